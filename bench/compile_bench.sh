@@ -0,0 +1,84 @@
+#!/bin/sh
+# Compiler throughput on generated programs: lexer tokens/sec, parser
+# statements/sec, code generation instructions/sec and the peak RSS of each
+# phase (bench/phases.c), at -O0 and -O2, for each workload profile at each
+# size. The programs come from bench/gen.c with a fixed seed, so a run is
+# comparable with bench/baseline.txt:
+#
+#     sh bench/compile_bench.sh > bench/baseline.txt     # new baseline
+#     sh bench/compile_bench.sh --compare                # against it
+#
+# The header names the compiler and, in a git checkout, the last commit that
+# changed parsercodegen.c, so a baseline says which code it measured.
+# --compare prints each rate as a ratio to the baseline and marks the ones
+# below 0.8 with "slower". SIZES overrides the program sizes (default
+# "1K 1M 16M"; gen accepts up to 1G, but beyond a few tens of megabytes the
+# code outgrows the 24-bit M field unless most of the source is comments;
+# see README.txt).
+#
+# Usage: sh bench/compile_bench.sh [--compare] [cc]
+
+set -e
+cd "$(dirname "$0")/.."
+COMPARE=
+if [ "$1" = --compare ]; then
+    COMPARE=1
+    shift
+fi
+CC=${1:-gcc}
+SIZES=${SIZES:-1K 1M 16M}
+TMP=${TMPDIR:-/tmp}/pl0-compile-bench.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+$CC -O2 bench/gen.c -o "$TMP/gen"
+$CC -O2 -pthread bench/phases.c -o "$TMP/phases"
+
+run() {
+    echo "# $($CC --version | head -n 1), $(uname -m)"
+    # The last commit that changed the compiler, when run in a git checkout
+    commit=$(git log -1 --format='%h %s' -- parsercodegen.c 2>/dev/null) &&
+        [ -n "$commit" ] && echo "# parsercodegen.c as of $commit"
+    printf '%-9s %-4s %-4s %10s %10s %10s %10s %8s %8s %8s\n' profile size opt bytes \
+        Mtokens/s Mstmts/s Minsns/s "lex MB" "parse MB" "gen MB"
+    for profile in flat expr nested commented; do
+        case $profile in
+            flat) options="--terms 2 --depth 0 --nest 0 --comments 0" ;;
+            expr) options="--terms 8 --depth 4" ;;
+            nested) options="--nest 6" ;;
+            commented) options="--comments 60" ;;
+        esac
+        for size in $SIZES; do
+            "$TMP/gen" --size $size $options > "$TMP/$profile.pl0"
+            for opt in -O0 -O2; do
+                # name bytes tokens stmts insns lex parse gen
+                set -- $("$TMP/phases" $opt "$TMP/$profile.pl0" | grep -v '^#')
+                printf '%-9s %-4s %-4s %10s %10s %10s %10s %8s %8s %8s\n' \
+                    $profile $size $opt "$2" "$3" "$4" "$5" "$6" "$7" "$8"
+            done
+        done
+    done
+}
+
+if [ -z "$COMPARE" ]; then
+    run
+    exit
+fi
+
+# Rates are columns 5-7; the key is profile, size and opt
+run > "$TMP/current"
+awk 'NR == FNR { if ($1 !~ /^#/ && $1 != "profile") base[$1 " " $2 " " $3] = $0; next }
+     $1 ~ /^#/ || $1 == "profile" { print; next }
+     {
+         key = $1 " " $2 " " $3
+         if (!(key in base)) { print $0 "  (no baseline)"; next }
+         split(base[key], b)
+         line = sprintf("%-9s %-4s %-4s %10s", $1, $2, $3, $4)
+         slower = ""
+         for (i = 5; i <= 7; i++) {
+             ratio = b[i] > 0 ? $i / b[i] : 0
+             line = line sprintf(" %9.2fx", ratio)
+             if (ratio < 0.8) slower = "  slower"
+         }
+         printf "%s %8s %8s %8s%s\n", line, $8, $9, $10, slower
+     }' bench/baseline.txt "$TMP/current"
@@ -0,0 +1,80 @@
+#!/bin/sh
+# Parser speed and stack use on deep and long expressions. Each program is
+# one assignment whose expression is
+#     paren   ((( ... 1 ... )))            DEPTH parentheses
+#     nest    1 - (1 - (1 - ... 1 ...))    DEPTH parentheses, a tree as deep
+#     long    1 + 2 * 3 - 4 + ...          DEPTH operands
+# compiled at -O0, at -O2 and for the register target with the C stack
+# limited to STACK_KB kilobytes (default 256), then run the same way. The
+# table gives the parse time from --stats-json (which includes the tree
+# passes, code generation and, in a one-shot compile, the page faults of
+# fresh memory) and whether the compile and run succeeded. DEPTHS
+# overrides the depths (default "1000 100000 1000000").
+#
+# Usage: sh bench/expr_bench.sh [cc]
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${1:-gcc}
+DEPTHS=${DEPTHS:-1000 100000 1000000}
+STACK_KB=${STACK_KB:-256}
+TMP=${TMPDIR:-/tmp}/pl0-expr-bench.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+$CC -O2 -pthread parsercodegen.c -o "$TMP/lex"
+
+printf '%-6s %8s %-6s %10s %10s %10s  %s\n' shape depth flags tokens "parse ms" Mtokens/s result
+for shape in paren nest long; do
+    for depth in $DEPTHS; do
+        awk -v d=$depth -v shape=$shape 'BEGIN {
+            printf "var x;\nbegin\n  x := "
+            if (shape == "paren") {
+                for (i = 0; i < d; i++) printf "("
+                printf "1"
+                for (i = 0; i < d; i++) printf ")"
+            } else if (shape == "nest") {
+                for (i = 0; i < d; i++) printf "1 - ("
+                printf "1"
+                for (i = 0; i < d; i++) printf ")"
+            } else {
+                printf "1"
+                for (i = 1; i < d; i++) printf " %s %d", substr("+-*", i % 3 + 1, 1), i % 9 + 1
+            }
+            printf ";\n  write x\nend.\n"
+        }' > "$TMP/$shape.pl0"
+
+        for name in O0 O2 reg; do
+            case $name in
+                O0) flags=-O0 ;;
+                O2) flags=-O2 ;;
+                reg) flags="--target register" ;;
+            esac
+            # Best of three parse times; the stack limit applies to the compiler only
+            result=ok
+            best=
+            for run in 1 2 3; do
+                if ! (ulimit -s $STACK_KB && exec "$TMP/lex" $flags --quiet --stats-json "$TMP/$shape.pl0") \
+                        >/dev/null 2>"$TMP/stats"; then
+                    result=crashed
+                    break
+                fi
+                parse=$(sed 's/.*"wall":{[^}]*"parse":\([0-9.]*\).*/\1/' "$TMP/stats")
+                best=$(echo "$parse $best" | awk '{ print ($2 == "" || $1 < $2) ? $1 : $2 }')
+            done
+            tokens=$(sed 's/.*"tokens":\([0-9]*\).*/\1/' "$TMP/stats")
+            if [ $result = ok ] && ! (ulimit -s $STACK_KB && exec "$TMP/lex" $flags --run "$TMP/$shape.pl0") \
+                    >/dev/null 2>&1; then
+                result="run failed"
+            fi
+            if [ $result = crashed ]; then
+                printf '%-6s %8s %-6s %10s %10s %10s  %s\n' $shape $depth $name - - - "$result"
+            else
+                echo "$shape $depth $name $tokens $best $result" | awk '{
+                    printf "%-6s %8s %-6s %10s %10.3f %10.2f  %s\n", $1, $2, $3, $4, $5 * 1e3,
+                           ($5 > 0 ? $4 / $5 / 1e6 : 0), substr($0, index($0, $6))
+                }'
+            fi
+        done
+    done
+done
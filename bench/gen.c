@@ -0,0 +1,213 @@
+// Workload generator for the compiler benchmarks: writes a random valid
+// PL/0 program to stdout. The programs are meant to be compiled, not run;
+// their loops need not terminate.
+//
+// Usage: gen [--size N[K|M|G]] [--vars N] [--consts N] [--terms N]
+//            [--depth N] [--nest N] [--comments PERCENT] [--seed N]
+//
+// --size     approximate length of the program (default 64K, up to 1G)
+// --vars     variables declared (default 16, at least 1)
+// --consts   constants declared (default 4)
+// --terms    most operands in one expression (default 4)
+// --depth    deepest parenthesis nesting in an expression (default 2)
+// --nest     deepest if/when nesting (default 3)
+// --comments percentage of statements preceded by a comment (default 10)
+// --seed     random seed (default 1)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    unsigned long long state;  // xorshift64
+    long long written;
+    int vars;
+    int consts;
+    int terms;
+    int depth;
+    int nest;
+    int comments;
+} Gen;
+
+unsigned next_random(Gen* g, unsigned n) {
+    g->state ^= g->state << 13;
+    g->state ^= g->state >> 7;
+    g->state ^= g->state << 17;
+    return (unsigned)(g->state >> 32) % n;
+}
+
+void put(Gen* g, const char* s) {
+    size_t n = strlen(s);
+    fwrite(s, 1, n, stdout);
+    g->written += (long long)n;
+}
+
+void put_number(Gen* g, const char* prefix, unsigned value) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%s%u", prefix, value);
+    fwrite(buf, 1, n, stdout);
+    g->written += n;
+}
+
+void indent(Gen* g, int level) {
+    for (int i = 0; i < level; i++) put(g, "  ");
+}
+
+void gen_operand(Gen* g, int depth);
+
+void gen_expression(Gen* g, int depth) {
+    static const char* const ops[] = {" + ", " - ", " * ", " / "};
+    int terms = 1 + (int)next_random(g, g->terms);
+    if (next_random(g, 8) == 0) put(g, "-");
+    for (int t = 0; t < terms; t++) {
+        if (t > 0) {
+            int op = (int)next_random(g, 4);
+            put(g, ops[op]);
+            if (op == 3) {  // never divide by zero
+                put_number(g, "", 1 + next_random(g, 99));
+                continue;
+            }
+        }
+        gen_operand(g, depth);
+    }
+}
+
+void gen_operand(Gen* g, int depth) {
+    unsigned r = next_random(g, 10);
+    if (depth > 0 && r < 2) {
+        put(g, "(");
+        gen_expression(g, depth - 1);
+        put(g, ")");
+    } else if (r < 6 || g->consts == 0) {
+        put_number(g, "v", next_random(g, g->vars));
+    } else if (r < 8) {
+        put_number(g, "c", next_random(g, g->consts));
+    } else {
+        put_number(g, "", next_random(g, 100000));
+    }
+}
+
+void gen_condition(Gen* g) {
+    static const char* const relations[] = {" = ", " <> ", " < ", " <= ", " > ", " >= "};
+    if (next_random(g, 8) == 0) {
+        put(g, "odd ");
+        gen_expression(g, g->depth);
+        return;
+    }
+    gen_expression(g, g->depth);
+    put(g, relations[next_random(g, 6)]);
+    gen_expression(g, g->depth);
+}
+
+void gen_comment(Gen* g, int level) {
+    static const char* const words[] = {
+        "update", "the", "running", "total", "check", "bound", "loop", "value", "next", "step"
+    };
+    indent(g, level);
+    put(g, "/*");
+    int count = 2 + (int)next_random(g, 8);
+    for (int i = 0; i < count; i++) {
+        put(g, " ");
+        put(g, words[next_random(g, 10)]);
+    }
+    put(g, " */\n");
+}
+
+void gen_statement(Gen* g, int nest, int level) {
+    if ((int)next_random(g, 100) < g->comments) gen_comment(g, level);
+    indent(g, level);
+    unsigned r = next_random(g, 100);
+    if (nest > 0 && r < 12) {
+        put(g, "if ");
+        gen_condition(g);
+        put(g, " then\n");
+        gen_statement(g, nest - 1, level + 1);
+        put(g, "\n");
+        indent(g, level);
+        put(g, "fi");
+    } else if (nest > 0 && r < 20) {
+        put(g, "when ");
+        gen_condition(g);
+        put(g, " do begin\n");
+        int count = 1 + (int)next_random(g, 4);
+        for (int i = 0; i < count; i++) {
+            gen_statement(g, nest - 1, level + 1);
+            put(g, i + 1 < count ? ";\n" : "\n");
+        }
+        indent(g, level);
+        put(g, "end");
+    } else if (r < 25) {
+        put(g, "write ");
+        gen_expression(g, g->depth);
+    } else {
+        put_number(g, "v", next_random(g, g->vars));
+        put(g, " := ");
+        gen_expression(g, g->depth);
+    }
+}
+
+// Parse N with an optional K, M or G suffix
+long long parse_size(const char* s) {
+    char* end;
+    long long n = strtoll(s, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    Gen g = {0};
+    long long size = 64 << 10;
+    g.vars = 16;
+    g.consts = 4;
+    g.terms = 4;
+    g.depth = 2;
+    g.nest = 3;
+    g.comments = 10;
+    unsigned long long seed = 1;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--size") == 0) size = parse_size(argv[i + 1]);
+        else if (strcmp(argv[i], "--vars") == 0) g.vars = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--consts") == 0) g.consts = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--terms") == 0) g.terms = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--depth") == 0) g.depth = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--nest") == 0) g.nest = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--comments") == 0) g.comments = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--seed") == 0) seed = strtoull(argv[i + 1], NULL, 10);
+        else {
+            fprintf(stderr, "gen: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (g.vars < 1 || g.consts < 0 || g.terms < 1 || g.depth < 0 || g.nest < 0 || size < 0) {
+        fprintf(stderr, "gen: option out of range\n");
+        return 1;
+    }
+    g.state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    static char buffer[1 << 16];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    if (g.consts > 0) {
+        put(&g, "const ");
+        for (int i = 0; i < g.consts; i++) {
+            put_number(&g, "c", i);
+            put_number(&g, " = ", next_random(&g, 100000));
+            put(&g, i + 1 < g.consts ? ", " : ";\n");
+        }
+    }
+    put(&g, "var ");
+    for (int i = 0; i < g.vars; i++) {
+        put_number(&g, "v", i);
+        put(&g, i + 1 < g.vars ? ", " : ";\n");
+    }
+    put(&g, "begin\n");
+    while (g.written < size - 16) {
+        gen_statement(&g, g.nest, 1);
+        put(&g, ";\n");
+    }
+    put(&g, "  write v0\nend.\n");
+    return fflush(stdout) != 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Differential check of the JIT against the interpreter: every program is
+# run with --run and with --jit at -O0, -O1 and -O2, and the output, the
+# exit status and the instruction count must match. Input for read comes
+# from the numbers in bench/check/input.txt.
+#
+# Usage: sh bench/jit_check.sh [programs...]
+# (default: bench/vm/*.pl0 and bench/check/*.pl0)
+
+cd "$(dirname "$0")/.."
+TMP=${TMPDIR:-/tmp}/pl0-jit-check.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+gcc -O2 -pthread parsercodegen.c -o "$TMP/lex" || exit 1
+
+[ $# -gt 0 ] || set -- bench/vm/*.pl0 bench/check/*.pl0
+runs=0
+failures=0
+for program in "$@"; do
+    for opt in -O0 -O1 -O2; do
+        for engine in run jit; do
+            "$TMP/lex" --$engine --vm-stats $opt "$program" <bench/check/input.txt \
+                >"$TMP/$engine.out" 2>"$TMP/$engine.stats"
+            echo "exit $?" >>"$TMP/$engine.out"
+            # keep the instruction count, drop the timing
+            cut -d' ' -f2 "$TMP/$engine.stats" >>"$TMP/$engine.out"
+        done
+        runs=$((runs + 1))
+        if ! cmp -s "$TMP/run.out" "$TMP/jit.out"; then
+            echo "MISMATCH $program $opt"
+            diff "$TMP/run.out" "$TMP/jit.out" | head -5
+            failures=$((failures + 1))
+        fi
+    done
+done
+echo "$runs runs, $failures mismatches"
+[ $failures -eq 0 ]
@@ -0,0 +1,33 @@
+// Check of the reserved word hash: every reserved word must map to its own
+// token type, and no other spelling may be taken for a keyword. Run it
+// after changing keyword_table or KEYWORD_HASH:
+//     cc -pthread bench/keyword_check.c -o keyword_check && ./keyword_check
+
+#define PL0_NO_MAIN
+#include "../parsercodegen.c"
+
+int main() {
+    int failures = 0;
+    int words = 0;
+    for (int type = oddsym; type <= procsym; type++) {
+        const char* spelling = token_spellings[type];
+        int len = strlen(spelling);
+        int isWord = len > 0 && isLetter(spelling[0]);
+        int found = isReservedWord(spelling, len);
+        if (found != (isWord ? type : 0)) {
+            printf("\"%s\" (token %d) is recognised as token %d\n", spelling, type, found);
+            failures++;
+        }
+        words += isWord;
+    }
+    int slots = 0;
+    for (int i = 0; i < KEYWORD_SLOTS; i++) {
+        if (keyword_table[i].word) slots++;
+    }
+    if (slots != words) {
+        printf("%d reserved words but %d keyword slots in use\n", words, slots);
+        failures++;
+    }
+    printf("%d reserved words, %s\n", words, failures ? "FAILED" : "ok");
+    return failures > 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Lexing throughput against threads, on one large program from bench/gen.c
+# (SIZE, default 256M, with comments before 30% of the statements). Each
+# row compiles it with --lex-threads N and gives the lex time from
+# --stats-json, the rate and the speedup over one thread. The rest of the
+# compile is single-threaded and not timed; at this size its code
+# outgrows the M field, which does not affect lexing. THREADS overrides
+# the thread counts (default "1 2 4 8").
+#
+# Usage: sh bench/lex_bench.sh [cc]
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${1:-gcc}
+SIZE=${SIZE:-256M}
+THREADS=${THREADS:-1 2 4 8}
+TMP=${TMPDIR:-/tmp}/pl0-lex-bench.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+$CC -O2 bench/gen.c -o "$TMP/gen"
+$CC -O2 -pthread parsercodegen.c -o "$TMP/lex"
+"$TMP/gen" --size $SIZE --comments 30 > "$TMP/big.pl0"
+
+echo "# $SIZE source, $(getconf _NPROCESSORS_ONLN 2>/dev/null || echo ?) cores"
+printf '%-8s %12s %10s %10s %8s\n' threads tokens "lex s" Mtokens/s speedup
+base=
+for threads in $THREADS; do
+    # The exit status is that of the compile, which fails on the code size
+    "$TMP/lex" --quiet --stats-json --lex-threads $threads "$TMP/big.pl0" \
+        >/dev/null 2>"$TMP/stats" || true
+    lex=$(sed 's/.*"wall":{[^}]*"lex":\([0-9.]*\).*/\1/' "$TMP/stats")
+    tokens=$(sed 's/.*"tokens":\([0-9]*\).*/\1/' "$TMP/stats")
+    [ -z "$base" ] && base=$lex
+    echo "$threads $tokens $lex $base" | awk '{
+        printf "%-8s %12s %10.3f %10.2f %7.2fx\n", $1, $2, $3,
+               ($3 > 0 ? $2 / $3 / 1e6 : 0), ($3 > 0 ? $4 / $3 : 0)
+    }'
+done
@@ -0,0 +1,107 @@
+// Lexer benchmark: lexes each file given on one thread with the scalar run
+// scanners and with each vector level the CPU has (SSE2, AVX2), and
+// reports tokens/sec, MB/sec and the speedup over scalar. Two more rows
+// compare ways of getting the token listing. "two passes" lexes the source
+// twice, which is what scanTokens() did when it echoed on a first scan and
+// filled the token list on a second. "pass+listing" lexes once and prints
+// the listing from the stored tokens, as the compiler does now. Its
+// speedup is over two passes. It builds the compiler in:
+//     cc -O2 -pthread bench/lex_simd.c -o lex_simd
+//
+// Usage: lex_simd files...
+//
+// Every time is the fastest of at least three runs, with more runs until
+// half a second has passed. The listing goes to /dev/null. The vector rows
+// must give the scalar token count, or the file is reported as a mismatch.
+
+#define PL0_NO_MAIN
+#include "../parsercodegen.c"
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Fastest time to lex the file passes times with the run scanners of
+// level, printing the listing after the last pass if list is set
+double time_lex(CompilerContext* ctx, const char* path, int level, int passes, int list) {
+    static Output out;
+    FILE* null = fopen("/dev/null", "w");
+    if (!null) {
+        perror("/dev/null");
+        exit(1);
+    }
+    out_init(&out, null);
+    double best = 0, total = 0;
+    int runs = 0;
+    do {
+        double seconds = 0;
+        for (int pass = 0; pass < passes; pass++) {
+            FILE* input = fopen(path, "r");
+            if (!input) {
+                perror(path);
+                exit(1);
+            }
+            compiler_reset(ctx);
+            load_source(ctx, input);
+            fclose(input);
+            ctx->simdLevel = level;
+            double start = now();
+            scanTokens(ctx);
+            if (list && pass == passes - 1) {
+                print_lexemes(&out, ctx, FORMAT_TEXT);
+                out_flush(&out);
+            }
+            seconds += now() - start;
+        }
+        if (best == 0 || seconds < best) best = seconds;
+        total += seconds;
+        runs++;
+    } while (runs < 3 || (total < 0.5 && runs < 1000));
+    fclose(null);
+    return best;
+}
+
+void print_row(const char* file, long bytes, const char* lexer, long tokens, double seconds, double base) {
+    printf("  %-22s %10ld %-13s %10.2f %10.1f %7.2fx\n", file, bytes, lexer,
+           tokens / seconds / 1e6, bytes / seconds / 1e6, base / seconds);
+}
+
+int main(int argc, char* argv[]) {
+    static const char* levels[] = {"scalar", "sse2", "avx2"};
+    int top = detect_simd_level();
+    int failures = 0;
+    printf("# %-22s %10s %-13s %10s %10s %8s\n", "file", "bytes", "lexer", "Mtokens/s", "MB/s", "speedup");
+    for (int i = 1; i < argc; i++) {
+        const char* name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+        CompilerContext* ctx = compiler_create();
+        compiler_set_lex_threads(ctx, 1);
+
+        double scalar = 0;
+        long tokens = 0;
+        long bytes = 0;
+        for (int level = SIMD_NONE; level <= top; level++) {
+            double seconds = time_lex(ctx, argv[i], level, 1, 0);
+            if (level == SIMD_NONE) {
+                scalar = seconds;
+                tokens = ctx->tokenCount;
+                bytes = ctx->sourceLength;
+            } else if (ctx->tokenCount != tokens) {
+                printf("  %-22s %s: %d tokens, scalar %ld\n", name, levels[level], ctx->tokenCount, tokens);
+                failures++;
+                continue;
+            }
+            print_row(name, bytes, levels[level], tokens, seconds, scalar);
+        }
+
+        double twice = time_lex(ctx, argv[i], top, 2, 0);
+        double listed = time_lex(ctx, argv[i], top, 1, 1);
+        print_row(name, bytes, "two passes", tokens, twice, twice);
+        print_row(name, bytes, "pass+listing", tokens, listed, twice);
+        compiler_destroy(ctx);
+        fflush(stdout);
+    }
+    return failures > 0;
+}
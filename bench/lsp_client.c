@@ -0,0 +1,466 @@
+// Scripted client for the language server (lex --server). It opens a
+// generated program of --lines lines and sends --edits edits of the kinds
+// typing produces: a statement typed in one key at a time, lines deleted,
+// numbers changed, a ; removed and put back, a comment opened and closed
+// again, a variable added to a declaration and removed. After each edit it
+// waits for the file's diagnostics and checks them against compile_buffer()
+// of its own copy of the text, then prints the latency of the edits next to
+// that of a full compile. It builds the compiler in, for the check:
+//     cc -O2 -pthread bench/lsp_client.c -o lsp_client
+//
+// Usage: lsp_client [--lines N] [--edits N] [--seed N] [server command...]
+//
+// The server command defaults to ./lex --server. The exit status is 1 if
+// any diagnostics differed.
+
+#define PL0_NO_MAIN
+#include "../parsercodegen.c"
+
+#include <sys/wait.h>
+
+#define URI "file:///bench.pl0"
+
+typedef struct {
+    FILE* to;            // server's stdin
+    FILE* from;          // server's stdout
+    pid_t pid;
+    char* text;          // the client's copy of the file
+    int length;
+    int capacity;
+    int version;
+    unsigned long long state;  // xorshift64
+    double* latency;     // seconds per edit
+    int edits;
+    int mismatches;
+    CompilerContext* ctx;
+    double compileSeconds;  // compile_buffer() time of the checks
+} Client;
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+unsigned next_random(Client* c, unsigned n) {
+    c->state ^= c->state << 13;
+    c->state ^= c->state >> 7;
+    c->state ^= c->state << 17;
+    return (unsigned)(c->state >> 32) % n;
+}
+
+void* must(void* p) {
+    if (!p) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+// Append to the client's text
+void put(Client* c, const char* s) {
+    int n = (int)strlen(s);
+    if (c->length + n + 1 > c->capacity) {
+        c->capacity = (c->length + n + 1) * 2;
+        c->text = must(realloc(c->text, c->capacity));
+    }
+    memcpy(c->text + c->length, s, n + 1);
+    c->length += n;
+}
+
+// A program of about lines lines: procedures with short bodies, then a
+// main body of assignments, calls, writes and nested if and when
+// statements, one statement per line
+void generate_program(Client* c, int lines) {
+    char line[160];
+    put(c, "const limit = 100;\nvar x, y, z, i;\n");
+    int procedures = lines / 200 + 1;
+    for (int p = 0; p < procedures; p++) {
+        sprintf(line, "procedure p%d;\n  var a, b;\n  begin\n    a := x + %d;\n", p, p % 1000);
+        put(c, line);
+        put(c, "    b := a * 2;\n    if a < b then y := y + b fi;\n    z := z + a\n  end;\n");
+    }
+    put(c, "begin\n  x := 0");
+    int written = 9 * procedures + 4;
+    char open[8];  // i for if ... then begin, w for when ... do begin
+    int depth = 0;
+    while (written < lines - depth - 1) {
+        int n = (int)next_random(c, 100);
+        char pad[16];
+        memset(pad, ' ', 2 + depth * 2);
+        pad[2 + depth * 2] = '\0';
+        if (n < 8 && depth < 6) {
+            sprintf(line, ";\n%s%s begin\n%s  x := x + 1", pad,
+                    n < 5 ? "if x < 500 then" : "when z > 100 do", pad);
+            open[depth++] = n < 5 ? 'i' : 'w';
+            written++;
+        } else if (n < 16 && depth > 0) {
+            depth--;
+            pad[2 + depth * 2] = '\0';
+            sprintf(line, "\n%send%s", pad, open[depth] == 'i' ? " fi" : "");
+        } else if (n < 26) {
+            sprintf(line, ";\n%scall p%u", pad, next_random(c, procedures));
+        } else if (n < 36) {
+            sprintf(line, ";\n%swrite x + y * %u", pad, next_random(c, 100));
+        } else {
+            sprintf(line, ";\n%s%c := %c + %u", pad, "xyz"[next_random(c, 3)], "xyzi"[next_random(c, 4)],
+                    next_random(c, 10000));
+        }
+        put(c, line);
+        written++;
+    }
+    while (depth > 0) {
+        depth--;
+        put(c, "\n");
+        for (int i = 0; i < 2 + depth * 2; i++) put(c, " ");
+        put(c, open[depth] == 'i' ? "end fi" : "end");
+    }
+    put(c, "\nend.\n");
+}
+
+// Start the server with its stdin and stdout on pipes
+void start_server(Client* c, char** command) {
+    int in[2], out[2];
+    if (pipe(in) != 0 || pipe(out) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    c->pid = fork();
+    if (c->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (c->pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    c->to = fdopen(in[1], "w");
+    c->from = fdopen(out[0], "r");
+    if (!c->to || !c->from) {
+        perror("fdopen");
+        exit(1);
+    }
+}
+
+void send_message(Client* c, const char* body, size_t length) {
+    fprintf(c->to, "Content-Length: %zu\r\n\r\n", length);
+    fwrite(body, 1, length, c->to);
+    fflush(c->to);
+}
+
+// Next message body from the server, NUL-terminated
+char* receive_message(Client* c) {
+    char line[256];
+    long length = -1;
+    for (;;) {
+        if (!fgets(line, sizeof(line), c->from)) {
+            printf("Error: the server closed its output\n");
+            exit(1);
+        }
+        if (strcmp(line, "\r\n") == 0 && length >= 0) break;
+        if (strncmp(line, "Content-Length:", 15) == 0) length = atol(line + 15);
+    }
+    char* body = must(malloc(length + 1));
+    if (fread(body, 1, length, c->from) != (size_t)length) {
+        printf("Error: the server closed its output\n");
+        exit(1);
+    }
+    body[length] = '\0';
+    return body;
+}
+
+// Body of a message built with Output
+typedef struct {
+    Output* out;
+    FILE* file;
+    char* body;
+    size_t length;
+} Message;
+
+void message_begin(Message* m) {
+    m->body = NULL;
+    m->file = must(open_memstream(&m->body, &m->length));
+    m->out = must(malloc(sizeof(Output)));
+    out_init(m->out, m->file);
+}
+
+void message_end(Message* m) {
+    out_flush(m->out);
+    fclose(m->file);
+    free(m->out);
+}
+
+// The publishDiagnostics body the server should send for the client's text,
+// from compile_buffer(): errors in the order the compiler found them, the
+// end of input at the end of the text
+char* expected_diagnostics(Client* c, size_t* length) {
+    CompileResult result;
+    double start = now();
+    compile_buffer(c->ctx, c->text, c->length, &result);
+    c->compileSeconds += now() - start;
+    int lastLine = 0, lastStart = 0;
+    for (int i = 0; i < c->length; i++) {
+        if (c->text[i] == '\n') {
+            lastLine++;
+            lastStart = i + 1;
+        }
+    }
+    Message m;
+    message_begin(&m);
+    out_str(m.out, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":\""
+            URI "\",\"diagnostics\":[");
+    int shown = 0;
+    for (int i = 0; i < result.errorCount; i++) {
+        const Error* e = &result.errors[i];
+        if (e->line < 0 && e->column == 0) continue;  // from code generation
+        int line = e->line >= 1 ? e->line - 1 : lastLine;
+        int character = e->line >= 1 ? e->column - 1 : c->length - lastStart;
+        out_str(m.out, shown++ ? ",{\"range\":{\"start\":{\"line\":" : "{\"range\":{\"start\":{\"line\":");
+        out_int(m.out, line, 0);
+        out_str(m.out, ",\"character\":");
+        out_int(m.out, character, 0);
+        out_str(m.out, "},\"end\":{\"line\":");
+        out_int(m.out, line, 0);
+        out_str(m.out, ",\"character\":");
+        out_int(m.out, character + 1, 0);
+        out_str(m.out, "}},\"severity\":1,\"source\":\"pl0\"");
+        if (e->code >= 0) {
+            out_str(m.out, ",\"code\":");
+            out_int(m.out, e->code, 0);
+        }
+        out_str(m.out, ",\"message\":");
+        out_json_string(m.out, e->message, (int)strlen(e->message));
+        out_char(m.out, '}');
+    }
+    out_str(m.out, "]}}");
+    message_end(&m);
+    *length = m.length;
+    return m.body;
+}
+
+// Wait for the diagnostics of the last change and check them
+void check_diagnostics(Client* c, double sent) {
+    char* body = receive_message(c);
+    if (c->edits >= 0) c->latency[c->edits] = now() - sent;
+    size_t length;
+    char* expected = expected_diagnostics(c, &length);
+    if (strlen(body) != length || memcmp(body, expected, length) != 0) {
+        if (c->mismatches++ < 3) {
+            printf("Edit %d: diagnostics differ\n  server:   %.300s\n  expected: %.300s\n", c->edits + 1,
+                   body, expected);
+        }
+    }
+    free(body);
+    free(expected);
+}
+
+// Offset of a 0-based line and character in the client's text
+int text_offset(Client* c, int line, int character) {
+    int i = 0;
+    for (int l = 0; l < line && i < c->length; i++) {
+        if (c->text[i] == '\n') l++;
+    }
+    return i + character;
+}
+
+// 0-based line and character of an offset
+void text_position(Client* c, int offset, int* line, int* character) {
+    int l = 0, start = 0;
+    for (int i = 0; i < offset; i++) {
+        if (c->text[i] == '\n') {
+            l++;
+            start = i + 1;
+        }
+    }
+    *line = l;
+    *character = offset - start;
+}
+
+// Replace the bytes [a, b) with text, here and in the server, and check
+// the diagnostics that come back
+void edit(Client* c, int a, int b, const char* text) {
+    int startLine, startCharacter, endLine, endCharacter;
+    text_position(c, a, &startLine, &startCharacter);
+    text_position(c, b, &endLine, &endCharacter);
+    int n = (int)strlen(text);
+    if (c->length + n + 1 > c->capacity) {
+        c->capacity = (c->length + n + 1) * 2;
+        c->text = must(realloc(c->text, c->capacity));
+    }
+    memmove(c->text + a + n, c->text + b, c->length - b + 1);
+    memcpy(c->text + a, text, n);
+    c->length += n - (b - a);
+
+    Message m;
+    message_begin(&m);
+    out_str(m.out, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":"
+            "{\"uri\":\"" URI "\",\"version\":");
+    out_int(m.out, ++c->version, 0);
+    out_str(m.out, "},\"contentChanges\":[{\"range\":{\"start\":{\"line\":");
+    out_int(m.out, startLine, 0);
+    out_str(m.out, ",\"character\":");
+    out_int(m.out, startCharacter, 0);
+    out_str(m.out, "},\"end\":{\"line\":");
+    out_int(m.out, endLine, 0);
+    out_str(m.out, ",\"character\":");
+    out_int(m.out, endCharacter, 0);
+    out_str(m.out, "}},\"text\":");
+    out_json_string(m.out, text, n);
+    out_str(m.out, "}]}}");
+    message_end(&m);
+    double sent = now();
+    send_message(c, m.body, m.length);
+    free(m.body);
+    check_diagnostics(c, sent);
+    c->edits++;
+}
+
+// Start of a random line of the main body, past the procedures
+int random_body_line(Client* c) {
+    const char* body = strstr(c->text, "\nbegin\n");
+    int first = body ? (int)(body - c->text) + 7 : 0;
+    int offset = first + (int)next_random(c, c->length - first);
+    while (offset > first && c->text[offset - 1] != '\n') offset--;
+    return offset;
+}
+
+// End of the line starting at offset, before its newline
+int line_end(Client* c, int offset) {
+    while (offset < c->length && c->text[offset] != '\n') offset++;
+    return offset;
+}
+
+// One scripted action: one edit or several
+void act(Client* c, int count) {
+    int kind = (int)next_random(c, 100);
+    int line = random_body_line(c);
+    int end = line_end(c, line);
+    if (kind < 40) {
+        // Type a statement in front of the line, a key at a time
+        const char* typed = "  y := y + 12;\n";
+        for (int i = 0; typed[i] && c->edits < count; i++) {
+            char key[2] = {typed[i], '\0'};
+            edit(c, line + i, line + i, key);
+        }
+    } else if (kind < 55) {
+        if (end < c->length && !strstr(c->text + line, "end.") ) edit(c, line, end + 1, "");
+    } else if (kind < 75) {
+        // Change a digit
+        for (int i = line; i < end; i++) {
+            if (isdigit((unsigned char)c->text[i])) {
+                char digit[2] = {(char)('1' + next_random(c, 9)), '\0'};
+                edit(c, i, i + 1, digit);
+                break;
+            }
+        }
+    } else if (kind < 85) {
+        // Drop the ; at the end of the line and put it back
+        if (end > line && c->text[end - 1] == ';') {
+            edit(c, end - 1, end, "");
+            if (c->edits < count) edit(c, end - 1, end - 1, ";");
+        }
+    } else if (kind < 92) {
+        // Start a comment, which runs to the end of the file, then remove it
+        edit(c, line, line, "/*");
+        if (c->edits < count) edit(c, line, line + 2, "");
+    } else {
+        // Declare one more variable, then remove it again
+        const char* decl = strstr(c->text, "var x, y, z, i");
+        if (decl) {
+            int at = (int)(decl - c->text) + 14;
+            edit(c, at, at, ", w");
+            if (c->edits < count) edit(c, at, at + 3, "");
+        }
+    }
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]) {
+    int lines = 100000;
+    int count = 1000;
+    unsigned long long seed = 1;
+    char* defaultCommand[] = {"./lex", "--server", NULL};
+    char** command = defaultCommand;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--lines") == 0 && i + 1 < argc) {
+            lines = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--edits") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            command = argv + i;
+            break;
+        }
+    }
+
+    Client c;
+    memset(&c, 0, sizeof(c));
+    c.state = seed * 2654435761u + 1;
+    c.latency = must(malloc(sizeof(double) * (count + 1)));
+    c.ctx = must(compiler_create());
+    generate_program(&c, lines);
+    signal(SIGPIPE, SIG_IGN);
+    start_server(&c, command);
+
+    const char* initialize = "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"initialize\",\"params\":"
+                             "{\"capabilities\":{}}}";
+    send_message(&c, initialize, strlen(initialize));
+    free(receive_message(&c));
+    const char* initialized = "{\"jsonrpc\":\"2.0\",\"method\":\"initialized\",\"params\":{}}";
+    send_message(&c, initialized, strlen(initialized));
+
+    Message m;
+    message_begin(&m);
+    out_str(m.out, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":"
+            "{\"uri\":\"" URI "\",\"languageId\":\"pl0\",\"version\":0,\"text\":");
+    out_json_string(m.out, c.text, c.length);
+    out_str(m.out, "}}}");
+    message_end(&m);
+    double sent = now();
+    send_message(&c, m.body, m.length);
+    free(m.body);
+    c.edits = -1;
+    check_diagnostics(&c, sent);
+    double openSeconds = now() - sent;
+    c.edits = 0;
+    c.compileSeconds = 0;
+
+    while (c.edits < count) act(&c, count);
+
+    const char* shutdown = "{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"shutdown\"}";
+    send_message(&c, shutdown, strlen(shutdown));
+    free(receive_message(&c));
+    const char* quit = "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}";
+    send_message(&c, quit, strlen(quit));
+    int status;
+    waitpid(c.pid, &status, 0);
+
+    qsort(c.latency, c.edits, sizeof(double), compare_double);
+    printf("%d lines, %d bytes: open %.1f ms, full compile %.2f ms on average\n", lines, c.length,
+           openSeconds * 1e3, c.edits ? c.compileSeconds / c.edits * 1e3 : 0.0);
+    if (c.edits > 0) {
+        printf("%d edits: median %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", c.edits,
+               c.latency[c.edits / 2] * 1e3, c.latency[c.edits * 9 / 10] * 1e3,
+               c.latency[c.edits * 99 / 100] * 1e3, c.latency[c.edits - 1] * 1e3);
+    }
+    printf("%d mismatches, server exit status %d\n", c.mismatches,
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    compiler_destroy(c.ctx);
+    free(c.latency);
+    free(c.text);
+    return c.mismatches > 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Checks of binary modules: every program written with -o must run under
+# --exec as it does under --run, and a module with one byte of a header
+# field or of the code changed must be refused with a checksum mismatch.
+# Input for read comes from the numbers in bench/check/input.txt.
+#
+# Usage: sh bench/module_check.sh [programs...]
+# (default: bench/vm/*.pl0 and bench/check/*.pl0)
+
+cd "$(dirname "$0")/.."
+TMP=${TMPDIR:-/tmp}/pl0-module-check.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+gcc -O2 -pthread parsercodegen.c -o "$TMP/lex" || exit 1
+
+# Flip the low bit of the byte at offset $2 of file $1
+flip() {
+    byte=$(od -An -tu1 -j"$2" -N1 "$1" | tr -d ' ')
+    printf "\\$(printf %o $((byte ^ 1)))" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+[ $# -gt 0 ] || set -- bench/vm/*.pl0 bench/check/*.pl0
+checks=0
+failures=0
+for program in "$@"; do
+    "$TMP/lex" --run "$program" -o "$TMP/m.pm0" <bench/check/input.txt >"$TMP/run.out"
+    echo "exit $?" >>"$TMP/run.out"
+    [ -f "$TMP/m.pm0" ] || continue
+    "$TMP/lex" --exec "$TMP/m.pm0" <bench/check/input.txt >"$TMP/exec.out"
+    echo "exit $?" >>"$TMP/exec.out"
+    checks=$((checks + 1))
+    if ! cmp -s "$TMP/run.out" "$TMP/exec.out"; then
+        echo "MISMATCH $program: --exec differs from --run"
+        failures=$((failures + 1))
+    fi
+
+    # code count, symbol count, string pool size, file size, first instruction
+    for offset in 16 24 32 36 40; do
+        cp "$TMP/m.pm0" "$TMP/bad.pm0"
+        flip "$TMP/bad.pm0" $offset
+        checks=$((checks + 1))
+        if ! "$TMP/lex" --exec "$TMP/bad.pm0" </dev/null 2>&1 | grep -q "checksum mismatch"; then
+            echo "ACCEPTED $program with byte $offset changed"
+            failures=$((failures + 1))
+        fi
+    done
+    rm -f "$TMP/m.pm0"
+done
+echo "$checks checks, $failures failures"
+[ $failures -eq 0 ]
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Cost of reaching variables of enclosing blocks. Each program nests
+# DEPTH procedures and runs a loop of ITERATIONS in the innermost one over
+# variables of the main block, DEPTH levels out (depth 0 runs the loop
+# in the main block itself; ITERATIONS is rounded to a multiple of
+# 10000, default 5000000). The table gives the instructions executed and
+# the best of three run times of the VM addressing outer frames through
+# its display and of one built with -DVM_STATIC_LINKS=1, which follows a
+# static link per level instead. DEPTHS overrides the depths (default
+# "0 1 2 4 7"; 7 is the deepest the L field allows).
+#
+# Usage: sh bench/nest_bench.sh [cc]
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${1:-gcc}
+DEPTHS=${DEPTHS:-0 1 2 4 7}
+ITERATIONS=${ITERATIONS:-5000000}
+TMP=${TMPDIR:-/tmp}/pl0-nest-bench.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+$CC -O2 -pthread parsercodegen.c -o "$TMP/display"
+$CC -O2 -pthread -DVM_STATIC_LINKS=1 parsercodegen.c -o "$TMP/links"
+
+# Best of three seconds of one VM on the program
+best_time() {
+    best=
+    for run in 1 2 3; do
+        "$1" --run --vm-stats "$TMP/nest.pl0" >/dev/null 2>"$TMP/stats"
+        # VM: <n> instructions in <s> s (<rate> million/sec)
+        set -- "$1" $(cat "$TMP/stats")
+        steps=$3
+        best=$(echo "$6 $best" | awk '{ print ($2 == "" || $1 < $2) ? $1 : $2 }')
+    done
+}
+
+printf '%-6s %14s %10s %10s %8s\n' depth instructions "display s" "links s" ratio
+for depth in $DEPTHS; do
+    awk -v d=$depth -v n=$ITERATIONS 'BEGIN {
+        printf "var i, j, s;\n"
+        pad = ""
+        for (k = 1; k <= d; k++) {
+            printf "%sprocedure p%d;\n", pad, k
+            pad = pad "  "
+        }
+        # Numbers have at most five digits: rounds of 10000 iterations
+        printf "%sbegin\n", pad
+        printf "%s  j := 0;\n", pad
+        printf "%s  when j < %d do begin\n", pad, (n < 10000 ? 1 : int(n / 10000))
+        printf "%s    i := 0;\n", pad
+        printf "%s    when i < 10000 do begin\n", pad
+        printf "%s      s := s + i;\n", pad
+        printf "%s      i := i + 1\n", pad
+        printf "%s    end;\n", pad
+        printf "%s    j := j + 1\n", pad
+        printf "%s  end\n", pad
+        printf "%send%s\n", pad, (d > 0 ? ";" : ".")
+        for (k = d; k >= 1; k--) {
+            pad = substr(pad, 3)
+            printf "%sbegin call p%d%s end%s\n", pad, k,
+                   (k == 1 ? "; write s" : ""), (k > 1 ? ";" : ".")
+        }
+    }' > "$TMP/nest.pl0"
+    best_time "$TMP/display"
+    display=$best
+    best_time "$TMP/links"
+    echo "$depth $steps $display $best" | awk '{
+        printf "%-6s %14s %10.3f %10.3f %7.2fx\n", $1, $2, $3, $4, ($3 > 0 ? $4 / $3 : 0)
+    }'
+done
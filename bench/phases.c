@@ -0,0 +1,172 @@
+// Phase benchmark: compiles each file given phase by phase and reports the
+// lexer's tokens/sec, the parser's statements/sec, code generation's
+// instructions/sec and the peak resident set of each phase. Code
+// generation includes the optimizer passes of the -O level, and its rate
+// is of the instructions the unoptimized program has. It builds the
+// compiler in, to reach the phases:
+//     cc -O2 -pthread bench/phases.c -o phases
+//
+// Usage: phases [-O0|-O1|-O2] [--target register] files...
+//
+// The first compile of a file measures peak RSS, with the kernel's
+// high-water mark reset before each phase where Linux allows it
+// (/proc/self/clear_refs; elsewhere it is the peak of the process so
+// far). The file is then compiled at least twice more and until the
+// phases have taken half a second, and the fastest time of each phase
+// counts, so the rates are for warm memory.
+
+#define PL0_NO_MAIN
+#include "../parsercodegen.c"
+
+#include <sys/resource.h>
+
+// Reset the peak RSS; returns 0 if the platform cannot
+int peak_reset() {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return 0;
+    int ok = fputs("5", f) >= 0;
+    return fclose(f) == 0 && ok;
+}
+
+// Peak RSS in KB since the last reset
+long peak_kb() {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f) {
+        char line[256];
+        long kb = -1;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+        }
+        fclose(f);
+        if (kb >= 0) return kb;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+long count_statements(const Node* n) {
+    long count = 0;
+    for (; n; n = n->next) {
+        switch (n->kind) {
+            case NODE_ASSIGN: case NODE_READ: case NODE_WRITE:
+            case NODE_BEGIN: case NODE_IF: case NODE_WHEN: case NODE_CALL:
+                count++;
+                break;
+        }
+        if (n->kind == NODE_BLOCK || n->kind == NODE_PROC || n->kind == NODE_BEGIN ||
+            n->kind == NODE_IF || n->kind == NODE_WHEN) {
+            count += count_statements(n->left) + count_statements(n->right);
+        }
+    }
+    return count;
+}
+
+typedef struct {
+    double seconds[3];  // lex, parse, generate
+    long peak[3];       // KB
+    long tokens;
+    long statements;
+    long instructions;
+} PhaseResult;
+
+// Compile the file once; returns 1 if it has errors
+int compile_phases(CompilerContext* ctx, const char* path, PhaseResult* r, int measurePeak) {
+    FILE* input = fopen(path, "r");
+    if (!input) {
+        perror(path);
+        exit(1);
+    }
+    compiler_reset(ctx);
+    load_source(ctx, input);
+    fclose(input);
+
+    if (measurePeak) peak_reset();
+    double t0 = now();
+    scanTokens(ctx);
+    double t1 = now();
+    if (measurePeak) r->peak[0] = peak_kb();
+    if (ctx->hasError) return 1;
+
+    if (measurePeak) peak_reset();
+    Node* tree = program(ctx);
+    double t2 = now();
+    if (measurePeak) r->peak[1] = peak_kb();
+    if (ctx->hasError) return 1;
+
+    r->statements = count_statements(tree);
+    if (measurePeak) peak_reset();
+    double t3 = now();
+    generate(ctx, tree);
+    double t4 = now();
+    if (measurePeak) r->peak[2] = peak_kb();
+    if (ctx->hasError) return 1;
+
+    double times[3] = {t1 - t0, t2 - t1, t4 - t3};
+    for (int i = 0; i < 3 && !measurePeak; i++) {
+        if (r->seconds[i] == 0 || times[i] < r->seconds[i]) r->seconds[i] = times[i];
+    }
+    r->tokens = ctx->tokenCount;
+    // Stack code is counted as generated, before the optimizer removed any
+    r->instructions = ctx->target == TARGET_REGISTER ? ctx->regLength : ctx->cx + ctx->codeSaved;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int optLevel = 0;
+    int target = TARGET_STACK;
+    int header = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-O", 2) == 0) {
+            optLevel = atoi(argv[i] + 2);
+            continue;
+        }
+        if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            target = strcmp(argv[++i], "register") == 0 ? TARGET_REGISTER : TARGET_STACK;
+            continue;
+        }
+        if (!header) {
+            printf("# %-22s %10s %12s %12s %12s %9s %9s %9s\n", "file", "bytes",
+                   "Mtokens/s", "Mstmts/s", "Minsns/s", "lex MB", "parse MB", "gen MB");
+            header = 1;
+        }
+
+        PhaseResult r;
+        memset(&r, 0, sizeof(r));
+        CompilerContext* ctx = compiler_create();
+        compiler_set_optimization(ctx, optLevel);
+        compiler_set_target(ctx, target);
+        double total = 0;
+        int runs = 0;
+        do {
+            double start = now();
+            if (compile_phases(ctx, argv[i], &r, runs == 0)) {
+                printf("%s: does not compile\n", argv[i]);
+                return 1;
+            }
+            if (runs > 0) total += now() - start;
+            runs++;
+        } while (runs < 3 || (total < 0.5 && runs < 1000));
+        long bytes = ctx->sourceLength;
+        compiler_destroy(ctx);
+
+        const char* name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+        printf("  %-22s %10ld %12.2f %12.2f %12.2f %9.1f %9.1f %9.1f\n", name, bytes,
+               r.tokens / r.seconds[0] / 1e6, r.statements / r.seconds[1] / 1e6,
+               r.instructions / r.seconds[2] / 1e6,
+               r.peak[0] / 1024.0, r.peak[1] / 1024.0, r.peak[2] / 1024.0);
+        fflush(stdout);
+    }
+    return 0;
+}
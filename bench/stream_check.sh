@@ -0,0 +1,42 @@
+#!/bin/sh
+# Check that a streamed compile (--stream) reports what a buffer compile
+# does. Every program is compiled both ways as is, and in three broken
+# versions:
+#   syntax   its first ":=" made ":= )"
+#   lexical  an invalid symbol after the closing period
+#   both     the two together, where the lexical error alone is reported
+# The listings (without the token listing, which streaming does not
+# print) and the exit statuses must match.
+#
+# Usage: sh bench/stream_check.sh [programs...]
+# (default: bench/vm/*.pl0 and bench/check/*.pl0)
+
+cd "$(dirname "$0")/.."
+TMP=${TMPDIR:-/tmp}/pl0-stream-check.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+gcc -O2 -pthread parsercodegen.c -o "$TMP/lex" || exit 1
+
+[ $# -gt 0 ] || set -- bench/vm/*.pl0 bench/check/*.pl0
+checks=0
+failures=0
+for program in "$@"; do
+    cp "$program" "$TMP/plain.pl0"
+    awk '!done && sub(/:=/, ":= )") { done = 1 } { print }' "$program" >"$TMP/syntax.pl0"
+    { cat "$program"; echo '@'; } >"$TMP/lexical.pl0"
+    { cat "$TMP/syntax.pl0"; echo '@'; } >"$TMP/both.pl0"
+    for version in plain syntax lexical both; do
+        "$TMP/lex" --emit tokens=none "$TMP/$version.pl0" >"$TMP/buffer.out"
+        echo "exit $?" >>"$TMP/buffer.out"
+        "$TMP/lex" --stream --emit tokens=none "$TMP/$version.pl0" >"$TMP/stream.out"
+        echo "exit $?" >>"$TMP/stream.out"
+        checks=$((checks + 1))
+        if ! cmp -s "$TMP/buffer.out" "$TMP/stream.out"; then
+            echo "MISMATCH $program ($version)"
+            diff "$TMP/buffer.out" "$TMP/stream.out" | head -5
+            failures=$((failures + 1))
+        fi
+    done
+done
+echo "$checks checks, $failures failures"
+[ $failures -eq 0 ]
@@ -0,0 +1,122 @@
+// Symbol lookup microbenchmark. For each symbol count given (default 100,
+// 1000, 10000 and 100000) it declares that many variables over LEVELS
+// nested blocks. The innermost block also redeclares every tenth name of
+// the outermost one, hiding the outer declaration. It then resolves the
+// same random sequence of uses two ways: with find_symbol() and with the
+// strcmp scan over symbol_table that find_symbol() replaced. It reports
+// nanoseconds per lookup for each and the ratio between them. The
+// scan makes fewer lookups on large tables, so a run stays short; the two
+// must agree on every symbol found. It builds the compiler in:
+//     cc -O2 -pthread bench/symbol_bench.c -o symbol_bench
+//
+// Usage: symbol_bench [symbols...]
+
+#define PL0_NO_MAIN
+#include "../parsercodegen.c"
+
+#define LEVELS 4            // blocks the symbols are declared over
+#define LOOKUPS 4000000     // uses resolved by find_symbol()
+#define SCAN_WORK 400000000 // at most this many symbols compared by the scan
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Name of symbol i, "v" and i in base 26, padded with zero bytes for
+// name_intern()
+void symbol_name(char* name, int i) {
+    int n = 0;
+    name[n++] = 'v';
+    do {
+        name[n++] = (char)('a' + i % 26);
+        i /= 26;
+    } while (i);
+    memset(name + n, 0, 16 - n);
+}
+
+// The lookup find_symbol() replaced: the innermost unmarked declaration
+// of name, by comparing it with every symbol from the last one back
+int scan_symbol(CompilerContext* ctx, const char* name) {
+    for (int i = ctx->sym_table_size - 1; i >= 0; i--) {
+        if (!ctx->symbol_table[i].mark && strcmp(ctx->symbol_table[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    static char* defaults[] = {"100", "1000", "10000", "100000"};
+    char** counts = argc > 1 ? argv + 1 : defaults;
+    int runs = argc > 1 ? argc - 1 : 4;
+    int failures = 0;
+    printf("# %10s %10s %12s %12s %12s %10s\n", "symbols", "lookups", "index ns", "scan lookups",
+           "scan ns", "speedup");
+    for (int r = 0; r < runs; r++) {
+        int count = atoi(counts[r]);
+        if (count < LEVELS * 10 || count > 10000000) {
+            fprintf(stderr, "symbol count %s: must be from %d to 10000000\n", counts[r], LEVELS * 10);
+            return 1;
+        }
+        CompilerContext* ctx = compiler_create();
+        char (*names)[16] = malloc(sizeof(*names) * count);
+        int* ids = malloc(sizeof(int) * count);
+        int* uses = malloc(sizeof(int) * LOOKUPS);
+        if (!ctx || !names || !ids || !uses) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        int symbols = 0;
+        for (int level = 0; level < LEVELS; level++) {
+            scope_enter(ctx);
+            for (int i = level * (count / LEVELS); i < (level + 1) * (count / LEVELS); i++) {
+                symbol_name(names[i], i);
+                ids[i] = name_intern(ctx->names, names[i], (int)strlen(names[i]));
+                add_symbol(ctx, 2, ids[i], 0, level, 3 + symbols++);
+            }
+        }
+        for (int i = 0; i < count / LEVELS; i += 10) {
+            add_symbol(ctx, 2, ids[i], 0, LEVELS - 1, 3 + symbols++);
+        }
+        count = count / LEVELS * LEVELS;  // the names declared
+
+        unsigned long long state = 88172645463325252ull;  // xorshift64
+        for (int k = 0; k < LOOKUPS; k++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            uses[k] = (int)((state >> 32) % (unsigned)count);
+        }
+
+        volatile long sink = 0;
+        double start = now();
+        long sum = 0;
+        for (int k = 0; k < LOOKUPS; k++) sum += find_symbol(ctx, ids[uses[k]]);
+        double index = (now() - start) / LOOKUPS;
+        sink += sum;
+
+        int scans = SCAN_WORK / symbols < LOOKUPS ? SCAN_WORK / symbols : LOOKUPS;
+        start = now();
+        sum = 0;
+        for (int k = 0; k < scans; k++) sum += scan_symbol(ctx, names[uses[k]]);
+        double scan = (now() - start) / scans;
+        sink += sum;
+
+        for (int k = 0; k < scans; k++) {
+            if (find_symbol(ctx, ids[uses[k]]) != scan_symbol(ctx, names[uses[k]])) {
+                printf("  %10d: find_symbol and the scan disagree on %s\n", symbols, names[uses[k]]);
+                failures++;
+                break;
+            }
+        }
+        printf("  %10d %10d %12.2f %12d %12.2f %9.0fx\n", symbols, LOOKUPS, index * 1e9, scans,
+               scan * 1e9, scan / index);
+        fflush(stdout);
+        free(uses);
+        free(ids);
+        free(names);
+        compiler_destroy(ctx);
+    }
+    return failures > 0;
+}
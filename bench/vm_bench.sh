@@ -0,0 +1,36 @@
+#!/bin/sh
+# VM throughput on the loop-heavy programs in bench/vm: instructions
+# executed and time of the threaded dispatch loop, of the plain switch
+# loop (-DVM_THREADED=0), of the x86-64 JIT (--jit) and of the register
+# bytecode interpreter (--target register), at -O0 and -O2.
+#
+# Usage: sh bench/vm_bench.sh [cc]
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${1:-gcc}
+TMP=${TMPDIR:-/tmp}/pl0-vm-bench.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+$CC -O2 -pthread parsercodegen.c -o "$TMP/lex"
+$CC -O2 -pthread -DVM_THREADED=0 parsercodegen.c -o "$TMP/lex-switch"
+
+printf '%-12s %-4s %-9s %14s %9s %12s\n' program opt engine instructions seconds "million/sec"
+for program in bench/vm/*.pl0; do
+    for opt in -O0 -O2; do
+        for engine in threaded switch jit register; do
+            case $engine in
+                threaded) set -- "$TMP/lex" --run ;;
+                switch) set -- "$TMP/lex-switch" --run ;;
+                jit) set -- "$TMP/lex" --jit ;;
+                register) set -- "$TMP/lex" --run --target register ;;
+            esac
+            "$@" --vm-stats $opt "$program" 2>"$TMP/stats" >/dev/null
+            # VM: <n> instructions in <s> s (<rate> million/sec)
+            set -- $(cat "$TMP/stats")
+            printf '%-12s %-4s %-9s %14s %9s %12s\n' \
+                "$(basename "$program" .pl0)" "$opt" "$engine" "$2" "$5" "${7#(}"
+        done
+    done
+done
@@ -3,17 +3,71 @@
 // Semester: Summer 2025
 // HW 3 - Tiny PL/0 Compiler (Parser and Code Generator)
 
+// POSIX and the GNU/BSD extensions used below (mmap with MAP_ANONYMOUS,
+// utimensat, st_mtim, pread, strdup, strncasecmp, open_memstream), so
+// the file also builds with -std=c11
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "parsercodegen.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEXER_SIMD 1
+#else
+#define LEXER_SIMD 0
+#endif
 
-#define MAX_ID_LEN 11
 #define MAX_NUM_LEN 5
-#define MAX_LINE_LEN 256
-#define MAX_SYMBOL_TABLE_SIZE 500
-#define MAX_TOKENS 10000
-#define CODE_SIZE 500
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define SOURCE_PADDING 64  // zero bytes after the source for vector loads
+#define STREAM_WINDOW (64 * 1024)  // initial window size when streaming
+#define LEXER_LOOKAHEAD 16  // bytes kept ahead of the scan position
+#define LEX_CHUNK_MIN (4 << 20)  // least source worth a lexing thread of its own
+
+// Vector fast paths used by the lexer, chosen at run time
+#define SIMD_AUTO -1
+#define SIMD_NONE 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+
+// Hooks filling CompileStats. They cost an increment or a clock read each;
+// building with -DPL0_STATS=0 turns them into nothing.
+#ifndef PL0_STATS
+#define PL0_STATS 1
+#endif
+
+#if PL0_STATS
+#define STATS_ADD(ctx, field, n) ((ctx)->stats.field += (n))
+#define STATS_ENTER(ctx) \
+    do { if (++(ctx)->depth > (ctx)->stats.maxDepth) (ctx)->stats.maxDepth = (ctx)->depth; } while (0)
+#define STATS_LEAVE(ctx) ((ctx)->depth--)
+#define STATS_START(clock) StatsClock clock; stats_clock(&clock)
+#define STATS_STOP(stats, clock, phase) stats_stop(&clock, (stats), (phase))
+#else
+#define STATS_ADD(ctx, field, n) ((void)0)
+#define STATS_ENTER(ctx) ((void)0)
+#define STATS_LEAVE(ctx) ((void)0)
+#define STATS_START(clock) ((void)0)
+#define STATS_STOP(stats, clock, phase) ((void)0)
+#endif
 
 // Token types
 typedef enum {
@@ -22,69 +76,299 @@ typedef enum {
     leqsym = 12, gtrsym = 13, geqsym = 14, lparentsym = 15, rparentsym = 16, 
     commasym = 17, semicolonsym = 18, periodsym = 19, becomessym = 20, 
     beginsym = 21, endsym = 22, ifsym = 23, thensym = 24, whensym = 25, 
-    dosym = 26, constsym = 27, varsym = 28, readsym = 29, writesym = 30
+    dosym = 26, constsym = 27, varsym = 28, readsym = 29, writesym = 30,
+    callsym = 31, procsym = 32
 } tokenType;
 
-// Token structure
+// View of the current token; lexeme is a slice of the source buffer
+// and is not NUL-terminated
 typedef struct {
     int type;
-    char lexeme[100];
+    const char* lexeme;
+    int length;
     int line;
     int column;
+    int name;       // name ID of an identifier, -1 for other tokens
 } Token;
 
-// Virtual machine instruction structure
+// Identifiers interned by the lexer. Every distinct spelling gets the next
+// dense name ID, so the parser compares and looks up names as integers.
+// The tables are malloc'd and kept across compiles, like the arena blocks.
 typedef struct {
-    int op;  // opcode
-    int L;   // lexicographical level
-    int M;   // modifier
-} instruction;
+    char text[MAX_ID_LEN + 1];  // padded with zeros
+    unsigned hash;
+} PooledName;
 
-// Symbol table structure
 typedef struct {
-    int kind;       // const = 1, var = 2
-    char name[11];  // name up to 11 chars
-    int val;        // number (ASCII value)
-    int level;      // L level (always 0 for this assignment)
-    int addr;       // M address
-    int mark;       // to indicate unavailable or deleted
-} symbol;
+    PooledName* names;  // by name ID
+    int count;
+    int capacity;
+    int* slots;         // open-addressing index of the IDs by hash, -1 when empty
+    int slotCount;      // power of two
+    long long probes;   // slots examined, for CompileStats
+} NamePool;
 
-// Global variables
-Token tokenList[MAX_TOKENS];
-int tokenCount = 0;
-int currentTokenIndex = 0;
-Token* currentToken = NULL;
+// Lexer state. In batch mode buf is the whole source; when streaming it is
+// a window over input that is refilled as the parser pulls tokens.
+// buf[end] is always followed by SOURCE_PADDING zero bytes.
+typedef struct {
+    char* buf;
+    int pos;        // next byte to scan
+    int end;        // bytes of input currently in buf
+    int capacity;   // bytes of input buf can hold
+    FILE* input;    // source of refills, NULL once exhausted
+    int line;
+    int lineStart;  // index in buf where the current line starts
+    int limit;      // no token starts at or after this index
+    int simdLevel;  // which run scanners to use
+    NamePool* names;       // identifiers are interned into it
+    CompilerContext* ctx;  // receives diagnostics and window growth
+} Lexer;
 
-symbol symbol_table[MAX_SYMBOL_TABLE_SIZE];
-int sym_table_size = 0;
-instruction code[CODE_SIZE];
-int cx = 0;  // code index
+// Bump allocator block; blocks are chained in allocation order
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
 
-// Error handling
+// Arena owning the source, tokens, symbols, code and diagnostics of a
+// compile. arena_reset() makes all blocks free again for the next compile;
+// arena_release() returns them to malloc.
 typedef struct {
-    int line;
-    int column;
-    char message[100];
-} Error;
-
-Error errors[100];
-int errorCount = 0;
-int hasError = 0;
-
-// Reserved words and symbols
-// const char *reservedWords[] = {
-//     "odd", "const", "var", "begin", "end", "if", "fi", "then", 
-//     "when", "do", "read", "write"
-// };
-
-// const int reservedTokens[] = {
-//     oddsym, constsym, varsym, beginsym, endsym, ifsym, fisym, thensym, 
-//     whensym, dosym, readsym, writesym
-// };
-
-const char symbols[] = {
-    '+', '-', '*', '/', '(', ')', '=', ',', '.', '<', '>', ';', ':'
+    ArenaBlock* first;
+    ArenaBlock* current;  // block allocations are taken from
+} Arena;
+
+// Syntax tree built by the parser. Expressions use left and right as
+// operands; statements of a begin ... end are chained through next. A
+// variable's op counts the levels out from the block using it to the block
+// declaring it, so 0 is the block's own frame.
+typedef enum {
+    NODE_LIT,     // value: the number
+    NODE_VAR,     // value: frame slot, op: levels out
+    NODE_NEG,     // op: OPR_NEG, left: operand
+    NODE_ODD,     // op: OPR_ODD, left: operand
+    NODE_BINARY,  // op: OPR_* code
+    NODE_ASSIGN,  // value: frame slot, op: levels out, left: expression
+    NODE_READ,    // value: frame slot, op: levels out
+    NODE_WRITE,   // left: expression
+    NODE_BEGIN,   // left: first statement, NULL if empty
+    NODE_IF,      // left: condition, right: body
+    NODE_WHEN,    // while loop; left: condition, right: body
+    NODE_BLOCK,   // value: frame size, op: level, aux: first symbol of its
+                  // scope, left: procedures, right: body
+    NODE_PROC,    // value: symbol, left: block; chained through next
+    NODE_CALL     // value: symbol of the procedure
+} NodeKind;
+
+typedef struct Node {
+    unsigned char kind;
+    unsigned char op;
+    int value;
+    int aux;  // scratch for the optimizer passes, but see NODE_BLOCK
+    struct Node* left;
+    struct Node* right;
+    struct Node* next;
+} Node;
+
+// Entry of the expression work stack: an operator waiting for its right
+// operand, or in the tree walks of code generation and the optimizer a
+// node to visit
+typedef struct {
+    Node* left;  // left operand of a binary operator; the node
+    int op;      // OPR_* code or EXPR_PAREN; whether the node's operands are done
+} ExprEntry;
+
+// Outline of a parse, recorded for incremental reparsing (see Document):
+// every statement() call in preorder, the syntax errors in the order they
+// were reported and the scope of every block body. Token indices equal to
+// the token count stand for the end of input.
+typedef struct {
+    int first;       // token the statement starts at
+    int end;         // token it returned at, the first one after it
+    int parent;      // enclosing statement, -1 for the body of a block
+    int depth;       // statements enclosing it
+    int block;       // index into blocks
+    int errorEnd;    // errors recorded by the time it returned
+    unsigned char panicIn;   // ctx->panicking on entry and on return
+    unsigned char panicOut;
+} OutlineSpan;
+
+typedef struct {
+    int token;
+    int code;        // index into error_messages
+} OutlineError;
+
+typedef struct {
+    int level;
+    int scopes;      // index in scopes of the first symbol of each level 0..level
+    int symbolEnd;   // symbols declared when its body starts
+} OutlineBlock;
+
+typedef struct {
+    OutlineSpan* spans;
+    int spanCount;
+    int spanCapacity;
+    OutlineError* errors;
+    int errorCount;
+    int errorCapacity;
+    OutlineBlock* blocks;
+    int blockCount;
+    int blockCapacity;
+    int* scopes;
+    int scopeCount;
+    int scopeCapacity;
+    int open;        // innermost statement being parsed, -1 if none
+    int block;       // block whose body is being parsed, -1 if none
+} Outline;
+
+// All state of one compile. Contexts share nothing, so separate threads may
+// compile with separate contexts; a context is reused across compiles and
+// keeps its arena blocks, so later compiles do not go back to malloc.
+struct CompilerContext {
+    Arena arena;
+
+    // Whole source program, loaded once and NUL-terminated
+    char* source;
+    int sourceLength;
+
+    // Token stream stored as parallel arrays; lexemes are slices of source
+    unsigned char* tokType;
+    int* tokOffset;
+    int* tokLength;
+    int* tokLine;
+    int* tokColumn;
+    int* tokName;     // name ID of each identifier, -1 for other tokens
+    int tokenCount;
+    int tokenCapacity;
+    int currentTokenIndex;
+    Token tokenView;
+    Token* currentToken;
+
+    // Pull tokens straight from the lexer instead of the token arrays
+    int streaming;
+    Lexer streamLexer;
+    int streamFailed;  // a lexical error ended the parse
+
+    // Identifier names; names is namePool unless a document lends its own
+    NamePool* names;
+    NamePool namePool;
+
+    symbol* symbol_table;
+    int sym_table_size;
+    int sym_table_capacity;
+
+    // visible[id] is the symbol_table index of the innermost visible
+    // declaration of name id, or -1; names from visibleCount on have none
+    int* visible;
+    int visibleCount;
+
+    // Lexical scopes: scope_start[l] is the first symbol declared at level l
+    int* scope_start;
+    int scope_capacity;
+    int current_level;
+
+    instruction* code;
+    int cx;  // code index
+    int code_capacity;
+
+    Error* errors;
+    int errorCount;
+    int errorCapacity;
+    int hasError;
+    int panicking;       // inside a syntax error, until the parser resynchronises
+
+    int simdLevel;       // lexer fast path, from detect_simd_level()
+    int lexThreads;      // from compiler_set_lex_threads()
+    int optPasses;       // PASS_* mask from compiler_set_optimization()
+    int codeSaved;       // instructions removed by the optimizer
+    PassStat passStats[8];
+    int passCount;
+    int target;          // TARGET_* from compiler_set_target()
+    int genLevel;        // level of the block gen_statement() is in
+
+    // Register code for TARGET_REGISTER
+    RegInstruction* regCode;
+    int regLength;
+    int regCapacity;
+    int* regConstants;
+    int regConstantCount;
+    int regConstantCapacity;
+    int regConstantBase;
+    int regFrame;        // first temporary
+    int regTemps;        // temporaries in use
+    int regMaxTemps;
+
+    // Work stack of expression() and gen_expression()
+    ExprEntry* exprStack;
+    int exprCapacity;
+
+    CompileStats stats;
+    int depth;           // current expression nesting, for stats.maxDepth
+
+    Outline* outline;    // the parser records into it when set
+};
+
+// Reserved words: a perfect hash on length and first letter. Every
+// reserved word owns its own slot, so recognising one costs a single
+// hash and at most one memcmp (checked by bench/keyword_check.c).
+#define MIN_KEYWORD_LEN 2
+#define MAX_KEYWORD_LEN 9
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(len, c0) (((len) + 4 * (unsigned char)(c0)) & (KEYWORD_SLOTS - 1))
+
+typedef struct {
+    const char* word;
+    int len;
+    int token;
+} keyword;
+
+const keyword keyword_table[KEYWORD_SLOTS] = {
+    [KEYWORD_HASH(3, 'o')] = {"odd", 3, oddsym},
+    [KEYWORD_HASH(5, 'c')] = {"const", 5, constsym},
+    [KEYWORD_HASH(3, 'v')] = {"var", 3, varsym},
+    [KEYWORD_HASH(5, 'b')] = {"begin", 5, beginsym},
+    [KEYWORD_HASH(3, 'e')] = {"end", 3, endsym},
+    [KEYWORD_HASH(2, 'i')] = {"if", 2, ifsym},
+    [KEYWORD_HASH(2, 'f')] = {"fi", 2, fisym},
+    [KEYWORD_HASH(4, 't')] = {"then", 4, thensym},
+    [KEYWORD_HASH(4, 'w')] = {"when", 4, whensym},
+    [KEYWORD_HASH(2, 'd')] = {"do", 2, dosym},
+    [KEYWORD_HASH(4, 'r')] = {"read", 4, readsym},
+    [KEYWORD_HASH(5, 'w')] = {"write", 5, writesym},
+    [KEYWORD_HASH(4, 'c')] = {"call", 4, callsym},
+    [KEYWORD_HASH(9, 'p')] = {"procedure", 9, procsym},
+};
+
+// Character classes driving the lexer (C locale, independent of setlocale)
+#define CC_BLANK   0x01  // space, tab, CR, VT, FF
+#define CC_NEWLINE 0x02
+#define CC_LETTER  0x04
+#define CC_DIGIT   0x08
+#define CC_SYMBOL  0x10
+#define CC_SPACE   (CC_BLANK | CC_NEWLINE)
+
+const unsigned char char_class[256] = {
+    [' '] = CC_BLANK, ['\t'] = CC_BLANK, ['\r'] = CC_BLANK,
+    ['\v'] = CC_BLANK, ['\f'] = CC_BLANK, ['\n'] = CC_NEWLINE,
+    ['a' ... 'z'] = CC_LETTER, ['A' ... 'Z'] = CC_LETTER,
+    ['0' ... '9'] = CC_DIGIT,
+    ['+'] = CC_SYMBOL, ['-'] = CC_SYMBOL, ['*'] = CC_SYMBOL, ['/'] = CC_SYMBOL,
+    ['('] = CC_SYMBOL, [')'] = CC_SYMBOL, ['='] = CC_SYMBOL, [','] = CC_SYMBOL,
+    ['.'] = CC_SYMBOL, ['<'] = CC_SYMBOL, ['>'] = CC_SYMBOL, [';'] = CC_SYMBOL,
+    [':'] = CC_SYMBOL
+};
+
+#define CHAR_CLASS(c) char_class[(unsigned char)(c)]
+
+// Source spelling of each token type, used by the lexeme echo
+const char* token_spellings[] = {
+    "", "odd", "", "", "+", "-", "*", "/", "fi", "=", "<>", "<",
+    "<=", ">", ">=", "(", ")", ",", ";", ".", ":=",
+    "begin", "end", "if", "then", "when", "do", "const", "var", "read", "write",
+    "call", "procedure"
 };
 
 const char* error_messages[] = {
@@ -108,757 +392,7303 @@ const char* error_messages[] = {
     "constants must be integers (no decimal points)",
     "invalid symbol",
     "identifier too long",
-    "number too long"
+    "number too long",
+    "procedure and call must be followed by identifier",
+    "procedure declarations must be followed by a semicolon",
+    "call must be followed by a procedure identifier",
+    "expressions must not contain procedure identifiers",
+    "procedures nested too deeply"
 };
 
 // Function prototypes
-void printSourceProgram(FILE *input);
-void scanTokens(FILE *input);
-int isReservedWord(char* id);
-void get_next_token();
-void error(int error_num);
-void emit(int op, int L, int M);
-int find_symbol(char* name);
-void program();
-void block();
-void const_declaration();
-int var_declaration();
-void statement();
-void condition();
-void expression();
-void term();
-void factor();
-void print_errors();
+void load_source(CompilerContext* ctx, FILE *input);
+void out_of_memory();
+void compiler_reset(CompilerContext* ctx);
+int compile_loaded(CompilerContext* ctx, CompileResult* result);
+void lexer_init(CompilerContext* ctx, Lexer* lx, char* buf, int length, FILE* input);
+int lex_next(Lexer* lx, Token* t);
+void scanTokens(CompilerContext* ctx);
+void start_streaming(CompilerContext* ctx, FILE* input);
+typedef struct Output Output;
+void print_lexemes(Output* out, CompilerContext* ctx, int format);
+void print_token_list(Output* out, CompilerContext* ctx);
+int isReservedWord(const char* id, int len);
+void get_next_token(CompilerContext* ctx);
+void error(CompilerContext* ctx, int error_num);
+void synchronize(CompilerContext* ctx);
+void accept_sync(CompilerContext* ctx);
+void emit(CompilerContext* ctx, int op, int L, int M);
+unsigned hash_name(const char* name, int len);
+int find_symbol(CompilerContext* ctx, int name);
+void scope_enter(CompilerContext* ctx);
+void scope_exit(CompilerContext* ctx);
+Node* new_node(CompilerContext* ctx, int kind, int op, int value, Node* left, Node* right);
+Node* program(CompilerContext* ctx);
+Node* block(CompilerContext* ctx);
+void const_declaration(CompilerContext* ctx);
+int var_declaration(CompilerContext* ctx);
+Node* procedure_declaration(CompilerContext* ctx);
+Node* statement(CompilerContext* ctx);
+Node* parse_statement(CompilerContext* ctx);
+Node* condition(CompilerContext* ctx);
+Node* expression(CompilerContext* ctx);
+Node* factor(CompilerContext* ctx);
+void peephole(CompilerContext* ctx);
+void generate(CompilerContext* ctx, Node* tree);
 
-// Helper functions
-void add_error(int line, int col, const char* msg) {
-    if (errorCount < 100) {
-        errors[errorCount].line = line;
-        errors[errorCount].column = col;
-        strncpy(errors[errorCount].message, msg, 99);
-        errorCount++;
-        hasError = 1;
+// Where a library call resumes if memory runs out on this thread, or
+// NULL. The library's entry points set it and report the failure in
+// their results; elsewhere running out of memory ends the process.
+_Thread_local jmp_buf* out_of_memory_jump;
+
+void out_of_memory() {
+    if (out_of_memory_jump) longjmp(*out_of_memory_jump, 1);
+    printf("Error: out of memory\n");
+    exit(1);
+}
+
+// Arena allocator
+void* arena_alloc(Arena* a, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock* b = a->current;
+    if (!b || b->size - b->used < size) {
+        // Reuse a block kept from an earlier compile if it is big enough
+        ArenaBlock* next = b ? b->next : a->first;
+        if (next && next->size >= size) {
+            b = next;
+        } else {
+            size_t blockSize = ARENA_BLOCK_SIZE;
+            if (b && b->size * 2 > blockSize) blockSize = b->size * 2;
+            if (blockSize < size) blockSize = size;
+            ArenaBlock* fresh = malloc(sizeof(ArenaBlock) + blockSize);
+            if (!fresh) {
+                out_of_memory();
+            }
+            fresh->size = blockSize;
+            fresh->next = next;
+            if (b) b->next = fresh;
+            else a->first = fresh;
+            b = fresh;
+        }
+        b->used = 0;
+        a->current = b;
     }
+    void* p = b->data + b->used;
+    b->used += size;
+    return p;
 }
 
-int isLetter(char c) {
-    return isalpha(c);
+// Resize an arena allocation. The newest allocation is extended in place
+// when its block has room; otherwise the data moves to a fresh allocation.
+void* arena_grow(Arena* a, void* old, size_t oldSize, size_t newSize) {
+    ArenaBlock* b = a->current;
+    size_t oldAligned = (oldSize + 7) & ~(size_t)7;
+    size_t newAligned = (newSize + 7) & ~(size_t)7;
+    if (old && b && (char*)old + oldAligned == b->data + b->used
+            && b->size - b->used >= newAligned - oldAligned) {
+        b->used += newAligned - oldAligned;
+        return old;
+    }
+    void* p = arena_alloc(a, newSize);
+    if (old) memcpy(p, old, oldSize);
+    return p;
 }
 
-int isNumber(char c) {
-    return isdigit(c);
+// Forget every allocation but keep the blocks for reuse
+void arena_reset(Arena* a) {
+    a->current = a->first;
+    if (a->first) a->first->used = 0;
 }
 
-int isASpecialSymbol(char input) {
-    for (int i = 0; i < 13; i++) {
-        if (input == symbols[i])
-            return 1;
+void arena_release(Arena* a) {
+    ArenaBlock* b = a->first;
+    while (b) {
+        ArenaBlock* next = b->next;
+        free(b);
+        b = next;
     }
-    return 0;
+    a->first = NULL;
+    a->current = NULL;
 }
 
-// void printSourceProgram(FILE *input) {
-//     char buffer[MAX_LINE_LEN];
-//     printf("Source Program:\n");
-//     rewind(input);
-//     while (fgets(buffer, sizeof(buffer), input)) {
-//         printf("%s", buffer);
-//     }
-//     rewind(input);
-// }
-
-int isReservedWord(char* id) {
-    if (strcmp(id, "odd") == 0) return oddsym;
-    if (strcmp(id, "const") == 0) return constsym;
-    if (strcmp(id, "var") == 0) return varsym;
-    if (strcmp(id, "begin") == 0) return beginsym;
-    if (strcmp(id, "end") == 0) return endsym;
-    if (strcmp(id, "if") == 0) return ifsym;
-    if (strcmp(id, "then") == 0) return thensym;
-    if (strcmp(id, "fi") == 0) return fisym;
-    if (strcmp(id, "when") == 0) return whensym;  // Changed from "while"/whilesym
-    if (strcmp(id, "do") == 0) return dosym;
-    if (strcmp(id, "read") == 0) return readsym;
-    if (strcmp(id, "write") == 0) return writesym;
-    return 0; // not a reserved word
+// Double the capacity of an arena-backed table holding count elements
+#define GROW_TABLE(table, capacity, initial) \
+    do { \
+        int newCapacity = (capacity) ? (capacity) * 2 : (initial); \
+        (table) = arena_grow(&ctx->arena, (table), sizeof(*(table)) * (capacity), \
+                             sizeof(*(table)) * newCapacity); \
+        (capacity) = newCapacity; \
+    } while (0)
+
+// Memory held by the arena's blocks
+size_t arena_size(const Arena* a) {
+    size_t size = 0;
+    for (const ArenaBlock* b = a->first; b; b = b->next) size += sizeof(ArenaBlock) + b->size;
+    return size;
 }
 
-void scanTokens(FILE *input) {
-    char buffer[MAX_LINE_LEN];
-    int lineNum = 1;
-
-    while (fgets(buffer, sizeof(buffer), input)) {
-        int i = 0;
-        int colNum = 1;
-        while (buffer[i] != '\0') {
-            char c = buffer[i];
-
-            // Skip whitespace
-            if (isspace(c)) { 
-                i++; 
-                colNum++;
-                continue; 
-            }
-
-            // Handle comments
-            if (buffer[i] == '/' && buffer[i + 1] == '*') {
-                int j = i + 2;
-                colNum += 2;
-                while (!(buffer[j] == '*' && buffer[j + 1] == '/')) {
-                    if (buffer[j] == '\0') {
-                        add_error(lineNum, colNum, "Unterminated comment");
-                        break;
-                    }
-                    j++;
-                    colNum++;
-                }
-                i = j + 2;
-                colNum += 2;
-                continue;
-            }
+// Bytes allocated since the last reset
+size_t arena_used(const Arena* a) {
+    size_t used = 0;
+    for (const ArenaBlock* b = a->first; b && a->current; b = b->next) {
+        used += b->used;
+        if (b == a->current) break;
+    }
+    return used;
+}
 
-            // Process identifiers and reserved words
-            if (isLetter(c)) {
-                int startCol = colNum;
-                char id[100];
-                int j = 0;
-                while (isLetter(buffer[i]) || isNumber(buffer[i])) {
-                    if (j < 99) id[j++] = buffer[i];
-                    i++;
-                    colNum++;
-                }
-                id[j] = '\0';
+// Grow a malloc'd table to hold count elements of size bytes
+void* reserve(void* table, int* capacity, int count, size_t size) {
+    if (count <= *capacity) return table;
+    int newCapacity = *capacity ? *capacity * 2 : 64;
+    if (newCapacity < count) newCapacity = count;
+    table = realloc(table, size * newCapacity);
+    if (!table) {
+        out_of_memory();
+    }
+    *capacity = newCapacity;
+    return table;
+}
 
-                if (strlen(id) > MAX_ID_LEN) {
-                    printf("%s\t\tError: Identifier too long\n", id);
-                    add_error(lineNum, startCol, "Identifier too long");
-                } else {
-                    int token = isReservedWord(id);
-                    if (token) {
-                        printf("%s\t\t%d\n", id, token);
-                    } else {
-                        printf("%s\t\t%d\n", id, identsym);
-                    }
-                }
-                continue;
-            }
+#define RESERVE(table, capacity, count) ((table) = reserve((table), &(capacity), (count), sizeof(*(table))))
 
-            // Process numbers
-            if (isNumber(c)) {
-                int startCol = colNum;
-                char num[100];
-                int j = 0;
-                while (isNumber(buffer[i])) {
-                    if (j < 99) num[j++] = buffer[i];
-                    i++;
-                    colNum++;
-                }
-                // Check for decimal point (invalid in PL/0)
-                if (buffer[i] == '.') {
-                    add_error(lineNum, colNum, "Decimal numbers not allowed");
-                    while (isNumber(buffer[i]) || buffer[i] == '.') {
-                        i++;
-                        colNum++;
-                    }
-                    continue;
-                }
-                num[j] = '\0';
-                if (strlen(num) > MAX_NUM_LEN) {
-                    printf("%s\t\tError: Number too long\n", num);
-                    add_error(lineNum, startCol, "Number too long");
-                } else {
-                    printf("%s\t\t%d\n", num, numbersym);
-                }
-                continue;
-            }
+#if PL0_STATS
+// Start of a timed phase
+typedef struct {
+    struct timespec wall;
+    struct timespec cpu;
+} StatsClock;
 
-            // Process special symbols
-            switch (c) {
-                case '+': printf("+\t\t%d\n", plussym); break;
-                case '-': printf("-\t\t%d\n", minussym); break;
-                case '*': printf("*\t\t%d\n", multsym); break;
-                case '/': printf("/\t\t%d\n", slashsym); break;
-                case '(': printf("(\t\t%d\n", lparentsym); break;
-                case ')': printf(")\t\t%d\n", rparentsym); break;
-                case '=': printf("=\t\t%d\n", eqlsym); break;
-                case ',': printf(",\t\t%d\n", commasym); break;
-                case '.': printf(".\t\t%d\n", periodsym); break;
-                case '<':
-                    if (buffer[i+1] == '=') { printf("<=\t\t%d\n", leqsym); i++; colNum++; }
-                    else if (buffer[i+1] == '>') { printf("<>\t\t%d\n", neqsym); i++; colNum++; }
-                    else { printf("<\t\t%d\n", lessym); }
-                    break;
-                case '>':
-                    if (buffer[i+1] == '=') { printf(">=\t\t%d\n", geqsym); i++; colNum++; }
-                    else { printf(">\t\t%d\n", gtrsym); }
-                    break;
-                case ';': printf(";\t\t%d\n", semicolonsym); break;
-                case ':':
-                    if (buffer[i+1] == '=') { printf(":=\t\t%d\n", becomessym); i++; colNum++; }
-                    else { printf(":\t\tError: invalid symbol\n"); add_error(lineNum, colNum, "Invalid symbol ':'"); }
-                    break;
-                default:
-                    printf("\t\tError: invalid symbol \"%c\"\n", c);
-                    add_error(lineNum, colNum, "Invalid symbol");
-                    break;
-            }
-            i++;
-            colNum++;
-        }
-        lineNum++;
-    }
+void stats_clock(StatsClock* c) {
+    clock_gettime(CLOCK_MONOTONIC, &c->wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c->cpu);
+}
 
-    if (!hasError) {
-        // Store tokens for parser
-        rewind(input);
-        lineNum = 1;
-        while (fgets(buffer, sizeof(buffer), input)) {
-            int i = 0;
-            int colNum = 1;
-            while (buffer[i] != '\0') {
-                char c = buffer[i];
+// Add the time since start to phase
+void stats_stop(const StatsClock* start, CompileStats* stats, int phase) {
+    StatsClock now;
+    stats_clock(&now);
+    stats->wall[phase] += (now.wall.tv_sec - start->wall.tv_sec) + (now.wall.tv_nsec - start->wall.tv_nsec) / 1e9;
+    stats->cpu[phase] += (now.cpu.tv_sec - start->cpu.tv_sec) + (now.cpu.tv_nsec - start->cpu.tv_nsec) / 1e9;
+}
+#endif
 
-                if (isspace(c)) {
-                    i++;
-                    colNum++;
-                    continue;
-                }
+// Helper functions
+void add_error(CompilerContext* ctx, int line, int col, const char* msg) {
+    if (ctx->errorCount == ctx->errorCapacity) {
+        GROW_TABLE(ctx->errors, ctx->errorCapacity, 16);
+    }
+    ctx->errors[ctx->errorCount].line = line;
+    ctx->errors[ctx->errorCount].column = col;
+    ctx->errors[ctx->errorCount].code = -1;
+    strncpy(ctx->errors[ctx->errorCount].message, msg, 99);
+    ctx->errors[ctx->errorCount].message[99] = '\0';
+    ctx->errorCount++;
+    ctx->hasError = 1;
+}
 
-                if (c == '/' && buffer[i+1] == '*') {
-                    i += 2;
-                    colNum += 2;
-                    while (!(buffer[i] == '*' && buffer[i+1] == '/')) {
-                        if (buffer[i] == '\0') break;
-                        i++;
-                        colNum++;
-                    }
-                    i += 2;
-                    colNum += 2;
-                    continue;
-                }
+int isLetter(char c) {
+    return CHAR_CLASS(c) & CC_LETTER;
+}
 
-                if (isLetter(c)) {
-                    char id[100];
-                    int j = 0;
-                    int startCol = colNum;
-                    while (isLetter(buffer[i]) || isNumber(buffer[i])) {
-                        if (j < 99) id[j++] = buffer[i];
-                        i++;
-                        colNum++;
-                    }
-                    id[j] = '\0';
-                    int token = isReservedWord(id);
-                    tokenList[tokenCount].type = token ? token : identsym;
-                    strcpy(tokenList[tokenCount].lexeme, token ? "" : id);
-                    tokenList[tokenCount].line = lineNum;
-                    tokenList[tokenCount].column = startCol;
-                    tokenCount++;
-                    continue;
-                }
+int isNumber(char c) {
+    return CHAR_CLASS(c) & CC_DIGIT;
+}
 
-                if (isNumber(c)) {
-                    char num[100];
-                    int j = 0;
-                    int startCol = colNum;
-                    while (isNumber(buffer[i])) {
-                        if (j < 99) num[j++] = buffer[i];
-                        i++;
-                        colNum++;
-                    }
-                    num[j] = '\0';
-                    tokenList[tokenCount].type = numbersym;
-                    strcpy(tokenList[tokenCount].lexeme, num);
-                    tokenList[tokenCount].line = lineNum;
-                    tokenList[tokenCount].column = startCol;
-                    tokenCount++;
-                    continue;
-                }
+// Run scanners: each returns the index of the first byte at or after i
+// that does not belong to the run. The source is followed by
+// SOURCE_PADDING zero bytes, so vector loads never leave the buffer and
+// the terminating NUL always ends a run.
+int blank_run_end_scalar(const char* buf, int i) {
+    while (CHAR_CLASS(buf[i]) & CC_BLANK) i++;
+    return i;
+}
 
-                int singleToken = 0;
-                switch (c) {
-                    case '+': singleToken = plussym; break;
-                    case '-': singleToken = minussym; break;
-                    case '*': singleToken = multsym; break;
-                    case '/': singleToken = slashsym; break;
-                    case '(': singleToken = lparentsym; break;
-                    case ')': singleToken = rparentsym; break;
-                    case '=': singleToken = eqlsym; break;
-                    case ',': singleToken = commasym; break;
-                    case '.': singleToken = periodsym; break;
-                    case '<':
-                        if (buffer[i+1] == '=') { singleToken = leqsym; i++; colNum++; }
-                        else if (buffer[i+1] == '>') { singleToken = neqsym; i++; colNum++; }
-                        else { singleToken = lessym; }
-                        break;
-                    case '>':
-                        if (buffer[i+1] == '=') { singleToken = geqsym; i++; colNum++; }
-                        else { singleToken = gtrsym; }
-                        break;
-                    case ';': singleToken = semicolonsym; break;
-                    case ':':
-                        if (buffer[i+1] == '=') { singleToken = becomessym; i++; colNum++; }
-                        break;
-                }
-                if (singleToken > 0) {
-                    tokenList[tokenCount].type = singleToken;
-                    tokenList[tokenCount].lexeme[0] = '\0';
-                    tokenList[tokenCount].line = lineNum;
-                    tokenList[tokenCount].column = colNum;
-                    tokenCount++;
-                }
-                i++;
-                colNum++;
-            }
-            lineNum++;
-        }
+int word_run_end_scalar(const char* buf, int i) {
+    while (CHAR_CLASS(buf[i]) & (CC_LETTER | CC_DIGIT)) i++;
+    return i;
+}
+
+int digit_run_end_scalar(const char* buf, int i) {
+    while (CHAR_CLASS(buf[i]) & CC_DIGIT) i++;
+    return i;
+}
 
-        // Print token list
-        printf("\nToken List:\n");
-        for (int i = 0; i < tokenCount; i++) {
-            if (tokenList[i].type == identsym || tokenList[i].type == numbersym)
-                printf("%d %s ", tokenList[i].type, tokenList[i].lexeme);
-            else
-                printf("%d ", tokenList[i].type);
+// Index of the "*/" closing a comment body starting at i, or of the NUL
+// if there is none; newlines crossed are added to *line / *lineStart
+int comment_end_scalar(const char* buf, int i, int* line, int* lineStart) {
+    while (buf[i] != '\0' && !(buf[i] == '*' && buf[i + 1] == '/')) {
+        if (buf[i] == '\n') {
+            (*line)++;
+            *lineStart = i + 1;
         }
-        printf("\n");
+        i++;
     }
+    return i;
 }
 
-void get_next_token() {
-    if (currentTokenIndex < tokenCount) {
-        currentToken = &tokenList[currentTokenIndex++];
-    } else {
-        // End of tokens, treat as period
-        static Token endToken = {periodsym, "", -1, -1};
-        currentToken = &endToken;
+#if LEXER_SIMD
+// Byte-wise unsigned range test lo <= v < lo + n, on signed SSE2 compares
+#define SSE2_IN_RANGE(v, lo, n) \
+    _mm_cmplt_epi8(_mm_xor_si128(_mm_sub_epi8((v), _mm_set1_epi8(lo)), _mm_set1_epi8((char)0x80)), \
+                   _mm_set1_epi8((char)(0x80 + (n))))
+#define AVX2_IN_RANGE(v, lo, n) \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + (n))), \
+                      _mm256_xor_si256(_mm256_sub_epi8((v), _mm256_set1_epi8(lo)), _mm256_set1_epi8((char)0x80)))
+
+__attribute__((target("sse2")))
+int blank_run_end_sse2(const char* buf, int i) {
+    for (;; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                     SSE2_IN_RANGE(v, '\t', 1));
+        blank = _mm_or_si128(blank, SSE2_IN_RANGE(v, '\v', 3));  // VT, FF, CR
+        unsigned stop = ~_mm_movemask_epi8(blank) & 0xFFFF;
+        if (stop) return i + __builtin_ctz(stop);
     }
 }
 
-void error(int error_num) {
-    if (error_num >= 0 && error_num < sizeof(error_messages)/sizeof(error_messages[0])) {
-        if (currentToken->line != -1) {
-            printf("Error (Line %d, Column %d): %s\n", 
-                   currentToken->line, currentToken->column, error_messages[error_num]);
-        } else {
-            printf("Error: %s\n", error_messages[error_num]);
-        }
-    } else {
-        printf("Unknown error\n");
+__attribute__((target("sse2")))
+int word_run_end_sse2(const char* buf, int i) {
+    for (;; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i word = _mm_or_si128(SSE2_IN_RANGE(lower, 'a', 26), SSE2_IN_RANGE(v, '0', 10));
+        unsigned stop = ~_mm_movemask_epi8(word) & 0xFFFF;
+        if (stop) return i + __builtin_ctz(stop);
     }
-    exit(1);
 }
 
-void emit(int op, int L, int M) {
-    if (cx >= CODE_SIZE) {
-        error("Program too long");
+__attribute__((target("sse2")))
+int digit_run_end_sse2(const char* buf, int i) {
+    for (;; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        unsigned stop = ~_mm_movemask_epi8(SSE2_IN_RANGE(v, '0', 10)) & 0xFFFF;
+        if (stop) return i + __builtin_ctz(stop);
     }
-    code[cx].op = op;
-    code[cx].L = L;
-    code[cx].M = M;
-    cx++;
 }
 
-// symbolTable Check
-int find_symbol(char* name) {
-    for (int i = 0; i < sym_table_size; i++) {
-        if (strcmp(symbol_table[i].name, name) == 0) {
-            return i;
+__attribute__((target("sse2")))
+int comment_end_sse2(const char* buf, int i, int* line, int* lineStart) {
+    for (;; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i next = _mm_loadu_si128((const __m128i*)(buf + i + 1));
+        __m128i close = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')),
+                                      _mm_cmpeq_epi8(next, _mm_set1_epi8('/')));
+        unsigned stop = _mm_movemask_epi8(_mm_or_si128(close, _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+        unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (stop) newlines &= (1u << __builtin_ctz(stop)) - 1;
+        if (newlines) {
+            *line += __builtin_popcount(newlines);
+            *lineStart = i + (31 - __builtin_clz(newlines)) + 1;
         }
+        if (stop) return i + __builtin_ctz(stop);
     }
-    return -1;
 }
 
-void program() {
-    // First instruction should be JMP to skip variable allocation
-    emit(JMP, 0, 13);
-    
-    get_next_token();
-    block();
-    if (currentToken->type != periodsym) {
-        error(0); // program must end with period
-    }
-    
-    // Mark all symbols at program end
-    for (int i = 0; i < sym_table_size; i++) {
-        symbol_table[i].mark = 1;
+__attribute__((target("avx2")))
+int blank_run_end_avx2(const char* buf, int i) {
+    for (;; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                        AVX2_IN_RANGE(v, '\t', 1));
+        blank = _mm256_or_si256(blank, AVX2_IN_RANGE(v, '\v', 3));
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(blank);
+        if (stop) return i + __builtin_ctz(stop);
     }
-    
-    emit(SYS, 0, 3); // HALT instruction
 }
 
-void block() {
-    const_declaration();
-    int num_vars = var_declaration();
-    emit(INC, 0, 3 + num_vars); // Allocate space for variables
-    
-    statement();
+__attribute__((target("avx2")))
+int word_run_end_avx2(const char* buf, int i) {
+    for (;; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i word = _mm256_or_si256(AVX2_IN_RANGE(lower, 'a', 26), AVX2_IN_RANGE(v, '0', 10));
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(word);
+        if (stop) return i + __builtin_ctz(stop);
+    }
 }
 
-void const_declaration() {
-    if (currentToken->type == constsym) {
-        do {
-            get_next_token();
-            if (currentToken->type != identsym) {
-                error(1); // const must be followed by identifier
-            }
-            
-            char name[MAX_ID_LEN + 1];
-            strcpy(name, currentToken->lexeme);
-            
-            if (find_symbol(name) != -1) {
-                error(2); // symbol already declared
-            }
-            
-            get_next_token();
-            if (currentToken->type != eqlsym) {
-                error(3); // constants must be assigned with =
-            }
-            
-            get_next_token();
-            if (currentToken->type != numbersym) {
-                error(4); // constants must be assigned an integer value
-            }
-            
-            // Additional check for decimal points
-            if (strchr(currentToken->lexeme, '.') != NULL) {
-                error(17); // constants must be integers
-            }
-            
-            // Add to symbol table
-            symbol_table[sym_table_size].kind = 1;
-            strcpy(symbol_table[sym_table_size].name, name);
-            symbol_table[sym_table_size].val = atoi(currentToken->lexeme);
-            symbol_table[sym_table_size].level = 0;
-            symbol_table[sym_table_size].addr = 0;
-            symbol_table[sym_table_size].mark = 0;
-            sym_table_size++;
-            
-            get_next_token();
-        } while (currentToken->type == commasym);
-        
-        if (currentToken->type != semicolonsym) {
-            error(5); // const declaration must end with semicolon
-        }
-        get_next_token();
+__attribute__((target("avx2")))
+int digit_run_end_avx2(const char* buf, int i) {
+    for (;; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(AVX2_IN_RANGE(v, '0', 10));
+        if (stop) return i + __builtin_ctz(stop);
     }
 }
 
-int var_declaration() {
-    int num_vars = 0;
-    if (currentToken->type == varsym) {
-        do {
-            num_vars++;
-            get_next_token();
-            if (currentToken->type != identsym) {
-                error(1); // var must be followed by identifier
-            }
-            
-            char name[MAX_ID_LEN + 1];
-            strcpy(name, currentToken->lexeme);
-            
-            if (find_symbol(name) != -1) {
-                error(2); // symbol already declared
-            }
-            
-            // Add to symbol table
-            symbol_table[sym_table_size].kind = 2;
-            strcpy(symbol_table[sym_table_size].name, name);
-            symbol_table[sym_table_size].val = 0;
-            symbol_table[sym_table_size].level = 0;
-            symbol_table[sym_table_size].addr = num_vars + 2; // First var at address 3
-            symbol_table[sym_table_size].mark = 0;
-            sym_table_size++;
-            
-            get_next_token();
-        } while (currentToken->type == commasym);
-        
-        if (currentToken->type != semicolonsym) {
-            error(5); // var declaration must end with semicolon
+__attribute__((target("avx2")))
+int comment_end_avx2(const char* buf, int i, int* line, int* lineStart) {
+    for (;; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i next = _mm256_loadu_si256((const __m256i*)(buf + i + 1));
+        __m256i close = _mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')),
+                                         _mm256_cmpeq_epi8(next, _mm256_set1_epi8('/')));
+        unsigned stop = _mm256_movemask_epi8(_mm256_or_si256(close, _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+        unsigned newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (stop) newlines &= (unsigned)((1ull << __builtin_ctz(stop)) - 1);
+        if (newlines) {
+            *line += __builtin_popcount(newlines);
+            *lineStart = i + (31 - __builtin_clz(newlines)) + 1;
         }
-        get_next_token();
+        if (stop) return i + __builtin_ctz(stop);
     }
-    return num_vars;
 }
+#endif
 
-void statement() {
-    if (currentToken->type == identsym) {
-        // Assignment statement
-        char name[MAX_ID_LEN + 1];
-        strcpy(name, currentToken->lexeme);
-        int sym_idx = find_symbol(name);
-        
-        if (sym_idx == -1) {
-            error(6); // undeclared identifier
-        }
-        if (symbol_table[sym_idx].kind != 2) {
-            error(7); // only variables can be assigned to
-        }
-        
-        get_next_token();
-        if (currentToken->type != becomessym) {
-            error(8); // assignment must use :=
-        }
-        
-        get_next_token();
-        expression();
-        emit(STO, 0, symbol_table[sym_idx].addr);
-    }
-    else if (currentToken->type == beginsym) {
-        // Compound statement
-        get_next_token();
-        statement();
-        
-        while (currentToken->type == semicolonsym) {
-            get_next_token();
-            // Check if this is an empty statement before end
-            if (currentToken->type != endsym) {
-                statement();
-            }
-        }
-        
-        if (currentToken->type != endsym) {
-            error(9); // begin must be followed by end
-        }
-        get_next_token();
-    }
-    else if (currentToken->type == ifsym) {
-        // If statement
-        get_next_token();
-        condition();
-        
-        if (currentToken->type != thensym) {
-            error(10); // if must be followed by then
-        }
-        
-        int jpc_idx = cx;
-        emit(JPC, 0, 0); // Placeholder address
-        
-        get_next_token();
-        statement();
-        
-        if (currentToken->type != fisym) {
-            error(15); // then must be followed by fi
-        }
-        get_next_token();
-        
-        code[jpc_idx].M = cx; // Update jump address
-    }
-    else if (currentToken->type == whensym) {
-        // When (while) statement
-        int loop_idx = cx;
-        get_next_token();
-        condition();
-        
-        if (currentToken->type != dosym) {
-            error(11); // when must be followed by do
-        }
-        
-        int jpc_idx = cx;
-        emit(JPC, 0, 0); // Placeholder address
-        
-        get_next_token();
-        statement();
-        
-        emit(JMP, 0, loop_idx);
-        code[jpc_idx].M = cx; // Update jump address
-    }
-    else if (currentToken->type == readsym) {
-        // Read statement
-        get_next_token();
-        if (currentToken->type != identsym) {
-            error(1); // read must be followed by identifier
-        }
-        
-        int sym_idx = find_symbol(currentToken->lexeme);
-        if (sym_idx == -1) {
-            error(6); // undeclared identifier
-        }
-        if (symbol_table[sym_idx].kind != 2) {
-            error(7); // only variables can be read into
-        }
-        
-        emit(SYS, 0, 1); // READ
-        emit(STO, 0, symbol_table[sym_idx].addr);
-        
-        get_next_token();
-    }
-    else if (currentToken->type == writesym) {
-        // Write statement
-        get_next_token();
-        expression();
-        emit(SYS, 0, 2); // WRITE
-    }
-    // Empty statement is allowed
+// Pick the widest vector fast path the CPU supports
+int detect_simd_level() {
+#if LEXER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_NONE;
 }
 
-void condition() {
-    if (currentToken->type == oddsym) {
-        get_next_token();
-        expression();
-        emit(OPR, 0, 11); // ODD operation (mod 2)
+#if LEXER_SIMD
+#define LEXER_RUN(level, name, ...) \
+    ((level) == SIMD_AVX2 ? name##_avx2(__VA_ARGS__) : \
+     (level) == SIMD_SSE2 ? name##_sse2(__VA_ARGS__) : name##_scalar(__VA_ARGS__))
+#else
+#define LEXER_RUN(level, name, ...) name##_scalar(__VA_ARGS__)
+#endif
+
+// Most runs are a few bytes long, where a vector load costs more than it
+// saves, so the first SCALAR_PREFIX bytes of a run are checked one by one
+#define SCALAR_PREFIX 8
+
+int blank_run_end(int level, const char* buf, int i) {
+    for (int k = 0; k < SCALAR_PREFIX; k++, i++) {
+        if (!(CHAR_CLASS(buf[i]) & CC_BLANK)) return i;
     }
-    else {
-        expression();
-        if (currentToken->type == eqlsym || currentToken->type == neqsym || 
-            currentToken->type == lessym || currentToken->type == leqsym || 
-            currentToken->type == gtrsym || currentToken->type == geqsym) {
-            
-            int relop = currentToken->type;
-            get_next_token();
-            expression();
-            
-            switch (relop) {
-                case eqlsym: emit(OPR, 0, 8); break;  // EQL
-                case neqsym: emit(OPR, 0, 9); break;   // NEQ
-                case lessym: emit(OPR, 0, 10); break;  // LSS
-                case leqsym: emit(OPR, 0, 11); break;  // LEQ
-                case gtrsym: emit(OPR, 0, 12); break;  // GTR
-                case geqsym: emit(OPR, 0, 13); break;  // GEQ
-            }
-        }
-        else {
-            error(12); // condition must contain comparison operator
-        }
+    return LEXER_RUN(level, blank_run_end, buf, i);
+}
+
+int word_run_end(int level, const char* buf, int i) {
+    for (int k = 0; k < SCALAR_PREFIX; k++, i++) {
+        if (!(CHAR_CLASS(buf[i]) & (CC_LETTER | CC_DIGIT))) return i;
     }
+    return LEXER_RUN(level, word_run_end, buf, i);
 }
 
-void expression() {
-    if (currentToken->type == plussym || currentToken->type == minussym) {
-        int addop = currentToken->type;
-        get_next_token();
-        term();
-        
-        if (addop == minussym) {
-            emit(OPR, 0, 1); // NEG
-        }
+int digit_run_end(int level, const char* buf, int i) {
+    for (int k = 0; k < SCALAR_PREFIX; k++, i++) {
+        if (!(CHAR_CLASS(buf[i]) & CC_DIGIT)) return i;
     }
-    else {
-        term();
+    return LEXER_RUN(level, digit_run_end, buf, i);
+}
+
+int isReservedWord(const char* id, int len) {
+    if (len < MIN_KEYWORD_LEN || len > MAX_KEYWORD_LEN) return 0;
+    const keyword* k = &keyword_table[KEYWORD_HASH(len, id[0])];
+    if (k->len == len && memcmp(k->word, id, len) == 0) return k->token;
+    return 0; // not a reserved word
+}
+
+// Read the whole input into source with a single read when the size is
+// known, falling back to chunked reads for pipes
+void load_source(CompilerContext* ctx, FILE *input) {
+    long size = -1;
+    if (fseek(input, 0, SEEK_END) == 0) {
+        size = ftell(input);
+        fseek(input, 0, SEEK_SET);
     }
-    
-    while (currentToken->type == plussym || currentToken->type == minussym) {
-        int addop = currentToken->type;
-        get_next_token();
-        term();
-        
-        if (addop == plussym) {
-            emit(OPR, 0, 2); // ADD
-        }
-        else {
-            emit(OPR, 0, 3); // SUB
+    size_t capacity = size >= 0 ? (size_t)size + SOURCE_PADDING : 4096;
+    size_t length = 0;
+    size_t n;
+    ctx->source = arena_alloc(&ctx->arena, capacity);
+    while ((n = fread(ctx->source + length, 1, capacity - length - SOURCE_PADDING, input)) > 0) {
+        length += n;
+        if (size < 0 && length == capacity - SOURCE_PADDING) {
+            ctx->source = arena_grow(&ctx->arena, ctx->source, capacity, capacity * 2);
+            capacity *= 2;
         }
     }
+    memset(ctx->source + length, 0, SOURCE_PADDING);
+    ctx->sourceLength = (int)length;
 }
 
-void term() {
-    factor();
-    while (currentToken->type == multsym || currentToken->type == slashsym) {
-        int mulop = currentToken->type;
-        get_next_token();
-        factor();
-        
-        if (mulop == multsym) {
-            emit(OPR, 0, 4); // MUL
-        }
-        else {
-            emit(OPR, 0, 5); // DIV
-        }
+// Append a token to the token stream
+void add_token(CompilerContext* ctx, int type, int offset, int length, int line, int column, int name) {
+    if (ctx->tokenCount == ctx->tokenCapacity) {
+        int newCapacity = ctx->tokenCapacity ? ctx->tokenCapacity * 2 : 1024;
+        ctx->tokType = arena_grow(&ctx->arena, ctx->tokType, ctx->tokenCapacity, newCapacity);
+        ctx->tokOffset = arena_grow(&ctx->arena, ctx->tokOffset, sizeof(int) * ctx->tokenCapacity, sizeof(int) * newCapacity);
+        ctx->tokLength = arena_grow(&ctx->arena, ctx->tokLength, sizeof(int) * ctx->tokenCapacity, sizeof(int) * newCapacity);
+        ctx->tokLine = arena_grow(&ctx->arena, ctx->tokLine, sizeof(int) * ctx->tokenCapacity, sizeof(int) * newCapacity);
+        ctx->tokColumn = arena_grow(&ctx->arena, ctx->tokColumn, sizeof(int) * ctx->tokenCapacity, sizeof(int) * newCapacity);
+        ctx->tokName = arena_grow(&ctx->arena, ctx->tokName, sizeof(int) * ctx->tokenCapacity, sizeof(int) * newCapacity);
+        ctx->tokenCapacity = newCapacity;
     }
+    ctx->tokType[ctx->tokenCount] = type;
+    ctx->tokOffset[ctx->tokenCount] = offset;
+    ctx->tokLength[ctx->tokenCount] = length;
+    ctx->tokLine[ctx->tokenCount] = line;
+    ctx->tokColumn[ctx->tokenCount] = column;
+    ctx->tokName[ctx->tokenCount] = name;
+    ctx->tokenCount++;
 }
 
-void factor() {
-    if (currentToken->type == identsym) {
-        int sym_idx = find_symbol(currentToken->lexeme);
-        if (sym_idx == -1) {
-            error(6); // undeclared identifier
-        }
-        
-        if (symbol_table[sym_idx].kind == 1) {
-            emit(LIT, 0, symbol_table[sym_idx].val); // Constant
-        }
-        else {
-            emit(LOD, 0, symbol_table[sym_idx].addr); // Variable
-        }
-        
-        get_next_token();
-    }
-    else if (currentToken->type == numbersym) {
-        emit(LIT, 0, atoi(currentToken->lexeme));
-        get_next_token();
-    }
-    else if (currentToken->type == lparentsym) {
-        get_next_token();
-        expression();
-        if (currentToken->type != rparentsym) {
-            error(13); // right parenthesis must follow left parenthesis
-        }
-        get_next_token();
-    }
-    else if (currentToken->type == rparentsym) {
-        error(16); // unmatched right parenthesis
+// Rebuild the slot index at twice the size
+void name_pool_grow(NamePool* p) {
+    int slotCount = p->slotCount ? p->slotCount * 2 : 256;
+    int* slots = malloc(sizeof(int) * slotCount);
+    if (!slots) {
+        out_of_memory();
     }
-    else {
-        error(14); // invalid factor
+    free(p->slots);
+    p->slots = slots;
+    p->slotCount = slotCount;
+    memset(p->slots, 0xff, sizeof(int) * p->slotCount);  // -1
+    unsigned mask = p->slotCount - 1;
+    for (int id = 0; id < p->count; id++) {
+        unsigned i = p->names[id].hash & mask;
+        while (p->slots[i] >= 0) i = (i + 1) & mask;
+        p->slots[i] = id;
     }
 }
 
-void print_errors() {
-    if (errorCount > 0) {
-        printf("\nErrors:\n");
-        for (int i = 0; i < errorCount; i++) {
-            printf("Line %d, Column %d: %s\n", 
-                   errors[i].line, errors[i].column, errors[i].message);
+// Word of the first bytes of a word in memory order, the others zero
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LEADING_BYTES(word, bytes) \
+    ((bytes) <= 0 ? 0 : (bytes) < 8 ? (word) & (~0ull << 8 * (8 - (bytes))) : (word))
+#else
+#define LEADING_BYTES(word, bytes) \
+    ((bytes) <= 0 ? 0 : (bytes) < 8 ? (word) & ((1ull << 8 * (bytes)) - 1) : (word))
+#endif
+
+_Static_assert(MAX_ID_LEN + 1 == 12, "name_intern() reads names as 8 + 4 bytes");
+
+// Name ID of the len bytes of name (at most MAX_ID_LEN), added to the pool
+// if they are new. The 12 bytes from name are read, which the lexer's
+// padded buffers allow; the name is hashed and compared as those bytes
+// with the ones past it zeroed, in two words.
+int name_intern(NamePool* p, const char* name, int len) {
+    if ((p->count + 1) * 2 > p->slotCount) name_pool_grow(p);
+    uint64_t head, tail = 0;
+    memcpy(&head, name, 8);
+    memcpy(&tail, name + 8, 4);
+    head = LEADING_BYTES(head, len);
+    tail = LEADING_BYTES(tail, len - 8);
+    PooledName key;
+    memcpy(key.text, &head, 8);
+    memcpy(key.text + 8, &tail, 4);
+    key.hash = (unsigned)((head * 0x9e3779b97f4a7c15ull ^ tail * 0xc2b2ae3d27d4eb4full) >> 32);
+    unsigned mask = p->slotCount - 1;
+    for (unsigned i = key.hash & mask; ; i = (i + 1) & mask) {
+#if PL0_STATS
+        p->probes++;
+#endif
+        int id = p->slots[i];
+        if (id < 0) {
+            RESERVE(p->names, p->capacity, p->count + 1);
+            id = p->count++;
+            p->names[id] = key;
+            p->slots[i] = id;
+            return id;
         }
+        if (memcmp(p->names[id].text, key.text, sizeof(key.text)) == 0) return id;
     }
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <input_file>\n", argv[0]);
-        return 1;
-    }    
+// Forget every name but keep the tables
+void name_pool_clear(NamePool* p) {
+    p->count = 0;
+    p->probes = 0;
+    if (p->slots) memset(p->slots, 0xff, sizeof(int) * p->slotCount);  // -1
+}
 
-    char* InputFile = argv[1];
-    FILE *input = fopen(InputFile, "r");
-    if (!input) {
-        perror("Error opening file");
-        return 1;
-    }
+void name_pool_free(NamePool* p) {
+    free(p->names);
+    free(p->slots);
+    memset(p, 0, sizeof(*p));
+}
 
-    // First pass - lexical analysis
-    printSourceProgram(input);
-    scanTokens(input);
-    
-    print_errors();
-    if (hasError) {
-        fclose(input);
-        return 1;
+// Number tail after a decimal point: digits and further points
+int decimal_run_end(int level, const char* buf, int i) {
+    (void)level;
+    while (isNumber(buf[i]) || buf[i] == '.') i++;
+    return i;
+}
+
+void lexer_init(CompilerContext* ctx, Lexer* lx, char* buf, int length, FILE* input) {
+    lx->buf = buf;
+    lx->pos = 0;
+    lx->end = length;
+    lx->capacity = length;
+    lx->input = input;
+    lx->line = 1;
+    lx->lineStart = 0;
+    lx->limit = INT_MAX;
+    lx->simdLevel = ctx->simdLevel;
+    lx->names = ctx->names;
+    lx->ctx = ctx;
+}
+
+// Drop the bytes before keep, move the rest to the front of the window and
+// read more input behind it. Returns how far the contents moved.
+int lexer_refill(Lexer* lx, int keep) {
+    memmove(lx->buf, lx->buf + keep, lx->end - keep);
+    lx->end -= keep;
+    lx->pos -= keep;
+    lx->lineStart -= keep;
+    if (lx->end == lx->capacity) {
+        // A single token fills the window
+        int newCapacity = lx->capacity * 2;
+        lx->buf = arena_grow(&lx->ctx->arena, lx->buf, lx->capacity + SOURCE_PADDING,
+                             newCapacity + SOURCE_PADDING);
+        lx->capacity = newCapacity;
     }
+    size_t n = fread(lx->buf + lx->end, 1, lx->capacity - lx->end, lx->input);
+    if (n == 0) lx->input = NULL;
+    lx->end += n;
+    memset(lx->buf + lx->end, 0, SOURCE_PADDING);
+    return keep;
+}
+
+// Finish a run with scan; a run that reaches the end of a streaming window
+// is continued after a refill that keeps the bytes from start
+#define LEX_RUN(lx, scan, start, i) \
+    do { \
+        (i) = scan((lx)->simdLevel, (lx)->buf, (i)); \
+        while ((i) == (lx)->end && (lx)->input) { \
+            int shift_ = lexer_refill((lx), (start)); \
+            (start) -= shift_; \
+            (i) = scan((lx)->simdLevel, (lx)->buf, (i) - shift_); \
+        } \
+    } while (0)
+
+// Scan the next token into t, returning 0 at the end of input. Lexical
+// errors are recorded as they are found; the offending lexeme comes back
+// as a token of type 0.
+int lex_next(Lexer* lx, Token* t) {
+    for (;;) {
+        if (lx->input && lx->end - lx->pos < LEXER_LOOKAHEAD) {
+            lexer_refill(lx, lx->pos);
+        }
+        const char* buffer = lx->buf;
+        int i = lx->pos;
+        char c = buffer[i];
+        int cls = CHAR_CLASS(c);
+
+        if (c == '\0' || i >= lx->limit) {
+            return 0;
+        }
+
+        // Skip whitespace
+        if (cls & CC_NEWLINE) {
+            lx->pos = i + 1;
+            lx->line++;
+            lx->lineStart = lx->pos;
+            continue;
+        }
+        if (cls & CC_BLANK) {
+            int start = i + 1;
+            i = start;
+            LEX_RUN(lx, blank_run_end, start, i);
+            lx->pos = i;
+            continue;
+        }
+
+        int start = i;
+        int startCol = i - lx->lineStart + 1;
+        int lineNum = lx->line;
+        int type;
+        int name = -1;
+
+        // Process identifiers and reserved words
+        if (cls & CC_LETTER) {
+            i++;
+            LEX_RUN(lx, word_run_end, start, i);
+            buffer = lx->buf;
+            int len = i - start;
+
+            if (len > MAX_ID_LEN) {
+                type = 0;
+                add_error(lx->ctx, lineNum, startCol, "Identifier too long");
+            } else {
+                int token = isReservedWord(buffer + start, len);
+                type = token ? token : identsym;
+                if (!token) name = name_intern(lx->names, buffer + start, len);
+            }
+        }
+        // Process numbers
+        else if (cls & CC_DIGIT) {
+            i++;
+            LEX_RUN(lx, digit_run_end, start, i);
+            buffer = lx->buf;
+            // Check for decimal point (invalid in PL/0)
+            if (buffer[i] == '.') {
+                add_error(lx->ctx, lineNum, i - lx->lineStart + 1, "Decimal numbers not allowed");
+                LEX_RUN(lx, decimal_run_end, start, i);
+                lx->pos = i;
+                continue;
+            }
+            if (i - start > MAX_NUM_LEN) {
+                type = 0;
+                add_error(lx->ctx, lineNum, startCol, "Number too long");
+            } else {
+                type = numbersym;
+            }
+        }
+        // Handle comments
+        else if (c == '/' && buffer[i + 1] == '*') {
+            int body = i + 2;
+            i = body;
+            for (;;) {
+                i = LEXER_RUN(lx->simdLevel, comment_end, lx->buf, i, &lx->line, &lx->lineStart);
+                if (i < lx->end || !lx->input) break;
+                // Window exhausted inside the comment; keep a trailing '*'
+                // in case the closing '/' comes with the next read
+                int keep = (i > body && lx->buf[i - 1] == '*') ? i - 1 : i;
+                int shift = lexer_refill(lx, keep);
+                body -= shift;
+                i = keep - shift;
+            }
+            if (lx->buf[i] == '\0') {
+                add_error(lx->ctx, lineNum, startCol, "Unterminated comment");
+                lx->pos = lx->end;
+                lx->input = NULL;
+                return 0;
+            }
+            lx->pos = i + 2;
+            continue;
+        }
+        else {
+            // Process special symbols
+            int singleToken = 0;
+            switch (c) {
+                case '+': singleToken = plussym; break;
+                case '-': singleToken = minussym; break;
+                case '*': singleToken = multsym; break;
+                case '/': singleToken = slashsym; break;
+                case '(': singleToken = lparentsym; break;
+                case ')': singleToken = rparentsym; break;
+                case '=': singleToken = eqlsym; break;
+                case ',': singleToken = commasym; break;
+                case '.': singleToken = periodsym; break;
+                case '<':
+                    if (buffer[i+1] == '=') { singleToken = leqsym; i++; }
+                    else if (buffer[i+1] == '>') { singleToken = neqsym; i++; }
+                    else { singleToken = lessym; }
+                    break;
+                case '>':
+                    if (buffer[i+1] == '=') { singleToken = geqsym; i++; }
+                    else { singleToken = gtrsym; }
+                    break;
+                case ';': singleToken = semicolonsym; break;
+                case ':':
+                    if (buffer[i+1] == '=') { singleToken = becomessym; i++; }
+                    else { add_error(lx->ctx, lineNum, startCol, "Invalid symbol ':'"); }
+                    break;
+                default:
+                    add_error(lx->ctx, lineNum, startCol, "Invalid symbol");
+                    break;
+            }
+            i++;
+            type = singleToken;
+        }
+
+        lx->pos = i;
+        t->type = type;
+        t->lexeme = lx->buf + start;
+        t->length = i - start;
+        t->line = lineNum;
+        t->column = startCol;
+        t->name = name;
+        return 1;
+    }
+}
+
+void scan_tokens_parallel(CompilerContext* ctx, int threads);
+
+// Add the tokens from lx's position to its limit to ctx; source is the
+// buffer their offsets are from
+void lex_tokens(CompilerContext* ctx, Lexer* lx, const char* source) {
+    Token t;
+    while (lex_next(lx, &t)) {
+        add_token(ctx, t.type, t.lexeme - source, t.length, t.line, t.column, t.name);
+    }
+}
+
+// Single pass over source: fills the token arrays and records lexical
+// errors, on several threads for a large source. Invalid lexemes are kept
+// as tokens of type 0 so the echo listing can be produced from the stored
+// tokens afterwards.
+void scanTokens(CompilerContext* ctx) {
+    int threads = ctx->lexThreads;
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+    if (threads > ctx->sourceLength / LEX_CHUNK_MIN) threads = ctx->sourceLength / LEX_CHUNK_MIN;
+    if (threads > 1) {
+        scan_tokens_parallel(ctx, threads);
+        return;
+    }
+    Lexer lx;
+    lexer_init(ctx, &lx, ctx->source, ctx->sourceLength, NULL);
+    lex_tokens(ctx, &lx, ctx->source);
+}
+
+// Parallel lexing. The source is split just after newlines into one chunk
+// per thread, and each chunk is lexed into a context of its own as if it
+// began a line outside any comment. Tokens never span lines, so that holds
+// unless a comment crosses into the chunk. A fix-up pass then walks the
+// chunks in order: a chunk starting where the lexer of the one before
+// stopped is kept, one a comment ends inside is lexed again from the end
+// of the comment, and one a comment covers is dropped. What is kept is
+// copied into the token arrays, again on the threads, with the line
+// numbers rebased and the chunk's name IDs mapped to the compile's, so the
+// tokens, names and errors are those of scanTokens().
+
+typedef struct {
+    CompilerContext* ctx;   // the chunk's tokens and errors
+    CompilerContext* into;  // the compile
+    int start;              // the chunk is bytes [start, end) of the source
+    int end;
+    int pos;                // lexer state, at the start and after the lex
+    int line;
+    int lineStart;
+    int lineOffset;         // added to the chunk's line numbers
+    int tokenBase;          // index of the chunk's first token in the stream
+    int* names;             // the compile's name ID of each of the chunk's
+    pthread_t thread;
+    int started;            // thread is running
+    int failed;             // memory ran out while lexing
+} LexChunk;
+
+void* lex_chunk(void* arg) {
+    LexChunk* c = arg;
+    // Running out of memory is reported on the calling thread, after the joins
+    jmp_buf jump;
+    jmp_buf* outer = out_of_memory_jump;
+    out_of_memory_jump = &jump;
+    if (setjmp(jump)) {
+        out_of_memory_jump = outer;
+        c->failed = 1;
+        return NULL;
+    }
+    Lexer lx;
+    lexer_init(c->ctx, &lx, c->into->source, c->into->sourceLength, NULL);
+    lx.pos = c->pos;
+    lx.line = c->line;
+    lx.lineStart = c->lineStart;
+    lx.limit = c->end;
+    lex_tokens(c->ctx, &lx, c->into->source);
+    c->pos = lx.pos;
+    c->line = lx.line;
+    c->lineStart = lx.lineStart;
+    out_of_memory_jump = outer;
+    return NULL;
+}
+
+void* copy_chunk(void* arg) {
+    LexChunk* c = arg;
+    CompilerContext* from = c->ctx;
+    CompilerContext* to = c->into;
+    int n = from->tokenCount;
+    int base = c->tokenBase;
+    if (n == 0) return NULL;
+    memcpy(to->tokType + base, from->tokType, n);
+    memcpy(to->tokOffset + base, from->tokOffset, sizeof(int) * n);
+    memcpy(to->tokLength + base, from->tokLength, sizeof(int) * n);
+    memcpy(to->tokColumn + base, from->tokColumn, sizeof(int) * n);
+    for (int i = 0; i < n; i++) {
+        to->tokLine[base + i] = from->tokLine[i] + c->lineOffset;
+        to->tokName[base + i] = from->tokName[i] >= 0 ? c->names[from->tokName[i]] : -1;
+    }
+    return NULL;
+}
+
+// Run fn on every chunk, the first on the calling thread. A chunk whose
+// thread cannot be started runs here afterwards.
+void run_chunks(void* (*fn)(void*), LexChunk* chunks, int count) {
+    for (int k = 1; k < count; k++) {
+        chunks[k].started = pthread_create(&chunks[k].thread, NULL, fn, &chunks[k]) == 0;
+    }
+    fn(&chunks[0]);
+    for (int k = 1; k < count; k++) {
+        if (chunks[k].started) pthread_join(chunks[k].thread, NULL);
+        else fn(&chunks[k]);
+    }
+}
+
+void scan_tokens_parallel(CompilerContext* ctx, int threads) {
+    LexChunk* chunks = arena_alloc(&ctx->arena, sizeof(LexChunk) * threads);
+    int count = 0;
+    int start = 0;
+    for (int k = 1; k <= threads && start < ctx->sourceLength; k++) {
+        int end = (int)((long long)ctx->sourceLength * k / threads);
+        if (end < start) end = start;
+        const char* newline = memchr(ctx->source + end, '\n', ctx->sourceLength - end);
+        end = newline && k < threads ? (int)(newline - ctx->source) + 1 : ctx->sourceLength;
+        LexChunk* c = &chunks[count++];
+        c->ctx = compiler_create();
+        if (!c->ctx) {
+            for (int j = 0; j < count - 1; j++) compiler_destroy(chunks[j].ctx);
+            out_of_memory();
+        }
+        c->into = ctx;
+        c->failed = 0;
+        c->start = c->pos = c->lineStart = start;
+        c->end = end;
+        c->line = 1;
+        start = end;
+    }
+    // The chunks' contexts are freed before passing on a failure
+    jmp_buf jump;
+    jmp_buf* outer = out_of_memory_jump;
+    out_of_memory_jump = &jump;
+    if (setjmp(jump)) {
+        out_of_memory_jump = outer;
+        for (int k = 0; k < count; k++) compiler_destroy(chunks[k].ctx);
+        out_of_memory();
+    }
+    run_chunks(lex_chunk, chunks, count);
+    for (int k = 0; k < count; k++) {
+        if (chunks[k].failed) out_of_memory();
+    }
+
+    // Fix-up, in source order, following the state of a sequential lexer
+    int pos = 0, line = 1, lineStart = 0;
+    int total = 0;
+    for (int k = 0; k < count; k++) {
+        LexChunk* c = &chunks[k];
+        if (pos == c->start) {
+            c->lineOffset = line - 1;
+        } else if (pos < c->end) {
+            // A comment from the chunks before ends inside this one (or
+            // a NUL ended the source early)
+            c->ctx->tokenCount = 0;
+            c->ctx->errorCount = 0;
+            name_pool_clear(c->ctx->names);
+            c->pos = pos;
+            c->line = line;
+            c->lineStart = lineStart;
+            c->lineOffset = 0;
+            lex_chunk(c);
+            if (c->failed) out_of_memory();
+        } else {
+            c->ctx->tokenCount = 0;
+            c->ctx->errorCount = 0;
+            c->tokenBase = total;
+            continue;
+        }
+        pos = c->pos;
+        line = c->line + c->lineOffset;
+        lineStart = c->lineStart;
+        c->tokenBase = total;
+        total += c->ctx->tokenCount;
+        // Interning the chunks' names in order numbers them as one lexer would
+        NamePool* names = c->ctx->names;
+        c->names = arena_alloc(&ctx->arena, sizeof(int) * names->count);
+        for (int id = 0; id < names->count; id++) {
+            const char* text = names->names[id].text;
+            c->names[id] = name_intern(ctx->names, text, (int)strlen(text));
+        }
+        ctx->names->probes += names->probes;
+        for (int i = 0; i < c->ctx->errorCount; i++) {
+            if (ctx->errorCount == ctx->errorCapacity) {
+                GROW_TABLE(ctx->errors, ctx->errorCapacity, 16);
+            }
+            Error* e = &ctx->errors[ctx->errorCount++];
+            *e = c->ctx->errors[i];
+            e->line += c->lineOffset;
+            ctx->hasError = 1;
+        }
+    }
+
+    ctx->tokType = arena_alloc(&ctx->arena, total);
+    ctx->tokOffset = arena_alloc(&ctx->arena, sizeof(int) * total);
+    ctx->tokLength = arena_alloc(&ctx->arena, sizeof(int) * total);
+    ctx->tokLine = arena_alloc(&ctx->arena, sizeof(int) * total);
+    ctx->tokColumn = arena_alloc(&ctx->arena, sizeof(int) * total);
+    ctx->tokName = arena_alloc(&ctx->arena, sizeof(int) * total);
+    ctx->tokenCount = ctx->tokenCapacity = total;
+    run_chunks(copy_chunk, chunks, count);
+    out_of_memory_jump = outer;
+    for (int k = 0; k < count; k++) {
+        compiler_destroy(chunks[k].ctx);
+    }
+}
+
+// Open a streaming lexer over input for get_next_token() to pull from
+void start_streaming(CompilerContext* ctx, FILE* input) {
+    char* window = arena_alloc(&ctx->arena, STREAM_WINDOW + SOURCE_PADDING);
+    memset(window, 0, SOURCE_PADDING);
+    lexer_init(ctx, &ctx->streamLexer, window, 0, input);
+    ctx->streamLexer.capacity = STREAM_WINDOW;
+    ctx->streaming = 1;
+}
+
+// Echo every lexeme with its token type (or lexical error) from the token stream
+// Buffered output for the listings. Everything goes through one large
+// buffer with integers formatted by hand, so a listing costs a handful of
+// fwrite() calls instead of a formatted printf per line.
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Listing artifacts, and the formats each can be written in
+enum { ARTIFACT_TOKENS, ARTIFACT_CODE, ARTIFACT_SYMBOLS, ARTIFACT_ERRORS, ARTIFACT_COUNT };
+enum {
+    FORMAT_TEXT,    // the classic listing
+    FORMAT_JSON,    // one JSON object per line
+    FORMAT_NONE,
+    FORMAT_BINARY   // code only: the binary module, which carries the symbols
+};
+
+struct Output {
+    FILE* file;
+    size_t length;
+    int failed;    // a write failed
+    char buffer[OUTPUT_BUFFER_SIZE];
+};
+
+void out_init(Output* o, FILE* file) {
+    o->file = file;
+    o->length = 0;
+    o->failed = 0;
+}
+
+void out_flush(Output* o) {
+    if (o->length > 0 && fwrite(o->buffer, 1, o->length, o->file) != o->length) o->failed = 1;
+    o->length = 0;
+}
+
+void out_bytes(Output* o, const char* s, size_t n) {
+    if (n > OUTPUT_BUFFER_SIZE - o->length) {
+        out_flush(o);
+        if (n > OUTPUT_BUFFER_SIZE) {
+            if (fwrite(s, 1, n, o->file) != n) o->failed = 1;
+            return;
+        }
+    }
+    memcpy(o->buffer + o->length, s, n);
+    o->length += n;
+}
+
+void out_str(Output* o, const char* s) {
+    out_bytes(o, s, strlen(s));
+}
+
+void out_char(Output* o, char c) {
+    if (o->length == OUTPUT_BUFFER_SIZE) out_flush(o);
+    o->buffer[o->length++] = c;
+}
+
+// s padded with blanks to width columns, on the left if width is negative
+void out_padded(Output* o, const char* s, int width) {
+    int n = (int)strlen(s);
+    for (int i = n; i < width; i++) out_char(o, ' ');
+    out_bytes(o, s, n);
+    for (int i = n; i < -width; i++) out_char(o, ' ');
+}
+
+// Decimal value, right-aligned in width columns
+void out_int(Output* o, int value, int width) {
+    char digits[12];
+    int n = 0;
+    unsigned v = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0) digits[n++] = '-';
+    for (int i = n; i < width; i++) out_char(o, ' ');
+    while (n > 0) out_char(o, digits[--n]);
+}
+
+// JSON string literal of n bytes
+void out_json_string(Output* o, const char* s, int n) {
+    out_char(o, '"');
+    for (int i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            out_char(o, '\\');
+            out_char(o, (char)c);
+        } else if (c < 0x20 || c >= 0x7F) {
+            static const char hex[] = "0123456789abcdef";
+            out_str(o, "\\u00");
+            out_char(o, hex[c >> 4]);
+            out_char(o, hex[c & 15]);
+        } else {
+            out_char(o, (char)c);
+        }
+    }
+    out_char(o, '"');
+}
+
+// ,"key": before a JSON value
+void out_key(Output* o, const char* key) {
+    out_str(o, ",\"");
+    out_str(o, key);
+    out_str(o, "\":");
+}
+
+void print_lexemes(Output* out, CompilerContext* ctx, int format) {
+    for (int i = 0; i < ctx->tokenCount; i++) {
+        const char* lexeme = ctx->source + ctx->tokOffset[i];
+        int len = ctx->tokLength[i];
+        const char* problem = NULL;
+        if (ctx->tokType[i] == 0) {
+            if (isLetter(lexeme[0])) problem = "Identifier too long";
+            else if (isNumber(lexeme[0])) problem = "Number too long";
+            else problem = "invalid symbol";
+        }
+        if (format == FORMAT_JSON) {
+            out_str(out, "{\"type\":\"lexeme\",\"text\":");
+            out_json_string(out, lexeme, len);
+            if (problem) {
+                out_key(out, "error");
+                out_json_string(out, problem, (int)strlen(problem));
+            } else {
+                out_key(out, "token");
+                out_int(out, ctx->tokType[i], 0);
+            }
+            out_str(out, "}\n");
+        } else if (!problem) {
+            out_bytes(out, lexeme, len);
+            out_str(out, "\t\t");
+            out_int(out, ctx->tokType[i], 0);
+            out_char(out, '\n');
+        } else if (isLetter(lexeme[0]) || isNumber(lexeme[0])) {
+            out_bytes(out, lexeme, len);
+            out_str(out, "\t\tError: ");
+            out_str(out, problem);
+            out_char(out, '\n');
+        } else if (lexeme[0] == ':') {
+            out_str(out, ":\t\tError: invalid symbol\n");
+        } else {
+            out_str(out, "\t\tError: invalid symbol \"");
+            out_char(out, lexeme[0]);
+            out_str(out, "\"\n");
+        }
+    }
+}
+
+// Print the token stream handed to the parser
+void print_token_list(Output* out, CompilerContext* ctx) {
+    out_str(out, "\nToken List:\n");
+    for (int i = 0; i < ctx->tokenCount; i++) {
+        out_int(out, ctx->tokType[i], 0);
+        out_char(out, ' ');
+        if (ctx->tokType[i] == identsym || ctx->tokType[i] == numbersym) {
+            out_bytes(out, ctx->source + ctx->tokOffset[i], ctx->tokLength[i]);
+            out_char(out, ' ');
+        }
+    }
+    out_char(out, '\n');
+}
+
+// A lexical error ends a streamed parse, since compile_buffer() does not
+// parse a program with lexical errors: the syntax errors before it are
+// dropped, the rest of the input is lexed only for its lexical errors, and
+// the parser sees the end of input and reports nothing more
+void stream_lex_failed(CompilerContext* ctx, int first) {
+    memmove(ctx->errors, ctx->errors + first, sizeof(Error) * (ctx->errorCount - first));
+    ctx->errorCount -= first;
+    Token t;
+    while (lex_next(&ctx->streamLexer, &t)) {
+        STATS_ADD(ctx, tokens, 1);
+    }
+    ctx->streamFailed = 1;
+}
+
+void get_next_token(CompilerContext* ctx) {
+    ctx->currentToken = &ctx->tokenView;
+    if (ctx->streaming) {
+        int errors = ctx->errorCount;
+        while (!ctx->streamFailed && lex_next(&ctx->streamLexer, &ctx->tokenView)) {
+            STATS_ADD(ctx, tokens, 1);
+            if (ctx->errorCount > errors) break;
+            if (ctx->tokenView.type != 0) return;
+        }
+        if (ctx->errorCount > errors && !ctx->streamFailed) stream_lex_failed(ctx, errors);
+        ctx->tokenView.type = periodsym;
+        ctx->tokenView.lexeme = "";
+        ctx->tokenView.length = 0;
+        ctx->tokenView.line = -1;
+        ctx->tokenView.column = -1;
+        ctx->tokenView.name = -1;
+    }
+    else if (ctx->currentTokenIndex < ctx->tokenCount) {
+        int i = ctx->currentTokenIndex++;
+        ctx->tokenView.type = ctx->tokType[i];
+        ctx->tokenView.lexeme = ctx->source + ctx->tokOffset[i];
+        ctx->tokenView.length = ctx->tokLength[i];
+        ctx->tokenView.line = ctx->tokLine[i];
+        ctx->tokenView.column = ctx->tokColumn[i];
+        ctx->tokenView.name = ctx->tokName[i];
+    } else {
+        // End of tokens, treat as period
+        ctx->tokenView.type = periodsym;
+        ctx->tokenView.lexeme = "";
+        ctx->tokenView.length = 0;
+        ctx->tokenView.line = -1;
+        ctx->tokenView.column = -1;
+        ctx->tokenView.name = -1;
+    }
+}
+
+// Value of a number token, read straight from its slice
+int token_value(const Token* t) {
+    int value = 0;
+    for (int i = 0; i < t->length; i++) {
+        value = value * 10 + (t->lexeme[i] - '0');
+    }
+    return value;
+}
+
+// Text of a syntax error code
+const char* error_message(int error_num) {
+    if (error_num >= 0 && error_num < (int)(sizeof(error_messages)/sizeof(error_messages[0]))) {
+        return error_messages[error_num];
+    }
+    return "Unknown error";
+}
+
+// Index of the current token; the token count at the end of input
+int current_token_index(CompilerContext* ctx) {
+    return ctx->tokenView.line == -1 ? ctx->tokenCount : ctx->currentTokenIndex - 1;
+}
+
+// Record a syntax error at the current token. The parser then runs in
+// panic mode: later errors are dropped until it resynchronises on one of
+// ; end fi do . so each mistake is reported once.
+void error(CompilerContext* ctx, int error_num) {
+    if (ctx->panicking || ctx->streamFailed) return;
+    ctx->panicking = 1;
+    add_error(ctx, ctx->currentToken->line, ctx->currentToken->column, error_message(error_num));
+    ctx->errors[ctx->errorCount - 1].code = error_num;
+    if (ctx->outline) {
+        Outline* o = ctx->outline;
+        RESERVE(o->errors, o->errorCapacity, o->errorCount + 1);
+        o->errors[o->errorCount].token = current_token_index(ctx);
+        o->errors[o->errorCount].code = error_num;
+        o->errorCount++;
+    }
+}
+
+int is_sync_token(int type) {
+    return type == semicolonsym || type == endsym || type == fisym ||
+           type == dosym || type == periodsym;
+}
+
+// Panic mode: skip tokens up to the next synchronizing token
+void synchronize(CompilerContext* ctx) {
+    while (!is_sync_token(ctx->currentToken->type)) {
+        get_next_token(ctx);
+    }
+}
+
+// Consume a synchronizing token the parser expected here; it is back in
+// step with the source, so errors are reported again
+void accept_sync(CompilerContext* ctx) {
+    ctx->panicking = 0;
+    get_next_token(ctx);
+}
+
+// Append an instruction. Operands and jump targets must fit the packed M
+// field, which bounds the code to INSTRUCTION_M_MAX + 1 instructions.
+void emit(CompilerContext* ctx, int op, int L, int M) {
+    if (M < INSTRUCTION_M_MIN || M > INSTRUCTION_M_MAX || ctx->cx > INSTRUCTION_M_MAX) {
+        if (!ctx->hasError) {
+            char msg[100];
+            if (ctx->cx > INSTRUCTION_M_MAX) {
+                snprintf(msg, sizeof(msg), "program too large: the code is limited to %d instructions",
+                         INSTRUCTION_M_MAX + 1);
+            } else {
+                snprintf(msg, sizeof(msg), "program too large: operand %d does not fit the 24-bit M field", M);
+            }
+            add_error(ctx, -1, 0, msg);
+        }
+        return;
+    }
+    if (ctx->cx == ctx->code_capacity) {
+        GROW_TABLE(ctx->code, ctx->code_capacity, 256);
+    }
+    ctx->code[ctx->cx].op = op;
+    ctx->code[ctx->cx].L = L;
+    ctx->code[ctx->cx].M = M;
+    ctx->cx++;
+}
+
+Node* new_node(CompilerContext* ctx, int kind, int op, int value, Node* left, Node* right) {
+    Node* n = arena_alloc(&ctx->arena, sizeof(Node));
+    n->kind = (unsigned char)kind;
+    n->op = (unsigned char)op;
+    n->value = value;
+    n->aux = 0;
+    n->left = left;
+    n->right = right;
+    n->next = NULL;
+    return n;
+}
+
+unsigned hash_name(const char* name, int len) {
+    unsigned h = 2166136261u;  // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Extend visible to every name interned so far; the new ones have no
+// declaration
+void grow_visible(CompilerContext* ctx) {
+    int count = ctx->visibleCount ? ctx->visibleCount * 2 : 256;
+    if (count < ctx->names->count) count = ctx->names->count;
+    ctx->visible = arena_grow(&ctx->arena, ctx->visible, sizeof(int) * ctx->visibleCount, sizeof(int) * count);
+    memset(ctx->visible + ctx->visibleCount, 0xff, sizeof(int) * (count - ctx->visibleCount));  // -1
+    ctx->visibleCount = count;
+}
+
+// Append a symbol to the symbol table and make it the visible binding of
+// its name, hiding any declaration from an enclosing scope
+void add_symbol(CompilerContext* ctx, int kind, int name, int val, int level, int addr) {
+    if (ctx->sym_table_size == ctx->sym_table_capacity) {
+        GROW_TABLE(ctx->symbol_table, ctx->sym_table_capacity, 64);
+    }
+    if (name >= ctx->visibleCount) grow_visible(ctx);
+    int idx = ctx->sym_table_size++;
+    symbol* s = &ctx->symbol_table[idx];
+    s->kind = kind;
+    strcpy(s->name, ctx->names->names[name].text);
+    s->val = val;
+    s->level = level;
+    s->addr = addr;
+    s->mark = 0;
+    s->id = name;
+    s->shadow = ctx->visible[name];
+    ctx->visible[name] = idx;
+}
+
+// symbolTable Check: innermost visible declaration of a name ID, or -1
+int find_symbol(CompilerContext* ctx, int name) {
+    STATS_ADD(ctx, lookups, 1);
+    return name < ctx->visibleCount ? ctx->visible[name] : -1;
+}
+
+// Open a new lexical level for the declarations of a block
+void scope_enter(CompilerContext* ctx) {
+    ctx->current_level++;
+    if (ctx->current_level == ctx->scope_capacity) {
+        GROW_TABLE(ctx->scope_start, ctx->scope_capacity, 8);
+    }
+    ctx->scope_start[ctx->current_level] = ctx->sym_table_size;
+}
+
+// Close the innermost level: mark its symbols and restore any outer
+// declarations they were hiding
+void scope_exit(CompilerContext* ctx) {
+    for (int i = ctx->sym_table_size - 1; i >= ctx->scope_start[ctx->current_level]; i--) {
+        symbol* s = &ctx->symbol_table[i];
+        s->mark = 1;
+        ctx->visible[s->id] = s->shadow;
+    }
+    ctx->current_level--;
+}
+
+// Parse the whole program into a tree; generate() turns it into code
+Node* program(CompilerContext* ctx) {
+    get_next_token(ctx);
+    Node* tree = block(ctx);
+    if (ctx->currentToken->type != periodsym) {
+        error(ctx, 0); // program must end with period
+    }
+    return tree;
+}
+
+// Resume after a broken declaration: right away if the next declaration
+// or the statement part follows (the ; was left out), otherwise after the
+// ; that ends it
+void recover_declaration(CompilerContext* ctx) {
+    int type = ctx->currentToken->type;
+    if (type == constsym || type == varsym || type == procsym || type == beginsym ||
+        type == ifsym || type == whensym || type == readsym || type == writesym ||
+        type == callsym) {
+        ctx->panicking = 0;
+        return;
+    }
+    synchronize(ctx);
+    if (ctx->currentToken->type == semicolonsym) accept_sync(ctx);
+}
+
+// Record the scope of the block whose body is about to be parsed: its
+// level, the first symbol of each enclosing level and how many symbols
+// exist. Returns the block that was being recorded.
+int outline_block(CompilerContext* ctx) {
+    Outline* o = ctx->outline;
+    RESERVE(o->blocks, o->blockCapacity, o->blockCount + 1);
+    RESERVE(o->scopes, o->scopeCapacity, o->scopeCount + ctx->current_level + 1);
+    OutlineBlock* b = &o->blocks[o->blockCount];
+    b->level = ctx->current_level;
+    b->scopes = o->scopeCount;
+    b->symbolEnd = ctx->sym_table_size;
+    memcpy(o->scopes + o->scopeCount, ctx->scope_start, sizeof(int) * (ctx->current_level + 1));
+    o->scopeCount += ctx->current_level + 1;
+    int outer = o->block;
+    o->block = o->blockCount++;
+    return outer;
+}
+
+Node* block(CompilerContext* ctx) {
+    scope_enter(ctx);
+    int first = ctx->sym_table_size;
+    const_declaration(ctx);
+    if (ctx->panicking) recover_declaration(ctx);
+    int num_vars = var_declaration(ctx);
+    if (ctx->panicking) recover_declaration(ctx);
+    Node* procedures = procedure_declaration(ctx);
+    if (ctx->panicking) recover_declaration(ctx);
     
-    // Second pass - parsing and code generation
-    program();
-    
-    // Print generated code
-    printf("\nAssembly Code:\n");
-    printf("Line OP L M\n");
-    for (int i = 0; i < cx; i++) {
-        printf("%4d %3d %d %d\n", i, code[i].op, code[i].L, code[i].M);
+    // Frame: 3 bookkeeping slots, then the variables
+    int outer = ctx->outline ? outline_block(ctx) : -1;
+    Node* body = statement(ctx);
+    if (ctx->outline) ctx->outline->block = outer;
+    Node* b = new_node(ctx, NODE_BLOCK, ctx->current_level, 3 + num_vars, procedures, body);
+    b->aux = first;
+    scope_exit(ctx); // Mark the block's symbols
+    return b;
+}
+
+void const_declaration(CompilerContext* ctx) {
+    if (ctx->currentToken->type == constsym) {
+        do {
+            get_next_token(ctx);
+            if (ctx->currentToken->type != identsym) {
+                error(ctx, 1); // const must be followed by identifier
+                return;
+            }
+            
+            int name = ctx->currentToken->name;
+            int prev = find_symbol(ctx, name);
+            if (prev != -1 && ctx->symbol_table[prev].level == ctx->current_level) {
+                error(ctx, 2); // symbol already declared
+                return;
+            }
+            
+            // Add to symbol table now; the value is filled in below
+            int sym_idx = ctx->sym_table_size;
+            add_symbol(ctx, 1, name, 0, ctx->current_level, 0);
+            
+            get_next_token(ctx);
+            if (ctx->currentToken->type != eqlsym) {
+                error(ctx, 3); // constants must be assigned with =
+                return;
+            }
+            
+            get_next_token(ctx);
+            if (ctx->currentToken->type != numbersym) {
+                error(ctx, 4); // constants must be assigned an integer value
+                return;
+            }
+            
+            // Additional check for decimal points
+            if (memchr(ctx->currentToken->lexeme, '.', ctx->currentToken->length) != NULL) {
+                error(ctx, 17); // constants must be integers
+                return;
+            }
+            
+            ctx->symbol_table[sym_idx].val = token_value(ctx->currentToken);
+            
+            get_next_token(ctx);
+        } while (ctx->currentToken->type == commasym);
+        
+        if (ctx->currentToken->type != semicolonsym) {
+            error(ctx, 5); // const declaration must end with semicolon
+            return;
+        }
+        get_next_token(ctx);
+    }
+}
+
+int var_declaration(CompilerContext* ctx) {
+    int num_vars = 0;
+    if (ctx->currentToken->type == varsym) {
+        do {
+            num_vars++;
+            get_next_token(ctx);
+            if (ctx->currentToken->type != identsym) {
+                error(ctx, 1); // var must be followed by identifier
+                return num_vars;
+            }
+            
+            int name = ctx->currentToken->name;
+            int prev = find_symbol(ctx, name);
+            if (prev != -1 && ctx->symbol_table[prev].level == ctx->current_level) {
+                error(ctx, 2); // symbol already declared
+                return num_vars;
+            }
+            
+            // Add to symbol table (first var at address 3)
+            add_symbol(ctx, 2, name, 0, ctx->current_level, num_vars + 2);
+            
+            get_next_token(ctx);
+        } while (ctx->currentToken->type == commasym);
+        
+        if (ctx->currentToken->type != semicolonsym) {
+            error(ctx, 5); // var declaration must end with semicolon
+            return num_vars;
+        }
+        get_next_token(ctx);
+    }
+    return num_vars;
+}
+
+// procedure ident; block; for each procedure of a block. Returns their
+// NODE_PROCs, chained through next.
+Node* procedure_declaration(CompilerContext* ctx) {
+    Node* first = NULL;
+    Node** tail = &first;
+    while (ctx->currentToken->type == procsym) {
+        get_next_token(ctx);
+        if (ctx->currentToken->type != identsym) {
+            error(ctx, 21); // procedure must be followed by identifier
+            return first;
+        }
+
+        int name = ctx->currentToken->name;
+        int prev = find_symbol(ctx, name);
+        if (prev != -1 && ctx->symbol_table[prev].level == ctx->current_level) {
+            error(ctx, 2); // symbol already declared
+            return first;
+        }
+        if (ctx->current_level == INSTRUCTION_L_MAX) {
+            error(ctx, 25); // the body's level would not fit L; parse it anyway
+        }
+
+        // Declared before the body, so it may call itself; the address is
+        // filled in by the code generator
+        int sym_idx = ctx->sym_table_size;
+        add_symbol(ctx, 3, name, 0, ctx->current_level, 0);
+
+        get_next_token(ctx);
+        if (ctx->currentToken->type == semicolonsym) {
+            get_next_token(ctx);
+        } else {
+            error(ctx, 22); // procedure name must be followed by semicolon
+        }
+        Node* body = block(ctx);
+        if (ctx->currentToken->type != semicolonsym) {
+            error(ctx, 22); // procedure block must be followed by semicolon
+            return first;
+        }
+        accept_sync(ctx);
+
+        Node* proc = new_node(ctx, NODE_PROC, 0, sym_idx, body, NULL);
+        *tail = proc;
+        tail = &proc->next;
+    }
+    return first;
+}
+
+// Levels out from the current block to the one declaring symbol sym_idx
+int levels_out(CompilerContext* ctx, int sym_idx) {
+    return ctx->current_level - ctx->symbol_table[sym_idx].level;
+}
+
+// Parse a statement, recording its span when the parser keeps an outline
+Node* statement(CompilerContext* ctx) {
+    Outline* o = ctx->outline;
+    if (!o) return parse_statement(ctx);
+    RESERVE(o->spans, o->spanCapacity, o->spanCount + 1);
+    int span = o->spanCount++;
+    OutlineSpan* sp = &o->spans[span];
+    sp->first = current_token_index(ctx);
+    sp->parent = o->open;
+    sp->depth = o->open >= 0 ? o->spans[o->open].depth + 1 : 0;
+    sp->block = o->block;
+    sp->panicIn = ctx->panicking;
+    o->open = span;
+    Node* n = parse_statement(ctx);
+    sp = &o->spans[span];  // the table may have moved
+    sp->end = current_token_index(ctx);
+    sp->errorEnd = o->errorCount;
+    sp->panicOut = ctx->panicking;
+    o->open = sp->parent;
+    return n;
+}
+
+// One step through the statements of a begin ... end, at the token after
+// a statement: take the ; and the statement after it. Returns 1 to go
+// on, 0 at the end and -1 if the program ends first.
+int statement_list_next(CompilerContext* ctx, Node*** tail) {
+    if (ctx->currentToken->type == semicolonsym) {
+        accept_sync(ctx);
+        // Check if this is an empty statement before end
+        if (ctx->currentToken->type != endsym) {
+            Node* s = statement(ctx);
+            if (s) {
+                **tail = s;
+                *tail = &s->next;
+            }
+        }
+    }
+    else if (ctx->currentToken->type == endsym) {
+        return 0;
+    }
+    else {
+        error(ctx, 9); // begin must be followed by end
+        if (ctx->currentToken->type == periodsym) return -1;
+        // Drop the stray token and resume at the next statement
+        get_next_token(ctx);
+        synchronize(ctx);
+    }
+    return 1;
+}
+
+Node* parse_statement(CompilerContext* ctx) {
+    if (ctx->currentToken->type == identsym) {
+        // Assignment statement
+        int sym_idx = find_symbol(ctx, ctx->currentToken->name);
+        
+        if (sym_idx == -1) {
+            error(ctx, 6); // undeclared identifier
+            synchronize(ctx);
+            return NULL;
+        }
+        if (ctx->symbol_table[sym_idx].kind != 2) {
+            error(ctx, 7); // only variables can be assigned to
+            synchronize(ctx);
+            return NULL;
+        }
+        
+        get_next_token(ctx);
+        if (ctx->currentToken->type != becomessym) {
+            error(ctx, 8); // assignment must use :=
+            synchronize(ctx);
+            return NULL;
+        }
+        
+        get_next_token(ctx);
+        Node* value = expression(ctx);
+        return new_node(ctx, NODE_ASSIGN, levels_out(ctx, sym_idx), ctx->symbol_table[sym_idx].addr,
+                        value, NULL);
+    }
+    else if (ctx->currentToken->type == callsym) {
+        // Call statement
+        get_next_token(ctx);
+        if (ctx->currentToken->type != identsym) {
+            error(ctx, 21); // call must be followed by identifier
+            synchronize(ctx);
+            return NULL;
+        }
+
+        int sym_idx = find_symbol(ctx, ctx->currentToken->name);
+        if (sym_idx == -1) {
+            error(ctx, 6); // undeclared identifier
+            synchronize(ctx);
+            return NULL;
+        }
+        if (ctx->symbol_table[sym_idx].kind != 3) {
+            error(ctx, 23); // only procedures can be called
+            synchronize(ctx);
+            return NULL;
+        }
+
+        get_next_token(ctx);
+        return new_node(ctx, NODE_CALL, 0, sym_idx, NULL, NULL);
+    }
+    else if (ctx->currentToken->type == beginsym) {
+        // Compound statement: the statements are chained through next
+        Node* compound = new_node(ctx, NODE_BEGIN, 0, 0, NULL, NULL);
+        Node** tail = &compound->left;
+        get_next_token(ctx);
+        Node* s = statement(ctx);
+        if (s) {
+            *tail = s;
+            tail = &s->next;
+        }
+        
+        int more;
+        while ((more = statement_list_next(ctx, &tail)) > 0) {}
+        if (more < 0) return compound;
+        accept_sync(ctx);
+        return compound;
+    }
+    else if (ctx->currentToken->type == ifsym) {
+        // If statement
+        get_next_token(ctx);
+        Node* cond = condition(ctx);
+        
+        if (ctx->currentToken->type != thensym) {
+            error(ctx, 10); // if must be followed by then
+            synchronize(ctx);
+            return NULL;
+        }
+        
+        get_next_token(ctx);
+        Node* body = statement(ctx);
+        
+        if (ctx->currentToken->type != fisym) {
+            error(ctx, 15); // then must be followed by fi
+            synchronize(ctx);
+            return NULL;
+        }
+        accept_sync(ctx);
+        return new_node(ctx, NODE_IF, 0, 0, cond, body);
+    }
+    else if (ctx->currentToken->type == whensym) {
+        // When (while) statement
+        get_next_token(ctx);
+        Node* cond = condition(ctx);
+        
+        if (ctx->currentToken->type != dosym) {
+            error(ctx, 11); // when must be followed by do
+            synchronize(ctx);
+            return NULL;
+        }
+        
+        accept_sync(ctx);
+        Node* body = statement(ctx);
+        return new_node(ctx, NODE_WHEN, 0, 0, cond, body);
+    }
+    else if (ctx->currentToken->type == readsym) {
+        // Read statement
+        get_next_token(ctx);
+        if (ctx->currentToken->type != identsym) {
+            error(ctx, 1); // read must be followed by identifier
+            synchronize(ctx);
+            return NULL;
+        }
+        
+        int sym_idx = find_symbol(ctx, ctx->currentToken->name);
+        if (sym_idx == -1) {
+            error(ctx, 6); // undeclared identifier
+            synchronize(ctx);
+            return NULL;
+        }
+        if (ctx->symbol_table[sym_idx].kind != 2) {
+            error(ctx, 7); // only variables can be read into
+            synchronize(ctx);
+            return NULL;
+        }
+        
+        get_next_token(ctx);
+        return new_node(ctx, NODE_READ, levels_out(ctx, sym_idx), ctx->symbol_table[sym_idx].addr,
+                        NULL, NULL);
+    }
+    else if (ctx->currentToken->type == writesym) {
+        // Write statement
+        get_next_token(ctx);
+        Node* value = expression(ctx);
+        return new_node(ctx, NODE_WRITE, 0, 0, value, NULL);
+    }
+    // Empty statement is allowed
+    return NULL;
+}
+
+Node* condition(CompilerContext* ctx) {
+    if (ctx->currentToken->type == oddsym) {
+        get_next_token(ctx);
+        Node* operand = expression(ctx);
+        return new_node(ctx, NODE_ODD, OPR_ODD, 0, operand, NULL); // ODD operation (mod 2)
+    }
+    else {
+        Node* left = expression(ctx);
+        if (ctx->currentToken->type == eqlsym || ctx->currentToken->type == neqsym || 
+            ctx->currentToken->type == lessym || ctx->currentToken->type == leqsym || 
+            ctx->currentToken->type == gtrsym || ctx->currentToken->type == geqsym) {
+            
+            int relop = ctx->currentToken->type;
+            get_next_token(ctx);
+            Node* right = expression(ctx);
+            
+            int op = 0;
+            switch (relop) {
+                case eqlsym: op = OPR_EQL; break;
+                case neqsym: op = OPR_NEQ; break;
+                case lessym: op = OPR_LSS; break;
+                case leqsym: op = OPR_LEQ; break;
+                case gtrsym: op = OPR_GTR; break;
+                case geqsym: op = OPR_GEQ; break;
+            }
+            return new_node(ctx, NODE_BINARY, op, 0, left, right);
+        }
+        else {
+            error(ctx, 12); // condition must contain comparison operator
+            synchronize(ctx);
+            return left;
+        }
+    }
+}
+
+// Expressions are parsed by precedence climbing over an explicit stack
+// rather than by recursing through term() and factor() at every
+// parenthesis, so nesting costs arena memory instead of C stack. The
+// operand being built is kept in a local; an operator waits on exprStack
+// with its left operand until one that binds no tighter arrives or its
+// parenthesis closes. A sign applies to the first term of an expression,
+// so unary minus binds looser than * and / and tighter than binary + and
+// -. The trees are node for node the ones the recursive descent built,
+// and so is the code.
+#define EXPR_PAREN 0  // exprStack marker of an open parenthesis
+
+// Binding power of each exprStack operator, by OPR code
+const unsigned char binding_power[OPR_DIV + 1] = {
+    [EXPR_PAREN] = 0, [OPR_ADD] = 1, [OPR_SUB] = 1, [OPR_NEG] = 2, [OPR_MUL] = 3, [OPR_DIV] = 3
+};
+
+// Binary operator of each token type, 0 for tokens that end an operand's
+// expression; tables keep the operator loop free of data-dependent
+// branches
+const unsigned char infix_operator[procsym + 1] = {
+    [plussym] = OPR_ADD, [minussym] = OPR_SUB, [multsym] = OPR_MUL, [slashsym] = OPR_DIV
+};
+
+// Push an entry on exprStack, which holds depth entries; returns the new
+// depth
+int expr_push(CompilerContext* ctx, int depth, Node* left, int op) {
+    if (depth == ctx->exprCapacity) {
+        GROW_TABLE(ctx->exprStack, ctx->exprCapacity, 64);
+    }
+    ctx->exprStack[depth].left = left;
+    ctx->exprStack[depth].op = op;
+    return depth + 1;
+}
+
+Node* expression(CompilerContext* ctx) {
+    // The whole expression sits in an outermost EXPR_PAREN, so reducing
+    // never has to check for the bottom of the stack
+    int depth = expr_push(ctx, 0, NULL, EXPR_PAREN);  // exprStack entries
+    ExprEntry* stack = ctx->exprStack;
+    int open = 0;        // parentheses open
+    int signAllowed = 1; // at the start of an expression
+    STATS_ENTER(ctx);
+    for (;;) {
+        int type = ctx->currentToken->type;
+        if (signAllowed && (type == plussym || type == minussym)) {
+            if (type == minussym) depth = expr_push(ctx, depth, NULL, OPR_NEG);
+            get_next_token(ctx);
+            type = ctx->currentToken->type;
+        }
+        signAllowed = 0;
+        if (type == lparentsym) {
+            get_next_token(ctx);
+            depth = expr_push(ctx, depth, NULL, EXPR_PAREN);
+            open++;
+            STATS_ENTER(ctx);
+            signAllowed = 1;
+            continue;
+        }
+        stack = ctx->exprStack;
+        Node* operand = factor(ctx);
+
+        // The operator after the operand, or the end of the innermost
+        // expression, which may be the end of a parenthesis. Either way
+        // the waiting operators that bind at least as tightly are applied
+        // first.
+        for (;;) {
+            int op = infix_operator[ctx->currentToken->type];
+            int power = op ? binding_power[op] : 1;
+            while (binding_power[stack[depth - 1].op] >= power) {
+                const ExprEntry* e = &stack[--depth];
+                if (e->op == OPR_NEG) {
+                    operand = new_node(ctx, NODE_NEG, OPR_NEG, 0, operand, NULL);
+                } else {
+                    operand = new_node(ctx, NODE_BINARY, e->op, 0, e->left, operand);
+                }
+            }
+            if (op) {
+                depth = expr_push(ctx, depth, operand, op);
+                get_next_token(ctx);
+                break;
+            }
+            if (ctx->panicking) {
+                // Skip the rest of a broken expression
+                synchronize(ctx);
+            }
+            STATS_LEAVE(ctx);
+            depth--;  // EXPR_PAREN
+            if (open == 0) return operand;
+            open--;
+            if (ctx->currentToken->type != rparentsym) {
+                error(ctx, 13); // right parenthesis must follow left parenthesis
+            } else {
+                get_next_token(ctx);
+            }
+        }
+    }
+}
+
+// Operand of an expression other than a parenthesis, which expression()
+// handles itself. Returns NULL after an error.
+Node* factor(CompilerContext* ctx) {
+    Node* n = NULL;
+    if (ctx->currentToken->type == identsym) {
+        int sym_idx = find_symbol(ctx, ctx->currentToken->name);
+        if (sym_idx == -1) {
+            error(ctx, 6); // undeclared identifier
+        }
+        else if (ctx->symbol_table[sym_idx].kind == 1) {
+            n = new_node(ctx, NODE_LIT, 0, ctx->symbol_table[sym_idx].val, NULL, NULL); // Constant
+        }
+        else if (ctx->symbol_table[sym_idx].kind == 3) {
+            error(ctx, 24); // a procedure has no value
+        }
+        else {
+            n = new_node(ctx, NODE_VAR, levels_out(ctx, sym_idx), ctx->symbol_table[sym_idx].addr,
+                         NULL, NULL); // Variable
+        }
+        
+        get_next_token(ctx);
+    }
+    else if (ctx->currentToken->type == numbersym) {
+        n = new_node(ctx, NODE_LIT, 0, token_value(ctx->currentToken), NULL, NULL);
+        get_next_token(ctx);
+    }
+    else if (ctx->currentToken->type == rparentsym) {
+        error(ctx, 16); // unmatched right parenthesis
+    }
+    else {
+        error(ctx, 14); // invalid factor
+    }
+    return n;
+}
+
+// Peephole optimizer. Runs after program() on code without errors and
+// rewrites code[] until nothing changes:
+//  - a jump to a JMP goes straight to that JMP's final target
+//  - a sliding window over the code folds constant operations, drops
+//    identities (x+0, x-0, x*1, x/1, 0+x, 1*x, x := x, double NEG) and
+//    resolves JPC on a constant
+//  - code no path reaches, such as code after an unconditional JMP, is
+//    removed
+// A window never extends past a jump target, so control flow is kept;
+// jump targets, and the procedure entries CAL targets, are relocated after
+// every pass that moves code.
+
+int is_jump(int op) {
+    return op == JMP || op == JPC;
+}
+
+// Instructions whose M is a code address
+int has_target(int op) {
+    return is_jump(op) || op == CAL;
+}
+
+// Move the procedures' addresses in the symbol table along with their code
+void relocate_procedures(CompilerContext* ctx, const int* newIndex) {
+    for (int i = 0; i < ctx->sym_table_size; i++) {
+        symbol* s = &ctx->symbol_table[i];
+        if (s->kind == 3) s->addr = newIndex[s->addr];
+    }
+}
+
+int fits_literal(int value) {
+    return value >= INSTRUCTION_M_MIN && value <= INSTRUCTION_M_MAX;
+}
+
+// Value of LIT a; LIT b; OPR m, with the VM's wrap-around arithmetic.
+// Returns 0 if the operation must be left to run time, or its value does
+// not fit a LIT.
+int fold_operation(int m, int a, int b, int* value) {
+    unsigned ua = (unsigned)a, ub = (unsigned)b;
+    switch (m) {
+        case OPR_ADD: *value = (int)(ua + ub); return fits_literal(*value);
+        case OPR_SUB: *value = (int)(ua - ub); return fits_literal(*value);
+        case OPR_MUL: *value = (int)(ua * ub); return fits_literal(*value);
+        case OPR_DIV:
+            if (b == 0 || (a == INT_MIN && b == -1)) return 0;  // trap at run time
+            *value = a / b; return fits_literal(*value);
+        case OPR_EQL: *value = a == b; return 1;
+        case OPR_NEQ: *value = a != b; return 1;
+        case OPR_LSS: *value = a < b; return 1;
+        case OPR_LEQ: *value = a <= b; return 1;
+        case OPR_GTR: *value = a > b; return 1;
+        case OPR_GEQ: *value = a >= b; return 1;
+    }
+    return 0;
+}
+
+// Thread jumps through JMPs; returns the number of jumps changed
+int thread_jumps(instruction* code, int n) {
+    int changed = 0;
+    for (int i = 0; i < n; i++) {
+        if (!is_jump(code[i].op)) continue;
+        int t = code[i].M;
+        for (int hops = 0; t < n && code[t].op == JMP && code[t].M != t && hops < n; hops++) {
+            t = code[t].M;
+        }
+        if (t != code[i].M) {
+            code[i].M = t;
+            changed++;
+        }
+    }
+    return changed;
+}
+
+// Try one rewrite at the end of the output code[0..*out). label[k] is set
+// when a jump lands on output instruction k; only the first instruction of
+// a window may be one, and whatever replaces the window takes its place.
+// Returns 1 if the tail was rewritten.
+int rewrite_tail(instruction* code, int* out, const char* label, int* carry) {
+    int k = *out;
+    if (k >= 2 && !label[k - 1]) {
+        instruction* a = &code[k - 2];
+        instruction* b = &code[k - 1];
+        if (a->op == LIT && b->op == OPR && b->M == OPR_NEG && fits_literal(-a->M)) {
+            a->M = (int)(0u - (unsigned)a->M);
+            *out = k - 1;
+            return 1;
+        }
+        if (a->op == LIT && b->op == OPR && b->M == OPR_ODD) {
+            a->M = a->M % 2;
+            *out = k - 1;
+            return 1;
+        }
+        if (a->op == LIT && b->op == JPC) {
+            // JPC jumps when the condition is 0
+            if (a->M == 0) {
+                *a = *b;
+                a->op = JMP;
+                *out = k - 1;
+            } else {
+                *carry = label[k - 2];
+                *out = k - 2;
+            }
+            return 1;
+        }
+        if ((a->op == LIT && b->op == OPR &&
+             (((b->M == OPR_ADD || b->M == OPR_SUB) && a->M == 0) ||
+              ((b->M == OPR_MUL || b->M == OPR_DIV) && a->M == 1))) ||
+            (a->op == OPR && a->M == OPR_NEG && b->op == OPR && b->M == OPR_NEG) ||
+            (a->op == LOD && b->op == STO && a->L == b->L && a->M == b->M)) {
+            *carry = label[k - 2];
+            *out = k - 2;
+            return 1;
+        }
+    }
+    if (k >= 3 && !label[k - 2] && !label[k - 1]) {
+        instruction* a = &code[k - 3];
+        instruction* b = &code[k - 2];
+        instruction* c = &code[k - 1];
+        int value;
+        if (c->op != OPR) return 0;
+        if (a->op == LIT && b->op == LIT && fold_operation(c->M, a->M, b->M, &value)) {
+            a->M = value;
+            *out = k - 2;
+            return 1;
+        }
+        if (a->op == LIT && (b->op == LIT || b->op == LOD) &&
+            ((c->M == OPR_ADD && a->M == 0) || (c->M == OPR_MUL && a->M == 1))) {
+            *a = *b;
+            *out = k - 2;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// One pass of the sliding window; returns the number of instructions removed
+int peephole_window(CompilerContext* ctx, char* label, int* newIndex) {
+    instruction* code = ctx->code;
+    int n = ctx->cx;
+    memset(label, 0, n + 1);
+    for (int i = 0; i < n; i++) {
+        if (has_target(code[i].op)) label[code[i].M] = 1;
+    }
+    char* outLabel = label + n + 1;  // the same for output instructions
+    int out = 0;
+    int carry = 0;  // a removed window's label, owed to the next instruction
+    for (int i = 0; i < n; i++) {
+        newIndex[i] = out;
+        instruction ins = code[i];
+        if (ins.op == JMP && ins.M == i + 1) {
+            carry |= label[i];  // jump to the next instruction
+            continue;
+        }
+        code[out] = ins;
+        outLabel[out] = label[i] | carry;
+        carry = 0;
+        out++;
+        while (rewrite_tail(code, &out, outLabel, &carry)) {
+        }
+    }
+    newIndex[n] = out;
+    for (int i = 0; i < out; i++) {
+        if (has_target(code[i].op)) code[i].M = newIndex[code[i].M];
+    }
+    relocate_procedures(ctx, newIndex);
+    int removed = n - out;
+    ctx->cx = out;
+    return removed;
+}
+
+// Drop code that no path from the entry reaches; returns the number of
+// instructions removed
+int remove_dead_code(CompilerContext* ctx, char* reached, int* newIndex) {
+    instruction* code = ctx->code;
+    int n = ctx->cx;
+    memset(reached, 0, n);
+    int* stack = newIndex;  // free until the compaction below
+    int top = 0;
+    if (n > 0) {
+        stack[top++] = 0;
+        reached[0] = 1;
+    }
+    while (top > 0) {
+        int i = stack[--top];
+        int next[2], count = 0;
+        if (code[i].op == JMP) {
+            next[count++] = code[i].M;
+        } else {
+            if (code[i].op == JPC || code[i].op == CAL) next[count++] = code[i].M;
+            int ends = (code[i].op == SYS && code[i].M == 3) || (code[i].op == OPR && code[i].M == OPR_RTN);
+            if (!ends && i + 1 < n) next[count++] = i + 1;  // HALT and RTN end the path
+        }
+        for (int j = 0; j < count; j++) {
+            if (next[j] < n && !reached[next[j]]) {
+                reached[next[j]] = 1;
+                stack[top++] = next[j];
+            }
+        }
+    }
+    int out = 0;
+    for (int i = 0; i < n; i++) {
+        newIndex[i] = out;
+        if (reached[i]) code[out++] = code[i];
+    }
+    newIndex[n] = out;
+    for (int i = 0; i < out; i++) {
+        if (has_target(code[i].op)) code[i].M = newIndex[code[i].M];
+    }
+    relocate_procedures(ctx, newIndex);
+    ctx->cx = out;
+    return n - out;
+}
+
+void peephole(CompilerContext* ctx) {
+    int n = ctx->cx;
+    char* flags = arena_alloc(&ctx->arena, 2 * (n + 1));
+    int* newIndex = arena_alloc(&ctx->arena, sizeof(int) * (n + 1));
+    int changed;
+    do {
+        changed = thread_jumps(ctx->code, ctx->cx);
+        changed += peephole_window(ctx, flags, newIndex);
+        changed += remove_dead_code(ctx, flags, newIndex);
+    } while (changed);
+}
+
+// Code generation: lower the syntax tree to code[], in the order the
+// parser used to emit it directly
+
+// Code of an expression in postfix order. The walk keeps its work on
+// exprStack rather than the C stack, so it copes with any depth; op is
+// set on a node whose operands are done and whose OPR comes next.
+void gen_expression(CompilerContext* ctx, const Node* n) {
+    int depth = expr_push(ctx, 0, (Node*)n, 0);
+    while (depth > 0) {
+        ExprEntry e = ctx->exprStack[--depth];
+        n = e.left;
+        if (e.op) {
+            emit(ctx, OPR, 0, n->op);
+            continue;
+        }
+        switch (n->kind) {
+            case NODE_LIT:
+                emit(ctx, LIT, 0, n->value);
+                break;
+            case NODE_VAR:
+                emit(ctx, LOD, ctx->genLevel - n->op, n->value);
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+                depth = expr_push(ctx, depth, e.left, 1);
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+            case NODE_BINARY:
+                depth = expr_push(ctx, depth, e.left, 1);
+                depth = expr_push(ctx, depth, n->right, 0);
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+        }
+    }
+}
+
+void gen_statement(CompilerContext* ctx, const Node* n) {
+    if (!n) return;
+    switch (n->kind) {
+        case NODE_ASSIGN:
+            gen_expression(ctx, n->left);
+            emit(ctx, STO, ctx->genLevel - n->op, n->value);
+            break;
+        case NODE_READ:
+            emit(ctx, SYS, 0, 1); // READ
+            emit(ctx, STO, ctx->genLevel - n->op, n->value);
+            break;
+        case NODE_WRITE:
+            gen_expression(ctx, n->left);
+            emit(ctx, SYS, 0, 2); // WRITE
+            break;
+        case NODE_BEGIN:
+            for (const Node* s = n->left; s; s = s->next) {
+                gen_statement(ctx, s);
+            }
+            break;
+        case NODE_IF: {
+            gen_expression(ctx, n->left);
+            int jpc_idx = ctx->cx;
+            emit(ctx, JPC, 0, 0); // Placeholder address
+            gen_statement(ctx, n->right);
+            ctx->code[jpc_idx].M = ctx->cx; // Update jump address
+            break;
+        }
+        case NODE_WHEN: {
+            int loop_idx = ctx->cx;
+            gen_expression(ctx, n->left);
+            int jpc_idx = ctx->cx;
+            emit(ctx, JPC, 0, 0); // Placeholder address
+            gen_statement(ctx, n->right);
+            emit(ctx, JMP, 0, loop_idx);
+            ctx->code[jpc_idx].M = ctx->cx; // Update jump address
+            break;
+        }
+        case NODE_BLOCK: {
+            // Jump over the declarations to the block's code. A procedure
+            // starts at its block's JMP.
+            int outer = ctx->genLevel;
+            ctx->genLevel = n->op;
+            int jmp_idx = ctx->cx;
+            emit(ctx, JMP, 0, 0);
+            for (const Node* p = n->left; p; p = p->next) {
+                ctx->symbol_table[p->value].addr = ctx->cx;
+                gen_statement(ctx, p->left);
+            }
+            ctx->code[jmp_idx].M = ctx->cx;
+            emit(ctx, INC, 0, n->value); // Allocate space for variables
+            gen_statement(ctx, n->right);
+            if (n->op > 0) emit(ctx, OPR, 0, OPR_RTN);  // the main block ends in HALT instead
+            ctx->genLevel = outer;
+            break;
+        }
+        case NODE_CALL: {
+            const symbol* proc = &ctx->symbol_table[n->value];
+            emit(ctx, CAL, proc->level + 1, proc->addr);
+            break;
+        }
+    }
+}
+
+// Number of instructions gen_*() produces for n. Like the other tree walks
+// that reach into expressions, it keeps its work on exprStack.
+int tree_size(CompilerContext* ctx, const Node* n) {
+    int size = 0;
+    int depth = expr_push(ctx, 0, (Node*)n, 0);
+    while (depth > 0) {
+        n = ctx->exprStack[--depth].left;
+        if (!n) continue;
+        switch (n->kind) {
+            case NODE_LIT:
+            case NODE_VAR:
+            case NODE_CALL:
+                size += 1;
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+            case NODE_ASSIGN:
+            case NODE_WRITE:
+                size += 1;
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+            case NODE_BINARY:
+            case NODE_IF:
+                size += 1;
+                depth = expr_push(ctx, depth, n->left, 0);
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+            case NODE_READ:
+                size += 2;
+                break;
+            case NODE_BEGIN:
+                for (Node* s = n->left; s; s = s->next) depth = expr_push(ctx, depth, s, 0);
+                break;
+            case NODE_WHEN:
+                size += 2;
+                depth = expr_push(ctx, depth, n->left, 0);
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+            case NODE_BLOCK:
+                size += 2 + (n->op > 0);
+                depth = expr_push(ctx, depth, n->right, 0);
+                for (Node* p = n->left; p; p = p->next) depth = expr_push(ctx, depth, p->left, 0);
+                break;
+        }
+    }
+    return size;
+}
+
+// Size of expression n, or limit if it is at least that big
+int tree_size_up_to(const Node* n, int limit) {
+    if (limit <= 1 || n->kind == NODE_LIT || n->kind == NODE_VAR) return 1;
+    int size = 1 + tree_size_up_to(n->left, limit - 1);
+    if (n->kind == NODE_BINARY && size < limit) size += tree_size_up_to(n->right, limit - size);
+    return size < limit ? size : limit;
+}
+
+int is_simple_statement(const Node* n) {
+    return n->kind == NODE_ASSIGN || n->kind == NODE_READ || n->kind == NODE_WRITE;
+}
+
+// Turn n into an empty statement, keeping its place in a statement list
+void make_empty(Node* n) {
+    n->kind = NODE_BEGIN;
+    n->left = NULL;
+    n->right = NULL;
+}
+
+// The tree passes below work on one block at a time and only on the
+// variables of its own frame; other frames' variables are left as they
+// are. A call can change or read the block's variables only through the
+// procedures declared inside the block, so calls are a barrier just in
+// blocks that declare procedures.
+
+// Constant propagation. The statements are walked in execution order with
+// the known value of every frame slot. Each change is logged so that an if
+// can keep only what holds on both of its paths and a loop body's
+// knowledge can be dropped at its exit. Known values replace variable
+// loads, constant operations are folded, and an if or when on a constant
+// condition is resolved.
+
+typedef struct {
+    int slot;
+    int known;
+    int value;
+} EnvChange;
+
+typedef struct {
+    char* known;
+    int* value;
+    EnvChange* log;
+    int logCount;
+    int logCapacity;
+    EnvChange* scratch;  // slot states saved by env_merge()
+    int scratchCapacity;
+    int* seen;           // stamp per slot, for env_merge()
+    int stamp;
+    int callSlots;       // slots a call may change: the frame or none
+} ConstEnv;
+
+void env_set(CompilerContext* ctx, ConstEnv* env, int slot, int known, int value) {
+    if (env->known[slot] == known && (!known || env->value[slot] == value)) return;
+    if (env->logCount == env->logCapacity) {
+        GROW_TABLE(env->log, env->logCapacity, 64);
+    }
+    EnvChange* c = &env->log[env->logCount++];
+    c->slot = slot;
+    c->known = env->known[slot];
+    c->value = env->value[slot];
+    env->known[slot] = known;
+    env->value[slot] = value;
+}
+
+// Undo the changes logged since mark
+void env_undo(ConstEnv* env, int mark) {
+    while (env->logCount > mark) {
+        EnvChange* c = &env->log[--env->logCount];
+        env->known[c->slot] = c->known;
+        env->value[c->slot] = c->value;
+    }
+}
+
+// Keep only the values that are the same before and after the changes
+// logged since mark
+void env_merge(CompilerContext* ctx, ConstEnv* env, int mark) {
+    int changes = env->logCount - mark;
+    while (env->scratchCapacity < changes) {
+        GROW_TABLE(env->scratch, env->scratchCapacity, 64);
+    }
+    int count = 0;
+    env->stamp++;
+    for (int i = env->logCount - 1; i >= mark; i--) {
+        int slot = env->log[i].slot;
+        if (env->seen[slot] == env->stamp) continue;
+        env->seen[slot] = env->stamp;
+        env->scratch[count].slot = slot;
+        env->scratch[count].known = env->known[slot];
+        env->scratch[count].value = env->value[slot];
+        count++;
+    }
+    env_undo(env, mark);
+    for (int i = 0; i < count; i++) {
+        EnvChange* after = &env->scratch[i];
+        if (env->known[after->slot] &&
+            !(after->known && after->value == env->value[after->slot])) {
+            env_set(ctx, env, after->slot, 0, 0);
+        }
+    }
+}
+
+void env_kill_call(CompilerContext* ctx, ConstEnv* env) {
+    for (int slot = 0; slot < env->callSlots; slot++) env_set(ctx, env, slot, 0, 0);
+}
+
+// Forget the value of every variable the statement n may change
+void env_kill_assigned(CompilerContext* ctx, ConstEnv* env, const Node* n) {
+    if (!n) return;
+    switch (n->kind) {
+        case NODE_ASSIGN:
+        case NODE_READ:
+            if (n->op == 0) env_set(ctx, env, n->value, 0, 0);
+            break;
+        case NODE_CALL:
+            env_kill_call(ctx, env);
+            break;
+        case NODE_BEGIN:
+            for (const Node* s = n->left; s; s = s->next) env_kill_assigned(ctx, env, s);
+            break;
+        case NODE_IF:
+        case NODE_WHEN:
+        case NODE_BLOCK:
+            env_kill_assigned(ctx, env, n->right);
+            break;
+    }
+}
+
+// Replace known variables in expression n and fold it, operands first
+void fold_expression(CompilerContext* ctx, ConstEnv* env, Node* n) {
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        ExprEntry e = ctx->exprStack[--depth];
+        n = e.left;
+        switch (n->kind) {
+            case NODE_VAR:
+                if (n->op == 0 && env->known[n->value]) {
+                    n->kind = NODE_LIT;
+                    n->value = env->value[n->value];
+                }
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+                if (!e.op) {
+                    depth = expr_push(ctx, depth, n, 1);
+                    depth = expr_push(ctx, depth, n->left, 0);
+                    break;
+                }
+                if (n->left->kind == NODE_LIT && (n->kind == NODE_ODD || fits_literal(-n->left->value))) {
+                    int v = n->left->value;
+                    n->value = n->kind == NODE_NEG ? (int)(0u - (unsigned)v) : v % 2;
+                    n->kind = NODE_LIT;
+                }
+                break;
+            case NODE_BINARY: {
+                if (!e.op) {
+                    depth = expr_push(ctx, depth, n, 1);
+                    depth = expr_push(ctx, depth, n->right, 0);
+                    depth = expr_push(ctx, depth, n->left, 0);
+                    break;
+                }
+                int v;
+                if (n->left->kind == NODE_LIT && n->right->kind == NODE_LIT &&
+                    fold_operation(n->op, n->left->value, n->right->value, &v)) {
+                    n->kind = NODE_LIT;
+                    n->value = v;
+                }
+                break;
+            }
+        }
+    }
+}
+
+void propagate_statement(CompilerContext* ctx, ConstEnv* env, Node* n) {
+    if (!n) return;
+    switch (n->kind) {
+        case NODE_ASSIGN:
+            fold_expression(ctx, env, n->left);
+            if (n->op != 0) break;
+            if (n->left->kind == NODE_LIT) {
+                env_set(ctx, env, n->value, 1, n->left->value);
+            } else {
+                env_set(ctx, env, n->value, 0, 0);
+            }
+            break;
+        case NODE_READ:
+            if (n->op == 0) env_set(ctx, env, n->value, 0, 0);
+            break;
+        case NODE_CALL:
+            env_kill_call(ctx, env);
+            break;
+        case NODE_WRITE:
+            fold_expression(ctx, env, n->left);
+            break;
+        case NODE_BEGIN:
+            for (Node* s = n->left; s; s = s->next) propagate_statement(ctx, env, s);
+            break;
+        case NODE_IF: {
+            fold_expression(ctx, env, n->left);
+            if (n->left->kind == NODE_LIT) {
+                // The if is its body or nothing
+                Node* body = n->left->value ? n->right : NULL;
+                make_empty(n);
+                n->left = body;
+                propagate_statement(ctx, env, body);
+                break;
+            }
+            int mark = env->logCount;
+            propagate_statement(ctx, env, n->right);
+            env_merge(ctx, env, mark);
+            break;
+        }
+        case NODE_WHEN: {
+            // Whatever the loop changes is unknown at its head
+            env_kill_assigned(ctx, env, n->right);
+            fold_expression(ctx, env, n->left);
+            if (n->left->kind == NODE_LIT && n->left->value == 0) {
+                make_empty(n);
+                break;
+            }
+            int mark = env->logCount;
+            propagate_statement(ctx, env, n->right);
+            env_undo(env, mark);
+            break;
+        }
+        case NODE_BLOCK:
+            propagate_statement(ctx, env, n->right);
+            break;
+    }
+}
+
+void propagate_constants(CompilerContext* ctx, Node* root) {
+    int slots = root->value;
+    ConstEnv env = {0};
+    env.known = arena_alloc(&ctx->arena, slots);
+    env.value = arena_alloc(&ctx->arena, sizeof(int) * slots);
+    env.seen = arena_alloc(&ctx->arena, sizeof(int) * slots);
+    memset(env.known, 0, slots);  // variables start out unknown
+    memset(env.seen, 0, sizeof(int) * slots);
+    env.callSlots = root->left ? slots : 0;
+    propagate_statement(ctx, &env, root);
+}
+
+// Common subexpression elimination by local value numbering. A basic block
+// is a run of assignments, reads and writes. Two expressions of a block
+// with the same value number compute the same value; when one costly
+// enough is repeated, it is computed once into a new frame slot and the
+// repeats load that slot.
+
+typedef struct {
+    int epoch;  // basic block the entry belongs to
+    int kind;
+    int op;
+    int a;
+    int b;
+    int vn;
+} ValueEntry;
+
+typedef struct {
+    ValueEntry* table;
+    int tableSize;   // power of two
+    int tableUsed;
+    int* varVN;      // value number of each slot's current contents
+    int* varEpoch;   // block in which varVN was set
+    int* count;      // occurrences of each value number in its block
+    int* temp;       // slot holding a value number's value, 0 if none
+    int vnCapacity;
+    int nextVN;
+    int epoch;
+    Node* root;      // block whose frame gets the temporaries
+    Node** insert;   // where the next temporary's assignment goes
+} ValueNumbering;
+
+int new_value_number(CompilerContext* ctx, ValueNumbering* vn) {
+    if (vn->nextVN == vn->vnCapacity) {
+        int capacity = vn->vnCapacity;
+        GROW_TABLE(vn->count, capacity, 256);
+        capacity = vn->vnCapacity;
+        GROW_TABLE(vn->temp, capacity, 256);
+        for (int i = vn->vnCapacity; i < capacity; i++) {
+            vn->count[i] = 0;
+            vn->temp[i] = 0;
+        }
+        vn->vnCapacity = capacity;
+    }
+    return vn->nextVN++;
+}
+
+int lookup_value(CompilerContext* ctx, ValueNumbering* vn, int kind, int op, int a, int b) {
+    if ((vn->tableUsed + 1) * 2 > vn->tableSize) {
+        ValueEntry* old = vn->table;
+        int oldSize = vn->tableSize;
+        vn->tableSize = oldSize ? oldSize * 2 : 1024;
+        vn->table = arena_alloc(&ctx->arena, sizeof(ValueEntry) * vn->tableSize);
+        for (int i = 0; i < vn->tableSize; i++) vn->table[i].vn = -1;
+        for (int i = 0; i < oldSize; i++) {
+            if (old[i].vn < 0) continue;
+            unsigned h = hash_name((const char*)&old[i], 5 * sizeof(int)) & (vn->tableSize - 1);
+            while (vn->table[h].vn >= 0) h = (h + 1) & (vn->tableSize - 1);
+            vn->table[h] = old[i];
+        }
+    }
+    ValueEntry key = {vn->epoch, kind, op, a, b, -1};
+    unsigned mask = vn->tableSize - 1;
+    unsigned h = hash_name((const char*)&key, 5 * sizeof(int)) & mask;
+    for (;; h = (h + 1) & mask) {
+        ValueEntry* e = &vn->table[h];
+        if (e->vn < 0) {
+            key.vn = new_value_number(ctx, vn);
+            *e = key;
+            vn->tableUsed++;
+            return key.vn;
+        }
+        if (e->epoch == key.epoch && e->kind == kind && e->op == op && e->a == a && e->b == b) {
+            return e->vn;
+        }
+    }
+}
+
+// Number every node of expression n, operands first, into its aux
+void number_expression(CompilerContext* ctx, ValueNumbering* vn, Node* n) {
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        ExprEntry e = ctx->exprStack[--depth];
+        n = e.left;
+        int a, b;
+        switch (n->kind) {
+            case NODE_VAR:
+                if (n->op != 0) {  // may change unseen
+                    n->aux = new_value_number(ctx, vn);
+                    break;
+                }
+                if (vn->varEpoch[n->value] != vn->epoch) {
+                    vn->varEpoch[n->value] = vn->epoch;
+                    vn->varVN[n->value] = new_value_number(ctx, vn);
+                }
+                n->aux = vn->varVN[n->value];
+                break;
+            case NODE_LIT:
+                n->aux = lookup_value(ctx, vn, NODE_LIT, 0, n->value, 0);
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+                if (!e.op) {
+                    depth = expr_push(ctx, depth, n, 1);
+                    depth = expr_push(ctx, depth, n->left, 0);
+                    break;
+                }
+                n->aux = lookup_value(ctx, vn, n->kind, n->op, n->left->aux, 0);
+                break;
+            default:
+                if (!e.op) {
+                    depth = expr_push(ctx, depth, n, 1);
+                    depth = expr_push(ctx, depth, n->right, 0);
+                    depth = expr_push(ctx, depth, n->left, 0);
+                    break;
+                }
+                a = n->left->aux;
+                b = n->right->aux;
+                if ((n->op == OPR_ADD || n->op == OPR_MUL || n->op == OPR_EQL || n->op == OPR_NEQ) && a > b) {
+                    int t = a;  // commutative: one number for both orders
+                    a = b;
+                    b = t;
+                }
+                n->aux = lookup_value(ctx, vn, NODE_BINARY, n->op, a, b);
+                break;
+        }
+    }
+}
+
+// Count the occurrences of each value number. The inside of a repeated
+// expression is not counted again: it goes when the repeat is replaced.
+void count_values(CompilerContext* ctx, ValueNumbering* vn, Node* n) {
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        n = ctx->exprStack[--depth].left;
+        if (n->kind == NODE_LIT || n->kind == NODE_VAR) continue;
+        if (++vn->count[n->aux] > 1) continue;
+        if (n->kind == NODE_BINARY) depth = expr_push(ctx, depth, n->right, 0);
+        depth = expr_push(ctx, depth, n->left, 0);
+    }
+}
+
+void number_statement(CompilerContext* ctx, ValueNumbering* vn, Node* n) {
+    if (n->kind != NODE_READ) {
+        number_expression(ctx, vn, n->left);
+        count_values(ctx, vn, n->left);
+    }
+    if (n->kind != NODE_WRITE && n->op == 0) {
+        // The slot now holds a new value
+        vn->varEpoch[n->value] = vn->epoch;
+        vn->varVN[n->value] = new_value_number(ctx, vn);
+    }
+}
+
+// Replace the repeats in expression n by loads of their temporaries. The
+// first occurrence of a repeat moves, with its own repeats replaced, into
+// an assignment to the temporary placed before the statement; op marks
+// such a moved value whose assignment is due.
+void replace_common(CompilerContext* ctx, ValueNumbering* vn, Node* n) {
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        ExprEntry e = ctx->exprStack[--depth];
+        n = e.left;
+        if (e.op) {
+            Node* assign = new_node(ctx, NODE_ASSIGN, 0, vn->temp[n->aux], n, NULL);
+            assign->next = *vn->insert;
+            *vn->insert = assign;
+            vn->insert = &assign->next;
+            continue;
+        }
+        if (n->kind == NODE_LIT || n->kind == NODE_VAR) continue;
+        // With two or more uses, replacing pays for any cost from 4 up
+        int uses = vn->count[n->aux];
+        int cost = uses < 2 ? 0 : tree_size_up_to(n, 4);
+        if (uses < 2 || cost * uses <= cost + 1 + uses) {
+            if (n->kind == NODE_BINARY) depth = expr_push(ctx, depth, n->right, 0);
+            depth = expr_push(ctx, depth, n->left, 0);
+            continue;
+        }
+        if (!vn->temp[n->aux]) {
+            // First occurrence: compute it into a new slot before the statement
+            vn->temp[n->aux] = vn->root->value++;
+            Node* value = new_node(ctx, n->kind, n->op, n->value, n->left, n->right);
+            value->aux = n->aux;
+            depth = expr_push(ctx, depth, value, 1);
+            if (value->kind == NODE_BINARY) depth = expr_push(ctx, depth, value->right, 0);
+            depth = expr_push(ctx, depth, value->left, 0);
+        }
+        n->kind = NODE_VAR;
+        n->op = 0;
+        n->value = vn->temp[n->aux];
+        n->left = NULL;
+        n->right = NULL;
+    }
+}
+
+void cse_statement(CompilerContext* ctx, ValueNumbering* vn, Node* n);
+
+void cse_list(CompilerContext* ctx, ValueNumbering* vn, Node** link) {
+    while (*link) {
+        Node* s = *link;
+        if (!is_simple_statement(s)) {
+            cse_statement(ctx, vn, s);
+            link = &s->next;
+            continue;
+        }
+        vn->epoch++;
+        for (Node* t = s; t && is_simple_statement(t); t = t->next) {
+            number_statement(ctx, vn, t);
+        }
+        while (*link && is_simple_statement(*link)) {
+            Node* t = *link;
+            vn->insert = link;
+            if (t->kind != NODE_READ) replace_common(ctx, vn, t->left);
+            link = &t->next;
+        }
+    }
+}
+
+// A lone assignment or write as the body of an if, when or block becomes a
+// list of one, so temporaries can be placed in front of it
+void cse_body(CompilerContext* ctx, ValueNumbering* vn, Node** body) {
+    if (!*body) return;
+    if (is_simple_statement(*body)) {
+        *body = new_node(ctx, NODE_BEGIN, 0, 0, *body, NULL);
+    }
+    cse_statement(ctx, vn, *body);
+}
+
+void cse_statement(CompilerContext* ctx, ValueNumbering* vn, Node* n) {
+    switch (n->kind) {
+        case NODE_BEGIN:
+            cse_list(ctx, vn, &n->left);
+            break;
+        case NODE_IF:
+        case NODE_WHEN:
+        case NODE_BLOCK:
+            cse_body(ctx, vn, &n->right);
+            break;
+    }
+}
+
+void eliminate_common_subexpressions(CompilerContext* ctx, Node* root) {
+    ValueNumbering vn = {0};
+    int slots = root->value;
+    vn.varVN = arena_alloc(&ctx->arena, sizeof(int) * slots);
+    vn.varEpoch = arena_alloc(&ctx->arena, sizeof(int) * slots);
+    memset(vn.varEpoch, 0, sizeof(int) * slots);
+    vn.root = root;
+    cse_statement(ctx, &vn, root);
+}
+
+// Liveness of frame slots, computed backwards over the tree with one bit
+// per slot. Dead store elimination drops assignments whose value is never
+// read, unless evaluating them could trap.
+
+typedef unsigned long long SlotWord;
+#define SLOT_BITS 64
+#define SLOT_TEST(set, s) (((set)[(s) / SLOT_BITS] >> ((s) % SLOT_BITS)) & 1)
+#define SLOT_ADD(set, s) ((set)[(s) / SLOT_BITS] |= 1ULL << ((s) % SLOT_BITS))
+#define SLOT_REMOVE(set, s) ((set)[(s) / SLOT_BITS] &= ~(1ULL << ((s) % SLOT_BITS)))
+
+typedef struct {
+    CompilerContext* ctx;  // for the expression walks
+    int words;             // SlotWords per set
+    int shared;            // calls may read any slot
+} Liveness;
+
+SlotWord* slot_set_copy(const Liveness* lv, const SlotWord* from) {
+    SlotWord* set = malloc(sizeof(SlotWord) * lv->words);
+    if (!set) {
+        out_of_memory();
+    }
+    memcpy(set, from, sizeof(SlotWord) * lv->words);
+    return set;
+}
+
+// Add the slots expression n reads to live
+void add_uses(const Liveness* lv, SlotWord* live, Node* n) {
+    CompilerContext* ctx = lv->ctx;
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        n = ctx->exprStack[--depth].left;
+        switch (n->kind) {
+            case NODE_VAR:
+                if (n->op == 0) SLOT_ADD(live, n->value);
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+            case NODE_BINARY:
+                depth = expr_push(ctx, depth, n->left, 0);
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+        }
+    }
+}
+
+// Division by anything but a nonzero constant may stop the program
+int can_trap(const Liveness* lv, Node* n) {
+    CompilerContext* ctx = lv->ctx;
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        n = ctx->exprStack[--depth].left;
+        switch (n->kind) {
+            case NODE_NEG:
+            case NODE_ODD:
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+            case NODE_BINARY:
+                if (n->op == OPR_DIV && !(n->right->kind == NODE_LIT && n->right->value != 0)) return 1;
+                depth = expr_push(ctx, depth, n->left, 0);
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+        }
+    }
+    return 0;
+}
+
+// live holds the slots live after n; on return, those live before it
+void live_statement(const Liveness* lv, Node* n, SlotWord* live, int removeDead) {
+    if (!n) return;
+    switch (n->kind) {
+        case NODE_ASSIGN:
+            if (n->op != 0) {  // another frame's variable is always kept
+                add_uses(lv, live, n->left);
+                break;
+            }
+            if (removeDead && !SLOT_TEST(live, n->value) && !can_trap(lv, n->left)) {
+                make_empty(n);
+                return;
+            }
+            SLOT_REMOVE(live, n->value);
+            add_uses(lv, live, n->left);
+            break;
+        case NODE_READ:
+            if (n->op == 0) SLOT_REMOVE(live, n->value);
+            break;
+        case NODE_CALL:
+            if (lv->shared) memset(live, 0xff, sizeof(SlotWord) * lv->words);
+            break;
+        case NODE_WRITE:
+            add_uses(lv, live, n->left);
+            break;
+        case NODE_BEGIN: {
+            int count = 0;
+            for (Node* s = n->left; s; s = s->next) count++;
+            if (count == 0) break;
+            Node** list = malloc(sizeof(Node*) * count);
+            if (!list) {
+                out_of_memory();
+            }
+            count = 0;
+            for (Node* s = n->left; s; s = s->next) list[count++] = s;
+            while (count > 0) live_statement(lv, list[--count], live, removeDead);
+            free(list);
+            break;
+        }
+        case NODE_IF: {
+            SlotWord* out = slot_set_copy(lv, live);
+            live_statement(lv, n->right, live, removeDead);
+            for (int i = 0; i < lv->words; i++) live[i] |= out[i];
+            add_uses(lv, live, n->left);
+            free(out);
+            break;
+        }
+        case NODE_WHEN: {
+            // Live at the head: live after the loop, used by the condition,
+            // or live into the body from the head; grown to a fixpoint
+            SlotWord* out = slot_set_copy(lv, live);
+            SlotWord* head = slot_set_copy(lv, live);
+            add_uses(lv, head, n->left);
+            SlotWord* body = slot_set_copy(lv, head);
+            for (;;) {
+                live_statement(lv, n->right, body, 0);
+                for (int i = 0; i < lv->words; i++) body[i] |= out[i];
+                add_uses(lv, body, n->left);
+                if (memcmp(body, head, sizeof(SlotWord) * lv->words) == 0) break;
+                memcpy(head, body, sizeof(SlotWord) * lv->words);
+            }
+            if (removeDead) {
+                live_statement(lv, n->right, body, 1);
+            }
+            memcpy(live, head, sizeof(SlotWord) * lv->words);
+            free(out);
+            free(head);
+            free(body);
+            break;
+        }
+        case NODE_BLOCK:
+            live_statement(lv, n->right, live, removeDead);
+            break;
+    }
+}
+
+// Slots live at the program's entry, that is possibly read before being
+// set; with removeDead, dead stores are dropped on the way
+SlotWord* live_at_entry(CompilerContext* ctx, Node* root, int removeDead) {
+    Liveness lv = {ctx, (root->value + SLOT_BITS - 1) / SLOT_BITS, root->left != NULL};
+    SlotWord* live = arena_alloc(&ctx->arena, sizeof(SlotWord) * lv.words);
+    memset(live, 0, sizeof(SlotWord) * lv.words);  // nothing is live at HALT
+    live_statement(&lv, root, live, removeDead);
+    return live;
+}
+
+// Slot compaction. A variable's live range runs from its first to its last
+// reference in code order, stretched over every loop that references it,
+// and starts at the entry if it may be read before being set. Variables
+// whose ranges do not overlap share a slot, and the frame shrinks to the
+// largest number of ranges open at once. Blocks that declare procedures
+// keep their layout, since the procedures address the frame too.
+
+typedef struct {
+    int first;  // -1 if the slot is never referenced
+    int last;
+} LiveRange;
+
+void range_touch(LiveRange* r, int slot, int pos) {
+    if (r[slot].first < 0) r[slot].first = pos;
+    r[slot].last = pos;
+}
+
+// Stretch the ranges of the variables n references over [start, end]
+void range_stretch(CompilerContext* ctx, LiveRange* r, Node* n, int start, int end) {
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        n = ctx->exprStack[--depth].left;
+        if (!n) continue;
+        switch (n->kind) {
+            case NODE_VAR:
+            case NODE_ASSIGN:
+            case NODE_READ:
+                if (n->op != 0) break;
+                if (r[n->value].first > start) r[n->value].first = start;
+                if (r[n->value].last < end) r[n->value].last = end;
+                break;
+        }
+        switch (n->kind) {
+            case NODE_BEGIN:
+                for (Node* s = n->left; s; s = s->next) depth = expr_push(ctx, depth, s, 0);
+                break;
+            case NODE_BINARY:
+            case NODE_IF:
+            case NODE_WHEN:
+                depth = expr_push(ctx, depth, n->left, 0);
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+            case NODE_ASSIGN:
+            case NODE_WRITE:
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+            case NODE_BLOCK:
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+        }
+    }
+}
+
+// Record the variable references of expression n, left to right, at
+// positions from *pos on
+void collect_expression_ranges(CompilerContext* ctx, LiveRange* r, Node* n, int* pos) {
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        n = ctx->exprStack[--depth].left;
+        switch (n->kind) {
+            case NODE_VAR:
+                if (n->op == 0) range_touch(r, n->value, *pos);
+                (*pos)++;
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+            case NODE_BINARY:
+                depth = expr_push(ctx, depth, n->right, 0);
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+        }
+    }
+}
+
+void collect_ranges(CompilerContext* ctx, LiveRange* r, Node* n, int* pos) {
+    if (!n) return;
+    switch (n->kind) {
+        case NODE_WRITE:
+            collect_expression_ranges(ctx, r, n->left, pos);
+            break;
+        case NODE_IF:
+            collect_expression_ranges(ctx, r, n->left, pos);
+            collect_ranges(ctx, r, n->right, pos);
+            break;
+        case NODE_ASSIGN:
+            collect_expression_ranges(ctx, r, n->left, pos);
+            if (n->op == 0) range_touch(r, n->value, *pos);
+            (*pos)++;
+            break;
+        case NODE_READ:
+            if (n->op == 0) range_touch(r, n->value, *pos);
+            (*pos)++;
+            break;
+        case NODE_BEGIN:
+            for (Node* s = n->left; s; s = s->next) collect_ranges(ctx, r, s, pos);
+            break;
+        case NODE_WHEN: {
+            int start = (*pos)++;
+            collect_expression_ranges(ctx, r, n->left, pos);
+            collect_ranges(ctx, r, n->right, pos);
+            int end = (*pos)++;
+            range_stretch(ctx, r, n, start, end);
+            break;
+        }
+        case NODE_BLOCK:
+            collect_ranges(ctx, r, n->right, pos);
+            break;
+    }
+}
+
+void remap_slots(CompilerContext* ctx, Node* n, const int* newSlot) {
+    int depth = expr_push(ctx, 0, n, 0);
+    while (depth > 0) {
+        n = ctx->exprStack[--depth].left;
+        if (!n) continue;
+        switch (n->kind) {
+            case NODE_VAR:
+            case NODE_ASSIGN:
+            case NODE_READ:
+                if (n->op == 0) n->value = newSlot[n->value];
+                break;
+        }
+        switch (n->kind) {
+            case NODE_BEGIN:
+                for (Node* s = n->left; s; s = s->next) depth = expr_push(ctx, depth, s, 0);
+                break;
+            case NODE_BINARY:
+            case NODE_IF:
+            case NODE_WHEN:
+                depth = expr_push(ctx, depth, n->left, 0);
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+            case NODE_NEG:
+            case NODE_ODD:
+            case NODE_ASSIGN:
+            case NODE_WRITE:
+                depth = expr_push(ctx, depth, n->left, 0);
+                break;
+            case NODE_BLOCK:
+                depth = expr_push(ctx, depth, n->right, 0);
+                break;
+        }
+    }
+}
+
+// A variable's slot with the start of its range, for sorting by start
+typedef struct {
+    int first;
+    int slot;
+} RangeStart;
+
+int compare_range_start(const void* a, const void* b) {
+    const RangeStart* x = a;
+    const RangeStart* y = b;
+    if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    return x->slot - y->slot;
+}
+
+void compact_slots(CompilerContext* ctx, Node* root, const SlotWord* liveIn) {
+    if (root->left) return;
+    int slots = root->value;
+    LiveRange* r = arena_alloc(&ctx->arena, sizeof(LiveRange) * slots);
+    for (int i = 0; i < slots; i++) r[i].first = -1;
+    int pos = 1;
+    collect_ranges(ctx, r, root, &pos);
+    int count = 0;
+    RangeStart* starts = arena_alloc(&ctx->arena, sizeof(RangeStart) * slots);
+    for (int i = 3; i < slots; i++) {
+        if (r[i].first < 0) continue;
+        if (SLOT_TEST(liveIn, i)) r[i].first = 0;
+        starts[count].first = r[i].first;
+        starts[count++].slot = i;
+    }
+    qsort(starts, count, sizeof(RangeStart), compare_range_start);
+    int* order = arena_alloc(&ctx->arena, sizeof(int) * slots);
+    for (int k = 0; k < count; k++) order[k] = starts[k].slot;
+
+    // Linear scan: the open ranges are kept in a heap by end, and the
+    // slots they release are reused lowest first
+    int* newSlot = arena_alloc(&ctx->arena, sizeof(int) * slots);
+    for (int i = 0; i < slots; i++) newSlot[i] = ADDR_REMOVED;  // unless it is used
+    int* open = arena_alloc(&ctx->arena, sizeof(int) * (count + 1));
+    char* used = arena_alloc(&ctx->arena, count + 3);
+    memset(used, 0, count + 3);
+    int openCount = 0, frame = 3, lowestFree = 3;
+    for (int k = 0; k < count; k++) {
+        int v = order[k];
+        while (openCount > 0 && r[open[0]].last < r[v].first) {
+            int done = open[0];
+            used[newSlot[done]] = 0;
+            if (newSlot[done] < lowestFree) lowestFree = newSlot[done];
+            open[0] = open[--openCount];
+            for (int i = 0;;) {
+                int c = 2 * i + 1;
+                if (c >= openCount) break;
+                if (c + 1 < openCount && r[open[c + 1]].last < r[open[c]].last) c++;
+                if (r[open[i]].last <= r[open[c]].last) break;
+                int t = open[i]; open[i] = open[c]; open[c] = t;
+                i = c;
+            }
+        }
+        while (used[lowestFree]) lowestFree++;
+        newSlot[v] = lowestFree;
+        used[lowestFree] = 1;
+        if (lowestFree + 1 > frame) frame = lowestFree + 1;
+        int i = openCount++;
+        open[i] = v;
+        while (i > 0 && r[open[(i - 1) / 2]].last > r[open[i]].last) {
+            int p = (i - 1) / 2;
+            int t = open[i]; open[i] = open[p]; open[p] = t;
+            i = p;
+        }
+    }
+    remap_slots(ctx, root, newSlot);
+    root->value = frame;
+    // The block's variables are the ones at its level up to the end of its scope
+    int level = root->op;
+    for (int i = root->aux; i < ctx->sym_table_size && ctx->symbol_table[i].level >= level; i++) {
+        symbol* s = &ctx->symbol_table[i];
+        if (s->kind == 2 && s->level == level && s->addr < slots) s->addr = newSlot[s->addr];
+    }
+}
+
+// Register code generation (TARGET_REGISTER). Variables are used in place
+// as registers, so x := y * 2 is the single MUL x, y, #2. While generating,
+// a temporary is numbered frame + t and constant i is -1 - i; both move to
+// their final registers once the numbers of temporaries and constants are
+// known. Loops are laid out with the test at the bottom, so each iteration
+// takes one conditional jump.
+
+void reg_emit(CompilerContext* ctx, int op, int d, int a, int b) {
+    if (ctx->regLength == ctx->regCapacity) {
+        GROW_TABLE(ctx->regCode, ctx->regCapacity, 256);
+    }
+    RegInstruction* in = &ctx->regCode[ctx->regLength++];
+    in->op = op;
+    in->d = d;
+    in->a = a;
+    in->b = b;
+}
+
+// Operand for the constant value, shared by all its uses
+int reg_constant(CompilerContext* ctx, int value) {
+    for (int i = 0; i < ctx->regConstantCount; i++) {
+        if (ctx->regConstants[i] == value) return -1 - i;
+    }
+    if (ctx->regConstantCount == ctx->regConstantCapacity) {
+        GROW_TABLE(ctx->regConstants, ctx->regConstantCapacity, 16);
+    }
+    ctx->regConstants[ctx->regConstantCount] = value;
+    return -1 - ctx->regConstantCount++;
+}
+
+int reg_temp(CompilerContext* ctx) {
+    int t = ctx->regTemps++;
+    if (ctx->regTemps > ctx->regMaxTemps) ctx->regMaxTemps = ctx->regTemps;
+    return ctx->regFrame + t;
+}
+
+int reg_leaf(const Node* n) {
+    return n->kind == NODE_LIT || n->kind == NODE_VAR;
+}
+
+// Operand for n, which is in temporary t unless n is a number or a variable
+int reg_operand(CompilerContext* ctx, const Node* n, int t) {
+    if (n->kind == NODE_LIT) return reg_constant(ctx, n->value);
+    if (n->kind == NODE_VAR) return n->value;
+    return t;
+}
+
+// Operand holding the value of n, computed into dst if dst >= 0 and an
+// instruction is needed. Each operand that needs an instruction takes the
+// next temporary, freed again when its parent has used it.
+int reg_expression(CompilerContext* ctx, const Node* n, int dst) {
+    if (reg_leaf(n)) return reg_operand(ctx, n, 0);
+    int depth = expr_push(ctx, 0, (Node*)n, 0);
+    while (depth > 0) {
+        ExprEntry e = ctx->exprStack[--depth];
+        const Node* m = e.left;
+        if (!e.op) {
+            switch (m->kind) {
+                case NODE_LIT:
+                    reg_constant(ctx, m->value);  // numbered in order of use
+                    break;
+                case NODE_VAR:
+                    break;
+                case NODE_NEG:
+                    depth = expr_push(ctx, depth, e.left, 1);
+                    depth = expr_push(ctx, depth, m->left, 0);
+                    break;
+                default:
+                    depth = expr_push(ctx, depth, e.left, 1);
+                    depth = expr_push(ctx, depth, m->right, 0);
+                    depth = expr_push(ctx, depth, m->left, 0);
+                    break;
+            }
+            continue;
+        }
+        // The operands done so far hold the temporaries from m's own on
+        int left = !reg_leaf(m->left);
+        int right = m->kind != NODE_NEG && !reg_leaf(m->right);
+        int temps = ctx->regTemps - left - right;
+        int a = reg_operand(ctx, m->left, ctx->regFrame + temps);
+        ctx->regTemps = temps;
+        if (m->kind == NODE_NEG) {
+            reg_emit(ctx, REG_NEG, m == n && dst >= 0 ? dst : reg_temp(ctx), a, 0);
+        } else {
+            int b = reg_operand(ctx, m->right, ctx->regFrame + temps + left);
+            int d = m == n && dst >= 0 ? dst : reg_temp(ctx);
+            reg_emit(ctx, REG_ADD + (m->op - OPR_ADD), d, a, b);
+        }
+    }
+    // n was finished last
+    return dst >= 0 ? dst : ctx->regCode[ctx->regLength - 1].d;
+}
+
+// Jump to target when the condition n is (when) true or false
+int reg_branch(CompilerContext* ctx, const Node* n, int when) {
+    static const int jumps[6] = {REG_JEQ, REG_JNE, REG_JLT, REG_JLE, REG_JGT, REG_JGE};
+    static const int negated[6] = {REG_JNE, REG_JEQ, REG_JGE, REG_JGT, REG_JLE, REG_JLT};
+    int temps = ctx->regTemps;
+    int at;
+    if (n->kind == NODE_ODD) {
+        int a = reg_expression(ctx, n->left, -1);
+        at = ctx->regLength;
+        reg_emit(ctx, when ? REG_JODD : REG_JEVEN, 0, a, 0);
+    } else if (n->kind == NODE_BINARY && n->op >= OPR_EQL) {
+        int a = reg_expression(ctx, n->left, -1);
+        int b = reg_expression(ctx, n->right, -1);
+        at = ctx->regLength;
+        int k = n->op - OPR_EQL;
+        reg_emit(ctx, when ? jumps[k] : negated[k], 0, a, b);
+    } else {
+        // A condition folded to a number: true unless 0
+        int a = reg_expression(ctx, n, -1);
+        at = ctx->regLength;
+        reg_emit(ctx, when ? REG_JNE : REG_JEQ, 0, a, reg_constant(ctx, 0));
+    }
+    ctx->regTemps = temps;
+    return at;  // the caller fills in the target
+}
+
+void reg_statement(CompilerContext* ctx, const Node* n) {
+    if (!n) return;
+    switch (n->kind) {
+        case NODE_ASSIGN: {
+            int value = reg_expression(ctx, n->left, n->value);
+            if (value != n->value) reg_emit(ctx, REG_MOV, n->value, value, 0);
+            break;
+        }
+        case NODE_READ:
+            reg_emit(ctx, REG_READ, n->value, 0, 0);
+            break;
+        case NODE_WRITE: {
+            int temps = ctx->regTemps;
+            reg_emit(ctx, REG_WRITE, 0, reg_expression(ctx, n->left, -1), 0);
+            ctx->regTemps = temps;
+            break;
+        }
+        case NODE_BEGIN:
+            for (const Node* s = n->left; s; s = s->next) {
+                reg_statement(ctx, s);
+            }
+            break;
+        case NODE_IF: {
+            int jump = reg_branch(ctx, n->left, 0);
+            reg_statement(ctx, n->right);
+            ctx->regCode[jump].d = ctx->regLength;
+            break;
+        }
+        case NODE_WHEN: {
+            int enter = ctx->regLength;
+            reg_emit(ctx, REG_JMP, 0, 0, 0);
+            int body = ctx->regLength;
+            reg_statement(ctx, n->right);
+            ctx->regCode[enter].d = ctx->regLength;
+            int jump = reg_branch(ctx, n->left, 1);
+            ctx->regCode[jump].d = body;
+            break;
+        }
+        case NODE_BLOCK:
+            reg_statement(ctx, n->right);
+            break;
+    }
+}
+
+void generate_register_code(CompilerContext* ctx, Node* tree) {
+    ctx->regFrame = tree->value;
+    reg_statement(ctx, tree);
+    reg_emit(ctx, REG_HALT, 0, 0, 0);
+
+    // Temporaries follow the frame, constants follow the temporaries
+    int base = ctx->regFrame + ctx->regMaxTemps;
+    for (int i = 0; i < ctx->regLength; i++) {
+        RegInstruction* in = &ctx->regCode[i];
+        if (in->a < 0) in->a = base - 1 - in->a;
+        if (in->b < 0) in->b = base - 1 - in->b;
+    }
+    ctx->regConstantBase = base;
+}
+
+void record_pass(CompilerContext* ctx, const char* name, int before, int after) {
+    PassStat* p = &ctx->passStats[ctx->passCount++];
+    p->name = name;
+    p->before = before;
+    p->after = after;
+}
+
+// Blocks of the program, the main block first
+Node** list_blocks(CompilerContext* ctx, Node* tree, int* count) {
+    int n = 1;
+    for (int i = 0; i < ctx->sym_table_size; i++) n += ctx->symbol_table[i].kind == 3;
+    Node** blocks = arena_alloc(&ctx->arena, sizeof(Node*) * n);
+    blocks[0] = tree;
+    *count = 1;
+    for (int i = 0; i < *count; i++) {
+        for (Node* p = blocks[i]->left; p; p = p->next) blocks[(*count)++] = p->left;
+    }
+    return blocks;
+}
+
+// Run the selected passes over the tree and lower it to code[], or to
+// register code
+void generate(CompilerContext* ctx, Node* tree) {
+    if (ctx->target == TARGET_REGISTER && tree->left) {
+        add_error(ctx, -1, 0, "the register target does not support procedures");
+        return;
+    }
+
+    // Tree sizes are only needed around the tree passes
+    int treePasses = ctx->optPasses & (PASS_CONSTPROP | PASS_CSE | PASS_DSE | PASS_SLOTS);
+    int size = treePasses ? tree_size(ctx, tree) + 1 : 0; // with the final HALT
+    int initial = size;
+    int count = 0;
+    Node** blocks = treePasses ? list_blocks(ctx, tree, &count) : NULL;
+    if (ctx->optPasses & PASS_CONSTPROP) {
+        for (int i = 0; i < count; i++) propagate_constants(ctx, blocks[i]);
+        record_pass(ctx, "constprop", size, tree_size(ctx, tree) + 1);
+        size = tree_size(ctx, tree) + 1;
+    }
+    if (ctx->optPasses & PASS_CSE) {
+        for (int i = 0; i < count; i++) eliminate_common_subexpressions(ctx, blocks[i]);
+        record_pass(ctx, "cse", size, tree_size(ctx, tree) + 1);
+        size = tree_size(ctx, tree) + 1;
+    }
+    if (ctx->optPasses & (PASS_DSE | PASS_SLOTS)) {
+        int frames = 0, compacted = 0;  // total frame sizes
+        for (int i = 0; i < count; i++) {
+            SlotWord* liveIn = live_at_entry(ctx, blocks[i], ctx->optPasses & PASS_DSE);
+            frames += blocks[i]->value;
+            if (ctx->optPasses & PASS_SLOTS) compact_slots(ctx, blocks[i], liveIn);
+            compacted += blocks[i]->value;
+        }
+        if (ctx->optPasses & PASS_DSE) {
+            record_pass(ctx, "dse", size, tree_size(ctx, tree) + 1);
+            size = tree_size(ctx, tree) + 1;
+        }
+        if (ctx->optPasses & PASS_SLOTS) {
+            record_pass(ctx, "slots", frames, compacted);
+        }
+    }
+    if (ctx->target == TARGET_REGISTER) {
+        generate_register_code(ctx, tree);
+        return;
+    }
+    gen_statement(ctx, tree);
+    emit(ctx, SYS, 0, 3); // HALT instruction
+    if (ctx->hasError) return;
+    if (!treePasses) initial = ctx->cx;  // the code is as long as the tree
+    if (ctx->optPasses & PASS_PEEPHOLE) {
+        int before = ctx->cx;
+        peephole(ctx);
+        record_pass(ctx, "peephole", before, ctx->cx);
+    }
+    ctx->codeSaved = initial - ctx->cx;
+}
+
+// Compiler context lifetime and the compile entry points
+
+CompilerContext* compiler_create() {
+    CompilerContext* ctx = calloc(1, sizeof(CompilerContext));
+    if (!ctx) return NULL;
+    ctx->simdLevel = detect_simd_level();
+    ctx->lexThreads = 1;
+    ctx->names = &ctx->namePool;
+    ctx->current_level = -1;
+    ctx->currentToken = &ctx->tokenView;
+    return ctx;
+}
+
+void compiler_set_optimization(CompilerContext* ctx, int level) {
+    ctx->optPasses = level <= 0 ? 0 : level == 1 ? PASS_PEEPHOLE : PASS_ALL;
+}
+
+void compiler_set_passes(CompilerContext* ctx, int passes) {
+    ctx->optPasses = passes & PASS_ALL;
+}
+
+void compiler_set_target(CompilerContext* ctx, int target) {
+    ctx->target = target;
+}
+
+void compiler_set_lex_threads(CompilerContext* ctx, int threads) {
+    ctx->lexThreads = threads;
+}
+
+void compiler_destroy(CompilerContext* ctx) {
+    if (!ctx) return;
+    arena_release(&ctx->arena);
+    name_pool_free(&ctx->namePool);
+    free(ctx);
+}
+
+// Forget the previous compile; the arena keeps its blocks and the name
+// pool its tables for this one
+void compiler_reset(CompilerContext* ctx) {
+    Arena arena = ctx->arena;
+    NamePool namePool = ctx->namePool;
+    int simdLevel = ctx->simdLevel;
+    int optPasses = ctx->optPasses;
+    int target = ctx->target;
+    int lexThreads = ctx->lexThreads;
+    memset(ctx, 0, sizeof(*ctx));
+    arena_reset(&arena);
+    ctx->arena = arena;
+    ctx->simdLevel = simdLevel;
+    ctx->optPasses = optPasses;
+    ctx->target = target;
+    ctx->lexThreads = lexThreads;
+    ctx->namePool = namePool;
+    name_pool_clear(&ctx->namePool);
+    ctx->names = &ctx->namePool;
+    ctx->current_level = -1;
+    ctx->currentToken = &ctx->tokenView;
+}
+
+void fill_result(CompilerContext* ctx, CompileResult* result) {
+    result->code = ctx->code;
+    result->codeLength = ctx->hasError ? 0 : ctx->cx;
+    result->codeSaved = ctx->codeSaved;
+    result->passes = ctx->passStats;
+    result->passCount = ctx->passCount;
+    result->reg.code = ctx->regCode;
+    result->reg.length = ctx->hasError ? 0 : ctx->regLength;
+    result->reg.registers = ctx->regConstantBase + ctx->regConstantCount;
+    result->reg.constants = ctx->regConstants;
+    result->reg.constantBase = ctx->regConstantBase;
+    result->reg.constantCount = ctx->regConstantCount;
+    result->symbols = ctx->symbol_table;
+    result->symbolCount = ctx->sym_table_size;
+    result->errors = ctx->errors;
+    result->errorCount = ctx->errorCount;
+#if PL0_STATS
+    if (!ctx->streaming) ctx->stats.tokens = ctx->tokenCount;
+    ctx->stats.symbols = ctx->sym_table_size;
+    ctx->stats.names = ctx->names->count;
+    ctx->stats.probes = ctx->names->probes;
+    ctx->stats.instructions = ctx->target == TARGET_REGISTER ? result->reg.length : result->codeLength;
+    ctx->stats.arenaBytes = arena_size(&ctx->arena) + sizeof(PooledName) * ctx->namePool.capacity +
+                            sizeof(int) * ctx->namePool.slotCount;
+#endif
+    result->stats = &ctx->stats;
+}
+
+// Lex and parse the source already loaded into ctx
+int compile_loaded(CompilerContext* ctx, CompileResult* result) {
+    STATS_START(lexClock);
+    scanTokens(ctx);
+    STATS_STOP(&ctx->stats, lexClock, PHASE_LEX);
+    if (!ctx->hasError) {
+        STATS_START(parseClock);
+        Node* tree = program(ctx);
+        if (!ctx->hasError) generate(ctx, tree);
+        STATS_STOP(&ctx->stats, parseClock, PHASE_PARSE);
+    }
+    fill_result(ctx, result);
+    return ctx->hasError;
+}
+
+// Compiles that could not be done
+const Error source_too_large = {-1, 0, -1, "program too large: sources are limited to 2 GB"};
+const Error compile_out_of_memory = {-1, 0, -1, "out of memory"};
+
+// Report a compile that could not be done as its single error
+int compile_refused(CompilerContext* ctx, CompileResult* result, const Error* error) {
+    compiler_reset(ctx);
+    ctx->hasError = 1;
+    fill_result(ctx, result);
+    result->errors = error;
+    result->errorCount = 1;
+    return 1;
+}
+
+int compile_buffer(CompilerContext* ctx, const char* src, size_t len, CompileResult* result) {
+    if (len > (size_t)(INT_MAX - SOURCE_PADDING)) {
+        return compile_refused(ctx, result, &source_too_large);
+    }
+    jmp_buf jump;
+    jmp_buf* outer = out_of_memory_jump;
+    out_of_memory_jump = &jump;
+    if (setjmp(jump)) {
+        out_of_memory_jump = outer;
+        return compile_refused(ctx, result, &compile_out_of_memory);
+    }
+    compiler_reset(ctx);
+    ctx->source = arena_alloc(&ctx->arena, len + SOURCE_PADDING);
+    memcpy(ctx->source, src, len);
+    memset(ctx->source + len, 0, SOURCE_PADDING);
+    ctx->sourceLength = (int)len;
+    int failed = compile_loaded(ctx, result);
+    out_of_memory_jump = outer;
+    return failed;
+}
+
+int compile_stream(CompilerContext* ctx, FILE* input, CompileResult* result) {
+    jmp_buf jump;
+    jmp_buf* outer = out_of_memory_jump;
+    out_of_memory_jump = &jump;
+    if (setjmp(jump)) {
+        out_of_memory_jump = outer;
+        return compile_refused(ctx, result, &compile_out_of_memory);
+    }
+    compiler_reset(ctx);
+    STATS_START(parseClock);
+    start_streaming(ctx, input);
+    Node* tree = program(ctx);
+    if (!ctx->streamFailed) {
+        // Lex what follows the program, as compile_buffer() does
+        int errors = ctx->errorCount;
+        Token t;
+        while (lex_next(&ctx->streamLexer, &t)) {
+            STATS_ADD(ctx, tokens, 1);
+        }
+        if (ctx->errorCount > errors) stream_lex_failed(ctx, errors);
+    }
+    if (!ctx->hasError) generate(ctx, tree);
+    STATS_STOP(&ctx->stats, parseClock, PHASE_PARSE);
+    fill_result(ctx, result);
+    out_of_memory_jump = outer;
+    return ctx->hasError;
+}
+
+// Documents: incremental compiles for editors. A document keeps its text
+// with the start of every line, its token stream and lexical errors, and
+// the outline and symbol table of its last parse. An edit lexes again from
+// the end of the last token before the first line it touches, since a
+// line may start inside a comment; past the lines the new text covers,
+// the lexer stops at the first token that starts where an old one did,
+// and the old tokens from there on are kept, moved by the edit.
+//
+// The tokens that changed are then parsed again from a statement
+// boundary before them: the parser resumes in the innermost begin ... end
+// around the change, after the last statement that ends before it, and
+// stops at the first boundary of that statement list after the change
+// where it is in the state the old parse was in there (same token, same
+// panic mode), or where the list ends the same way. Statements only look
+// symbols up, so the parse resumes with the symbols of the block as they
+// were when its body started. Changes the outline cannot place, such as
+// ones in declarations, parse the whole program again. While the text has
+// lexical errors it is not parsed, as in compile_buffer(); the changes of
+// the edits meanwhile are merged and parsed together once the errors are
+// gone. Documents report diagnostics only; no syntax tree is kept between
+// edits.
+struct Document {
+    CompilerContext* ctx;      // parses, over the document's text and tokens
+    CompilerContext* lexed;    // receives the tokens and errors of an edit's lexing
+    char* text;                // followed by SOURCE_PADDING zero bytes
+    int length;
+    int textCapacity;
+    int* lineStart;            // offset of each line
+    int lineCount;
+    int lineCapacity;
+    unsigned char* tokType;    // token stream, as in CompilerContext
+    int* tokOffset;
+    int* tokLength;
+    int* tokLine;
+    int* tokColumn;
+    int* tokName;
+    int tokenCount;
+    int tokenCapacity;
+    NamePool names;            // of the tokens; names of deleted text stay
+    Error* lexErrors;
+    int lexErrorCount;
+    int lexErrorCapacity;
+    Outline outline;
+    int parsed;                // there is an outline, of the tokens before the pending change
+    int parseEnd;              // token the parse stopped at; it never saw the ones after
+    int pending;               // tokens [pendingStart, pendingEnd) of the outline's have
+    int pendingStart;          // become pendingDelta more since it was made
+    int pendingEnd;
+    int pendingDelta;
+    size_t arenaLimit;         // parse from scratch once reparses have used more of the arena
+    Error* diagnostics;
+    int diagnosticCapacity;
+    DocumentStats stats;
+};
+
+// Grow the token arrays to hold count tokens
+void document_reserve_tokens(Document* doc, int count) {
+    int capacity = doc->tokenCapacity;
+    RESERVE(doc->tokType, capacity, count);
+    capacity = doc->tokenCapacity;
+    RESERVE(doc->tokOffset, capacity, count);
+    capacity = doc->tokenCapacity;
+    RESERVE(doc->tokLength, capacity, count);
+    capacity = doc->tokenCapacity;
+    RESERVE(doc->tokLine, capacity, count);
+    capacity = doc->tokenCapacity;
+    RESERVE(doc->tokColumn, capacity, count);
+    capacity = doc->tokenCapacity;
+    RESERVE(doc->tokName, capacity, count);
+    doc->tokenCapacity = capacity;
+}
+
+// Index of the line holding offset
+int document_line_index(const Document* doc, int offset) {
+    int lo = 0, hi = doc->lineCount;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (doc->lineStart[mid] <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Index of the first token at or after offset
+int document_token_from(const Document* doc, int offset) {
+    int lo = 0, hi = doc->tokenCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (doc->tokOffset[mid] < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Offset of a 1-based line and column, clamped to the line and the text
+int document_offset(const Document* doc, int line, int column) {
+    if (line < 1) return 0;
+    if (line > doc->lineCount) return doc->length;
+    int start = doc->lineStart[line - 1];
+    int end = line < doc->lineCount ? doc->lineStart[line] - 1 : doc->length;
+    if (column < 1) return start;
+    return column - 1 < end - start ? start + column - 1 : end;
+}
+
+// Point the parser at the document's text and tokens
+void document_attach(Document* doc) {
+    CompilerContext* ctx = doc->ctx;
+    ctx->source = doc->text;
+    ctx->sourceLength = doc->length;
+    ctx->tokType = doc->tokType;
+    ctx->tokOffset = doc->tokOffset;
+    ctx->tokLength = doc->tokLength;
+    ctx->tokLine = doc->tokLine;
+    ctx->tokColumn = doc->tokColumn;
+    ctx->tokName = doc->tokName;
+    ctx->names = &doc->names;
+    ctx->tokenCount = doc->tokenCount;
+    ctx->tokenCapacity = doc->tokenCount;
+    ctx->outline = &doc->outline;
+}
+
+// Parse the whole program, recording a new outline
+void document_parse(Document* doc) {
+    CompilerContext* ctx = doc->ctx;
+    compiler_reset(ctx);
+    document_attach(doc);
+    Outline* o = &doc->outline;
+    o->spanCount = o->errorCount = o->blockCount = o->scopeCount = 0;
+    o->open = o->block = -1;
+    program(ctx);
+    doc->parseEnd = current_token_index(ctx);
+    doc->parsed = 1;
+    doc->pending = 0;
+    doc->arenaLimit = 2 * arena_used(&ctx->arena) + ARENA_BLOCK_SIZE;
+    doc->stats.fullParses++;
+}
+
+// Make the symbols visible in a block's body the visible ones again
+void restore_scope(CompilerContext* ctx, const Outline* o, const OutlineBlock* b) {
+    ctx->current_level = b->level;
+    if (ctx->visibleCount == 0) return;
+    memset(ctx->visible, 0xff, sizeof(int) * ctx->visibleCount);  // -1
+    const int* first = o->scopes + b->scopes;
+    // Later declarations hide earlier ones of the same name
+    for (int i = 0; i < b->symbolEnd; i++) {
+        const symbol* s = &ctx->symbol_table[i];
+        if (s->level > b->level || i < first[s->level]) continue;
+        ctx->visible[s->id] = i;
+    }
+}
+
+// First span after span's statements, among the first limit spans
+int subtree_end(const Outline* o, int span, int limit) {
+    int i = span + 1;
+    while (i < limit && o->spans[i].depth > o->spans[span].depth) i++;
+    return i;
+}
+
+// Statement before span in the same list, or -1
+int previous_sibling(const Outline* o, int span) {
+    int i = span - 1;
+    if (i == o->spans[span].parent) return -1;
+    while (o->spans[i].depth > o->spans[span].depth) i = o->spans[i].parent;
+    return i;
+}
+
+// Replace the old spans [from, to) and errors [errorFrom, errorTo) by the
+// ones a reparse of list appended past spanMark and errorMark, and move
+// what follows by delta tokens
+void outline_splice(Outline* o, int list, int from, int to, int errorFrom, int errorTo,
+                    int spanMark, int errorMark, int delta) {
+    int added = o->spanCount - spanMark;
+    int spanDelta = added - (to - from);
+    int addedErrors = o->errorCount - errorMark;
+    int errorDelta = addedErrors - (errorTo - errorFrom);
+
+    OutlineSpan* spans = malloc(sizeof(OutlineSpan) * added + 1);
+    OutlineError* errors = malloc(sizeof(OutlineError) * addedErrors + 1);
+    if (!spans || !errors) {
+        free(spans);
+        free(errors);
+        out_of_memory();
+    }
+    memcpy(spans, o->spans + spanMark, sizeof(OutlineSpan) * added);
+    memcpy(errors, o->errors + errorMark, sizeof(OutlineError) * addedErrors);
+    for (int i = 0; i < added; i++) {
+        if (spans[i].parent >= spanMark) spans[i].parent += from - spanMark;
+        spans[i].errorEnd += errorFrom - errorMark;
+    }
+    for (int i = to; i < spanMark; i++) {
+        OutlineSpan* s = &o->spans[i];
+        s->first += delta;
+        s->end += delta;
+        s->errorEnd += errorDelta;
+        if (s->parent >= to) s->parent += spanDelta;
+    }
+    for (int i = errorTo; i < errorMark; i++) o->errors[i].token += delta;
+
+    memmove(o->spans + from + added, o->spans + to, sizeof(OutlineSpan) * (spanMark - to));
+    memcpy(o->spans + from, spans, sizeof(OutlineSpan) * added);
+    o->spanCount = spanMark + spanDelta;
+    memmove(o->errors + errorFrom + addedErrors, o->errors + errorTo, sizeof(OutlineError) * (errorMark - errorTo));
+    memcpy(o->errors + errorFrom, errors, sizeof(OutlineError) * addedErrors);
+    o->errorCount = errorMark + errorDelta;
+    free(spans);
+    free(errors);
+
+    for (int i = list; i >= 0; i = o->spans[i].parent) {
+        o->spans[i].end += delta;
+        o->spans[i].errorEnd += errorDelta;
+    }
+}
+
+// Parse the statement list of the begin span list again, from the end of
+// its statement after (from the start if after is -1), until it meets the
+// old parse past token changeEnd. Returns 0, leaving the outline as it
+// was, if it does not.
+int resume_list(Document* doc, int list, int after, int changeEnd, int delta) {
+    CompilerContext* ctx = doc->ctx;
+    Outline* o = &doc->outline;
+    OutlineSpan begin = o->spans[list];
+    int spanMark = o->spanCount, errorMark = o->errorCount;
+    int from = list + 1;
+    int errorFrom = 0;
+    if (after >= 0) {
+        from = subtree_end(o, after, spanMark);
+        errorFrom = o->spans[after].errorEnd;
+        ctx->currentTokenIndex = o->spans[after].end;
+        ctx->panicking = o->spans[after].panicOut;
+    } else {
+        // Errors come in token order; none of the list's are at its begin
+        while (errorFrom < errorMark && o->errors[errorFrom].token <= begin.first) errorFrom++;
+        ctx->currentTokenIndex = begin.first + 1;
+        ctx->panicking = begin.panicIn;
+    }
+    get_next_token(ctx);
+    restore_scope(ctx, o, &o->blocks[begin.block]);
+    ctx->errorCount = 0;
+    o->open = list;
+    o->block = begin.block;
+    if (after < 0) statement(ctx);
+
+    Node* statements = NULL;
+    Node** tail = &statements;
+    int next = from;  // old statement of the list the parse may meet next
+    int more;
+    do {
+        int at = current_token_index(ctx);
+        while (next < spanMark && o->spans[next].depth == begin.depth + 1 &&
+               o->spans[next].end + delta < at) {
+            next = subtree_end(o, next, spanMark);
+        }
+        if (next < spanMark && o->spans[next].depth == begin.depth + 1 &&
+            o->spans[next].end + delta == at && o->spans[next].end >= changeEnd &&
+            o->spans[next].panicOut == ctx->panicking) {
+            doc->stats.statementsParsed += o->spanCount - spanMark;
+            outline_splice(o, list, from, subtree_end(o, next, spanMark), errorFrom,
+                           o->spans[next].errorEnd, spanMark, errorMark, delta);
+            o->open = o->block = -1;
+            return 1;
+        }
+    } while ((more = statement_list_next(ctx, &tail)) > 0);
+    if (more == 0) accept_sync(ctx);
+    doc->stats.statementsParsed += o->spanCount - spanMark;
+    o->open = o->block = -1;
+    if (begin.end >= changeEnd && current_token_index(ctx) == begin.end + delta &&
+        ctx->panicking == begin.panicOut) {
+        outline_splice(o, list, from, subtree_end(o, list, spanMark), errorFrom,
+                       begin.errorEnd, spanMark, errorMark, delta);
+        return 1;
+    }
+    o->spanCount = spanMark;
+    o->errorCount = errorMark;
+    return 0;
+}
+
+// Parse again after the tokens [start, oldEnd) became delta more; returns
+// 0 if the outline could not place the change
+int document_reparse(Document* doc, int start, int oldEnd, int delta) {
+    Outline* o = &doc->outline;
+    document_attach(doc);
+    // Last statement that starts before the change
+    int lo = 0, hi = o->spanCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (o->spans[mid].first < start) lo = mid + 1;
+        else hi = mid;
+    }
+    // Try the begin ... end lists around it, innermost first
+    int child = -1;  // statement of list on the way up from there
+    for (int list = lo - 1; list >= 0; child = list, list = o->spans[list].parent) {
+        if (doc->tokType[o->spans[list].first] != beginsym) continue;
+        int after = -1;
+        if (child >= 0) after = o->spans[child].end < start ? child : previous_sibling(o, child);
+        if (resume_list(doc, list, after, oldEnd, delta)) return 1;
+    }
+    return 0;
+}
+
+// Note that the tokens [start, end) became delta more, merged with the
+// changes not parsed yet
+void document_change(Document* doc, int start, int end, int delta) {
+    if (!doc->pending) {
+        doc->pendingStart = start;
+        doc->pendingEnd = end;
+        doc->pendingDelta = delta;
+        doc->pending = 1;
+        return;
+    }
+    // end is past the earlier changes, or in the tokens after them
+    int last = doc->pendingEnd + doc->pendingDelta;
+    if (end > last) last = end;
+    if (start < doc->pendingStart) doc->pendingStart = start;
+    doc->pendingEnd = last - doc->pendingDelta;
+    doc->pendingDelta += delta;
+}
+
+// Bring the outline up to date with the tokens
+void document_update(Document* doc) {
+    if (!doc->parsed) {
+        document_parse(doc);
+        return;
+    }
+    if (!doc->pending) return;
+    doc->pending = 0;
+    if (doc->pendingStart > doc->parseEnd) return;
+    // The nodes and errors of reparses pile up in the arena until a full
+    // parse starts it over
+    if (arena_used(&doc->ctx->arena) > doc->arenaLimit ||
+        !document_reparse(doc, doc->pendingStart, doc->pendingEnd, doc->pendingDelta)) {
+        document_parse(doc);
+    } else {
+        doc->parseEnd += doc->pendingDelta;
+    }
+}
+
+// Old token k and new token i are the same, when old token k was not
+// replaced by [a, b) and the text after b moved by d
+int same_token(const Document* doc, int k, int i, int a, int b, int d) {
+    const CompilerContext* lexed = doc->lexed;
+    int offset = doc->tokOffset[k];
+    int length = doc->tokLength[k];
+    if (doc->tokType[k] != lexed->tokType[i] || length != lexed->tokLength[i]) return 0;
+    if (offset < b && offset + length > a) return 0;
+    if (offset >= b) offset += d;
+    return memcmp(doc->text + offset, doc->text + lexed->tokOffset[i], length) == 0;
+}
+
+// Compare positions of errors and tokens
+int position_before(int line, int column, int otherLine, int otherColumn) {
+    return line < otherLine || (line == otherLine && column < otherColumn);
+}
+
+// Replace the bytes [a, b) of the text with len bytes of text
+void document_replace(Document* doc, int a, int b, const char* text, int len) {
+    int d = len - (b - a);
+    int firstLine = document_line_index(doc, a);
+    int lastLine = document_line_index(doc, b);
+
+    // Lexing resumes after the last token before the first line touched,
+    // where the old lexer was between tokens
+    int firstToken = document_token_from(doc, doc->lineStart[firstLine]);
+    int from = 0, fromLine = 1;
+    if (firstToken > 0) {
+        from = doc->tokOffset[firstToken - 1] + doc->tokLength[firstToken - 1];
+        fromLine = doc->tokLine[firstToken - 1];
+    }
+    int fromColumn = from - doc->lineStart[fromLine - 1] + 1;
+
+    RESERVE(doc->text, doc->textCapacity, doc->length + d + SOURCE_PADDING);
+    memmove(doc->text + a + len, doc->text + b, doc->length - b);
+    memcpy(doc->text + a, text, len);
+    doc->length += d;
+    memset(doc->text + doc->length, 0, SOURCE_PADDING);
+
+    int newLines = 0;
+    for (int i = 0; i < len; i++) newLines += text[i] == '\n';
+    int lineDelta = newLines - (lastLine - firstLine);
+    RESERVE(doc->lineStart, doc->lineCapacity, doc->lineCount + lineDelta);
+    memmove(doc->lineStart + lastLine + 1 + lineDelta, doc->lineStart + lastLine + 1,
+            sizeof(int) * (doc->lineCount - lastLine - 1));
+    doc->lineCount += lineDelta;
+    for (int i = firstLine + 1 + newLines; i < doc->lineCount; i++) doc->lineStart[i] += d;
+    for (int i = 0, line = firstLine + 1; i < len; i++) {
+        if (text[i] == '\n') doc->lineStart[line++] = a + i + 1;
+    }
+    int lastNewLine = firstLine + newLines;
+    int limit = lastNewLine + 1 < doc->lineCount ? doc->lineStart[lastNewLine + 1] : doc->length;
+
+    // Lex until a token from limit on starts where an old token from b on
+    // did, and keep that one and the rest
+    CompilerContext* lexed = doc->lexed;
+    compiler_reset(lexed);
+    lexed->names = &doc->names;
+    Lexer lx;
+    lexer_init(lexed, &lx, doc->text, doc->length, NULL);
+    lx.pos = from;
+    lx.line = fromLine;
+    lx.lineStart = doc->lineStart[fromLine - 1];
+    int old = document_token_from(doc, b);
+    Token t;
+    for (;;) {
+        if (!lex_next(&lx, &t)) {
+            old = doc->tokenCount;
+            break;
+        }
+        doc->stats.tokensLexed++;
+        int offset = t.lexeme - doc->text;
+        if (offset >= limit) {
+            while (old < doc->tokenCount && doc->tokOffset[old] + d < offset) old++;
+            if (old < doc->tokenCount && doc->tokOffset[old] + d == offset) {
+                // Its errors are among the old ones
+                while (lexed->errorCount > 0 &&
+                       !position_before(lexed->errors[lexed->errorCount - 1].line,
+                                        lexed->errors[lexed->errorCount - 1].column, t.line, t.column)) {
+                    lexed->errorCount--;
+                }
+                break;
+            }
+        }
+        add_token(lexed, t.type, offset, t.length, t.line, t.column, t.name);
+    }
+
+    // Lexical errors: the old ones from the lexer's start up to the old
+    // token it stopped at make way for the new ones
+    int errorFrom = 0;
+    while (errorFrom < doc->lexErrorCount &&
+           position_before(doc->lexErrors[errorFrom].line, doc->lexErrors[errorFrom].column, fromLine, fromColumn)) {
+        errorFrom++;
+    }
+    int errorTo = errorFrom;
+    while (errorTo < doc->lexErrorCount &&
+           (old == doc->tokenCount ||
+            position_before(doc->lexErrors[errorTo].line, doc->lexErrors[errorTo].column,
+                            doc->tokLine[old], doc->tokColumn[old]))) {
+        errorTo++;
+    }
+    int errorDelta = lexed->errorCount - (errorTo - errorFrom);
+    RESERVE(doc->lexErrors, doc->lexErrorCapacity, doc->lexErrorCount + errorDelta);
+    memmove(doc->lexErrors + errorTo + errorDelta, doc->lexErrors + errorTo,
+            sizeof(Error) * (doc->lexErrorCount - errorTo));
+    if (lexed->errorCount > 0) {
+        memcpy(doc->lexErrors + errorFrom, lexed->errors, sizeof(Error) * lexed->errorCount);
+    }
+    doc->lexErrorCount += errorDelta;
+    for (int i = errorFrom + lexed->errorCount; i < doc->lexErrorCount; i++) doc->lexErrors[i].line += lineDelta;
+
+    // Tokens the parser has to see again: those between the unchanged
+    // ones at either end of the lexed stretch
+    int count = lexed->tokenCount;
+    int oldCount = old - firstToken;
+    int prefix = 0, suffix = 0;
+    while (prefix < oldCount && prefix < count && same_token(doc, firstToken + prefix, prefix, a, b, d)) {
+        prefix++;
+    }
+    while (suffix < oldCount - prefix && suffix < count - prefix &&
+           same_token(doc, old - 1 - suffix, count - 1 - suffix, a, b, d)) {
+        suffix++;
+    }
+    int changeStart = firstToken + prefix;
+    int changeEnd = old - suffix;
+    int delta = count - oldCount;
+
+    int tail = doc->tokenCount - old;
+    document_reserve_tokens(doc, doc->tokenCount + delta);
+    int to = firstToken + count;
+    memmove(doc->tokType + to, doc->tokType + old, tail);
+    memmove(doc->tokOffset + to, doc->tokOffset + old, sizeof(int) * tail);
+    memmove(doc->tokLength + to, doc->tokLength + old, sizeof(int) * tail);
+    memmove(doc->tokLine + to, doc->tokLine + old, sizeof(int) * tail);
+    memmove(doc->tokColumn + to, doc->tokColumn + old, sizeof(int) * tail);
+    memmove(doc->tokName + to, doc->tokName + old, sizeof(int) * tail);
+    for (int i = to; i < to + tail; i++) {
+        doc->tokOffset[i] += d;
+        doc->tokLine[i] += lineDelta;
+    }
+    if (count > 0) {
+        memcpy(doc->tokType + firstToken, lexed->tokType, count);
+        memcpy(doc->tokOffset + firstToken, lexed->tokOffset, sizeof(int) * count);
+        memcpy(doc->tokLength + firstToken, lexed->tokLength, sizeof(int) * count);
+        memcpy(doc->tokLine + firstToken, lexed->tokLine, sizeof(int) * count);
+        memcpy(doc->tokColumn + firstToken, lexed->tokColumn, sizeof(int) * count);
+        memcpy(doc->tokName + firstToken, lexed->tokName, sizeof(int) * count);
+    }
+    doc->tokenCount += delta;
+
+    if (changeStart < changeEnd || delta != 0) document_change(doc, changeStart, changeEnd, delta);
+    // As in compile_buffer(), a program with lexical errors is not parsed;
+    // its changes wait for the edit that clears them
+    if (doc->lexErrorCount == 0) document_update(doc);
+}
+
+// Give every table room from the start, so copies of nothing have a
+// source. Returns 1 if memory runs out.
+int document_reserve_tables(Document* doc) {
+    jmp_buf jump;
+    jmp_buf* outer = out_of_memory_jump;
+    out_of_memory_jump = &jump;
+    if (setjmp(jump)) {
+        out_of_memory_jump = outer;
+        return 1;
+    }
+    Outline* o = &doc->outline;
+    RESERVE(doc->lineStart, doc->lineCapacity, 1);
+    document_reserve_tokens(doc, 1);
+    RESERVE(doc->lexErrors, doc->lexErrorCapacity, 1);
+    RESERVE(o->spans, o->spanCapacity, 1);
+    RESERVE(o->errors, o->errorCapacity, 1);
+    RESERVE(o->blocks, o->blockCapacity, 1);
+    RESERVE(o->scopes, o->scopeCapacity, 1);
+    RESERVE(doc->diagnostics, doc->diagnosticCapacity, 1);
+    out_of_memory_jump = outer;
+    return 0;
+}
+
+Document* document_create() {
+    Document* doc = calloc(1, sizeof(Document));
+    if (!doc) return NULL;
+    doc->ctx = compiler_create();
+    doc->lexed = compiler_create();
+    if (!doc->ctx || !doc->lexed || document_reserve_tables(doc) || document_set_text(doc, "", 0)) {
+        document_destroy(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+void document_destroy(Document* doc) {
+    if (!doc) return;
+    compiler_destroy(doc->ctx);
+    compiler_destroy(doc->lexed);
+    free(doc->text);
+    free(doc->lineStart);
+    free(doc->tokType);
+    free(doc->tokOffset);
+    free(doc->tokLength);
+    free(doc->tokLine);
+    free(doc->tokColumn);
+    free(doc->tokName);
+    name_pool_free(&doc->names);
+    free(doc->lexErrors);
+    free(doc->outline.spans);
+    free(doc->outline.errors);
+    free(doc->outline.blocks);
+    free(doc->outline.scopes);
+    free(doc->diagnostics);
+    free(doc);
+}
+
+// Forget the text, down to an empty document that is not parsed yet
+void document_clear(Document* doc) {
+    doc->length = 0;
+    doc->lineStart[0] = 0;
+    doc->lineCount = 1;
+    doc->tokenCount = 0;
+    name_pool_clear(&doc->names);
+    doc->lexErrorCount = 0;
+    Outline* o = &doc->outline;
+    o->spanCount = o->errorCount = o->blockCount = o->scopeCount = 0;
+    doc->parsed = 0;
+    doc->pending = 0;
+}
+
+// document_replace(), leaving the document empty if memory runs out.
+// Returns 1 if it did.
+int document_try_replace(Document* doc, int a, int b, const char* text, int len) {
+    jmp_buf jump;
+    jmp_buf* outer = out_of_memory_jump;
+    out_of_memory_jump = &jump;
+    if (setjmp(jump)) {
+        out_of_memory_jump = outer;
+        document_clear(doc);
+        return 1;
+    }
+    document_replace(doc, a, b, text, len);
+    out_of_memory_jump = outer;
+    return 0;
+}
+
+int document_set_text(Document* doc, const char* text, size_t len) {
+    if (len > INT_MAX - SOURCE_PADDING) return 1;
+    document_clear(doc);
+    return document_try_replace(doc, 0, 0, text, (int)len);
+}
+
+int document_edit(Document* doc, int startLine, int startColumn, int endLine, int endColumn,
+                  const char* text, size_t len) {
+    int a = document_offset(doc, startLine, startColumn);
+    int b = document_offset(doc, endLine, endColumn);
+    if (b < a) b = a;
+    if (len > (size_t)(INT_MAX - SOURCE_PADDING - (doc->length - (b - a)))) return 1;
+    doc->stats.edits++;
+    if (a == b && len == 0) return 0;
+    return document_try_replace(doc, a, b, text, (int)len);
+}
+
+int document_diagnostics(Document* doc, const Error** errors) {
+    if (doc->lexErrorCount > 0) {
+        *errors = doc->lexErrors;
+        return doc->lexErrorCount;
+    }
+    const Outline* o = &doc->outline;
+    jmp_buf jump;
+    jmp_buf* outer = out_of_memory_jump;
+    out_of_memory_jump = &jump;
+    if (setjmp(jump)) {
+        out_of_memory_jump = outer;
+        *errors = &compile_out_of_memory;
+        return 1;
+    }
+    RESERVE(doc->diagnostics, doc->diagnosticCapacity, o->errorCount);
+    out_of_memory_jump = outer;
+    for (int i = 0; i < o->errorCount; i++) {
+        Error* e = &doc->diagnostics[i];
+        int token = o->errors[i].token;
+        e->line = token < doc->tokenCount ? doc->tokLine[token] : -1;
+        e->column = token < doc->tokenCount ? doc->tokColumn[token] : -1;
+        e->code = o->errors[i].code;
+        strncpy(e->message, error_message(e->code), 99);
+        e->message[99] = '\0';
+    }
+    *errors = doc->diagnostics;
+    return o->errorCount;
+}
+
+const DocumentStats* document_stats(const Document* doc) {
+    return &doc->stats;
+}
+
+// Virtual machine. vm_run() checks the code once and decodes it for direct
+// threading: each instruction becomes the address of its handler, and
+// every handler jumps straight to the next one's. OPR and SYS are split
+// into one handler per operation. The decoded form is wider than the
+// packed instruction, but a dispatch is then a single load; indexing a
+// handler table from packed words measured 20-30% slower even on loops
+// far larger than the data cache.
+//
+// The top of the stack is kept in a register and the stack memory holds
+// the rest. INC spills the register before reserving the frame and leaves
+// a placeholder in it, so variables always live in memory and LOD/STO
+// never have to look at the register. The check works out the deepest
+// stack any path can reach, so the handlers do no bounds checks; only CAL
+// checks that the callee's frame and stack fit.
+//
+// A procedure's frame starts with 3 bookkeeping cells: the display entry
+// CAL replaced, the caller's frame and the return address, as offsets.
+// Variables of the running block are addressed from bp as before, and
+// those of enclosing blocks (LODX, STOX) through the display, which holds
+// the frame of the innermost active block of each level. So a variable
+// any number of levels out costs one load more than a local one, where
+// following static links costs a load per level. -DVM_STATIC_LINKS=1
+// builds the VM the classic way instead, with a static link in the first
+// cell, for comparison (bench/nest_bench.sh).
+
+#ifndef VM_THREADED
+#if defined(__GNUC__)
+#define VM_THREADED 1  // computed goto
+#else
+#define VM_THREADED 0
+#endif
+#endif
+
+#ifndef VM_STATIC_LINKS
+#define VM_STATIC_LINKS 0
+#endif
+
+#define VM_CALL_STACK (1 << 20)  // stack cells for the frames of procedure calls
+
+enum {
+    VM_LIT, VM_LOD, VM_STO, VM_INC, VM_JMP, VM_JPC,
+    VM_NEG, VM_ADD, VM_SUB, VM_MUL, VM_DIV, VM_ODD,
+    VM_EQL, VM_NEQ, VM_LSS, VM_LEQ, VM_GTR, VM_GEQ,
+    VM_READ, VM_WRITE, VM_HALT,
+    VM_LODX, VM_STOX, VM_CAL, VM_RTN,
+    VM_OP_COUNT
+};
+
+// Decoded instruction
+typedef struct {
+#if VM_THREADED
+    const void* handler;
+#endif
+    short op;  // VM_* operation
+    short l;   // level of LODX, STOX, CAL and RTN; static links to follow
+               // instead with VM_STATIC_LINKS
+    int m;     // operand; jump targets are instruction indexes
+} VmInsn;
+
+// Stack effect of an instruction: values popped and pushed
+typedef struct {
+    int pops;
+    int pushes;
+} VmEffect;
+
+// VM_* operation of an instruction, or -1 if it is not valid
+int vm_operation(const instruction* in) {
+    static const signed char oprs[14] = {
+        VM_RTN, VM_NEG, VM_ADD, VM_SUB, VM_MUL, VM_DIV, VM_ODD, -1,
+        VM_EQL, VM_NEQ, VM_LSS, VM_LEQ, VM_GTR, VM_GEQ
+    };
+    if (in->L != 0 && in->op != LOD && in->op != STO && in->op != CAL) return -1;
+    switch (in->op) {
+        case LIT: return VM_LIT;
+        case LOD: return VM_LOD;
+        case STO: return VM_STO;
+        case CAL: return VM_CAL;
+        case INC: return VM_INC;
+        case JMP: return VM_JMP;
+        case JPC: return VM_JPC;
+        case OPR: return in->M >= 0 && in->M < 14 ? oprs[in->M] : -1;
+        case SYS:
+            if (in->M == 1) return VM_READ;
+            if (in->M == 2) return VM_WRITE;
+            if (in->M == 3) return VM_HALT;
+            return -1;
+    }
+    return -1;
+}
+
+VmEffect vm_effect(int op) {
+    VmEffect e = {0, 0};
+    switch (op) {
+        case VM_LIT: case VM_LOD: case VM_LODX: case VM_READ:
+            e.pushes = 1;
+            break;
+        case VM_STO: case VM_STOX: case VM_JPC: case VM_WRITE:
+            e.pops = 1;
+            break;
+        case VM_NEG: case VM_ODD:
+            e.pops = 1;
+            e.pushes = 1;
+            break;
+        case VM_INC: case VM_JMP: case VM_HALT: case VM_CAL: case VM_RTN:
+            break;
+        default:  // binary operations
+            e.pops = 2;
+            e.pushes = 1;
+            break;
+    }
+    return e;
+}
+
+// Check code and decode it into prog. Every path from the first
+// instruction must end in HALT, or in a procedure in RTN, reach each
+// instruction with the same frame and stack depth, and only address
+// variables inside the frame.
+//
+// Each CAL target starts a procedure at the CAL's level, with an empty
+// frame. The walk works out which procedure every instruction belongs to
+// and, from the levels of the CALs, which procedure declares each one, so
+// that it knows the frame an outer variable's level refers to; an outer
+// variable must lie within the frame its block makes calls with. Calls
+// need their caller's frame set up and an empty stack above it, and
+// procedures may not store into their bookkeeping cells.
+//
+// Returns the index of the first bad instruction, or -1 with the number of
+// stack cells the code needs in *stackSize and, if it makes calls, the
+// cells a procedure may use from its frame up in *callNeed (else 0), or
+// -2 if memory runs out.
+int vm_prepare(const instruction* code, int n, VmInsn* prog, int* stackSize, int* callNeed) {
+    if (n <= 0) return 0;
+    int* cells = malloc(sizeof(int) * 7 * n);
+    if (!cells) return -2;
+    int* frame = cells;          // frame size on entry, -1 if unseen
+    int* depth = cells + n;      // values above the frame on entry
+    int* proc = cells + 2 * n;   // first instruction of its procedure, 0 for the main block
+    int* work = cells + 3 * n;
+    // By the first instruction of a procedure
+    int* level = cells + 4 * n;      // level of its block
+    int* parent = cells + 5 * n;     // procedure declaring it, -1 for the main block
+    int* callFrame = cells + 6 * n;  // smallest frame it calls with
+    for (int i = 0; i < n; i++) {
+        frame[i] = -1;
+        prog[i].op = VM_HALT;  // never reached
+        prog[i].l = 0;
+        prog[i].m = 0;
+    }
+    int bad = -1, count = 0, deepest = 0, need = 0;
+    frame[0] = 0;
+    depth[0] = 0;
+    proc[0] = 0;
+    level[0] = 0;
+    parent[0] = -1;
+    callFrame[0] = INT_MAX;
+    work[count++] = 0;
+    while (count > 0 && bad < 0) {
+        int pc = work[--count];
+        int f = frame[pc], d = depth[pc], p = proc[pc], lv = level[p];
+        const instruction* in = &code[pc];
+        int op = vm_operation(in);
+        VmEffect e = vm_effect(op);
+        if (op < 0 || d < e.pops) {
+            bad = pc;
+            break;
+        }
+        prog[pc].op = op;
+        prog[pc].m = in->M;
+        d += e.pushes - e.pops;
+        if (op == VM_INC) {
+            if (f != 0 || d != 0 || in->M < (lv > 0 ? 3 : 0)) bad = pc;
+            f = in->M;
+        } else if ((op == VM_LOD || op == VM_STO) && in->L == lv) {
+            if (in->M < 0 || in->M >= f || (op == VM_STO && lv > 0 && in->M < 3)) bad = pc;
+        } else if (op == VM_LOD || op == VM_STO) {
+            // Bounds are checked once every procedure's calls are known
+            if ((int)in->L > lv || in->M < 0) bad = pc;
+            prog[pc].op = op == VM_LOD ? VM_LODX : VM_STOX;
+            prog[pc].l = VM_STATIC_LINKS ? lv - in->L : in->L;
+        } else if (op == VM_CAL) {
+            int t = in->M, callee = in->L;
+            if (d != 0 || f < 3 || callee < 1 || callee > lv + 1 || t < 0 || t >= n) {
+                bad = pc;
+                break;
+            }
+            // The callee is declared by the caller's enclosing block at the
+            // level above its own
+            int up = p;
+            for (int k = lv; k > callee - 1; k--) up = parent[up];
+            if (f < callFrame[p]) callFrame[p] = f;
+            if (frame[t] < 0) {
+                frame[t] = 0;
+                depth[t] = 0;
+                proc[t] = t;
+                level[t] = callee;
+                parent[t] = up;
+                callFrame[t] = INT_MAX;
+                work[count++] = t;
+            } else if (proc[t] != t || level[t] != callee || parent[t] != up) {
+                bad = pc;
+            }
+            prog[pc].l = VM_STATIC_LINKS ? lv - (callee - 1) : callee;
+        } else if (op == VM_RTN) {
+            if (lv == 0 || d != 0 || f < 3) bad = pc;
+            prog[pc].l = lv;
+        }
+        if (lv == 0 && 1 + f + d > deepest) deepest = 1 + f + d;
+        if (lv > 0 && f + d > need) need = f + d;
+
+        // Successors: the jump target, then the next instruction
+        int next[2], succ = 0;
+        if (op == VM_JMP || op == VM_JPC) {
+            if (in->M < 0 || in->M >= n) bad = pc;
+            else next[succ++] = in->M;
+        }
+        if (op != VM_JMP && op != VM_HALT && op != VM_RTN) {
+            if (pc + 1 >= n) bad = pc;
+            else next[succ++] = pc + 1;
+        }
+        for (int s = 0; s < succ && bad < 0; s++) {
+            int t = next[s];
+            if (frame[t] < 0) {
+                frame[t] = f;
+                depth[t] = d;
+                proc[t] = p;
+                work[count++] = t;
+            } else if (frame[t] != f || depth[t] != d || proc[t] != p) {
+                bad = t;
+            }
+        }
+    }
+
+    // Outer variables: within the frame of the enclosing procedure at their
+    // level whenever it calls, and clear of its bookkeeping cells
+    for (int pc = 0; pc < n && bad < 0; pc++) {
+        if (frame[pc] < 0 || (prog[pc].op != VM_LODX && prog[pc].op != VM_STOX)) continue;
+        int up = proc[pc];
+        for (int k = level[up]; k > (int)code[pc].L; k--) up = parent[up];
+        if (code[pc].M >= callFrame[up] ||
+            (prog[pc].op == VM_STOX && code[pc].L > 0 && code[pc].M < 3)) {
+            bad = pc;
+        }
+    }
+    *stackSize = deepest + 1;
+    *callNeed = 0;
+    for (int pc = 0; pc < n; pc++) {
+        if (frame[pc] >= 0 && prog[pc].op == VM_CAL) {
+            // Room for the callee's bookkeeping cells even if it never
+            // sets up its frame
+            *callNeed = need > 3 ? need : 3;
+            *stackSize += VM_CALL_STACK;
+            break;
+        }
+    }
+    free(cells);
+    return bad;
+}
+
+int vm_run(const instruction* code, int length, FILE* in, FILE* out, RunResult* result) {
+    result->status = VM_HALTED;
+    result->pc = 0;
+    result->steps = 0;
+    VmInsn* prog = malloc(sizeof(VmInsn) * (length > 0 ? length : 1));
+    if (!prog) {
+        result->status = VM_OUT_OF_MEMORY;
+        return 1;
+    }
+    int stackSize, callNeed;
+    int bad = vm_prepare(code, length, prog, &stackSize, &callNeed);
+    if (bad != -1) {
+        free(prog);
+        result->status = bad >= 0 ? VM_BAD_CODE : VM_OUT_OF_MEMORY;
+        result->pc = bad >= 0 ? bad : 0;
+        return 1;
+    }
+    int* stack = calloc(stackSize, sizeof(int));
+    if (!stack) {
+        free(prog);
+        result->status = VM_OUT_OF_MEMORY;
+        return 1;
+    }
+
+    const VmInsn* ip = prog;
+    int* bp = stack + 1;  // the main frame, after the first spill
+    int* sp = stack;      // next free cell
+    int tos = 0;          // top of the stack
+    int* const stackEnd = stack + stackSize;
+#if !VM_STATIC_LINKS
+    int* display[INSTRUCTION_L_MAX + 1];  // frame of the innermost active block of each level
+    for (int i = 0; i <= INSTRUCTION_L_MAX; i++) display[i] = bp;
+#endif
+    long long steps = 0;
+    int status = VM_HALTED;
+
+#if VM_THREADED
+    static const void* const handlers[VM_OP_COUNT] = {
+        &&op_LIT, &&op_LOD, &&op_STO, &&op_INC, &&op_JMP, &&op_JPC,
+        &&op_NEG, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_ODD,
+        &&op_EQL, &&op_NEQ, &&op_LSS, &&op_LEQ, &&op_GTR, &&op_GEQ,
+        &&op_READ, &&op_WRITE, &&op_HALT,
+        &&op_LODX, &&op_STOX, &&op_CAL, &&op_RTN
+    };
+    for (int i = 0; i < length; i++) prog[i].handler = handlers[prog[i].op];
+#define VM_OP(name) op_##name:
+#define VM_NEXT do { steps++; goto *ip->handler; } while (0)
+    goto *ip->handler;
+#else
+#define VM_OP(name) case VM_##name:
+#define VM_NEXT { steps++; continue; }
+    for (;;) switch (ip->op) {
+#endif
+
+// Binary operation on the two top values, with wrap-around arithmetic
+#define VM_BINARY(name, expr) \
+    VM_OP(name) { unsigned a = (unsigned)*--sp, b = (unsigned)tos; tos = (int)(expr); ip++; VM_NEXT; }
+#define VM_COMPARE(name, cmp) \
+    VM_OP(name) { tos = *--sp cmp tos; ip++; VM_NEXT; }
+// Frame of the block at ip->l: through the display, or ip->l static links out
+#if VM_STATIC_LINKS
+#define VM_OUTER(frame) \
+    do { frame = bp; for (int hop = ip->l; hop > 0; hop--) frame = stack + frame[0]; } while (0)
+#else
+#define VM_OUTER(frame) (frame = display[ip->l])
+#endif
+
+    VM_OP(LIT) *sp++ = tos; tos = ip->m; ip++; VM_NEXT;
+    VM_OP(LOD) *sp++ = tos; tos = bp[ip->m]; ip++; VM_NEXT;
+    VM_OP(STO) bp[ip->m] = tos; tos = *--sp; ip++; VM_NEXT;
+    VM_OP(INC) *sp++ = tos; sp += ip->m; ip++; VM_NEXT;
+    VM_OP(JMP) ip = prog + ip->m; VM_NEXT;
+    VM_OP(JPC) {
+        int value = tos;
+        tos = *--sp;
+        ip = value == 0 ? prog + ip->m : ip + 1;
+        VM_NEXT;
+    }
+    VM_OP(NEG) tos = (int)(0u - (unsigned)tos); ip++; VM_NEXT;
+    VM_BINARY(ADD, a + b)
+    VM_BINARY(SUB, a - b)
+    VM_BINARY(MUL, a * b)
+    VM_OP(DIV) {
+        int a = *--sp, b = tos;
+        if (b == 0) {
+            sp++;
+            status = VM_DIVIDE_BY_ZERO;
+            goto stop;
+        }
+        tos = b == -1 ? (int)(0u - (unsigned)a) : a / b;
+        ip++;
+        VM_NEXT;
+    }
+    VM_OP(ODD) tos = tos % 2; ip++; VM_NEXT;
+    VM_COMPARE(EQL, ==)
+    VM_COMPARE(NEQ, !=)
+    VM_COMPARE(LSS, <)
+    VM_COMPARE(LEQ, <=)
+    VM_COMPARE(GTR, >)
+    VM_COMPARE(GEQ, >=)
+    VM_OP(READ) {
+        int value;
+        fprintf(out, "Please Enter an Integer: ");
+        fflush(out);
+        if (fscanf(in, "%d", &value) != 1) {
+            status = VM_BAD_INPUT;
+            goto stop;
+        }
+        *sp++ = tos;
+        tos = value;
+        ip++;
+        VM_NEXT;
+    }
+    VM_OP(WRITE) fprintf(out, "Output result is: %d\n", tos); tos = *--sp; ip++; VM_NEXT;
+    VM_OP(HALT) steps++; goto stop;
+    VM_OP(LODX) { int* frame; VM_OUTER(frame); *sp++ = tos; tos = frame[ip->m]; ip++; VM_NEXT; }
+    VM_OP(STOX) { int* frame; VM_OUTER(frame); frame[ip->m] = tos; tos = *--sp; ip++; VM_NEXT; }
+    VM_OP(CAL) {
+        // The callee's frame starts above the cell its INC spills to
+        if (stackEnd - sp <= callNeed) {
+            status = VM_STACK_OVERFLOW;
+            goto stop;
+        }
+        int* frame = sp + 1;
+        int* link;
+        VM_OUTER(link);  // the display entry to replace, or the static link
+        frame[0] = (int)(link - stack);
+        frame[1] = (int)(bp - stack);
+        frame[2] = (int)(ip - prog) + 1;
+#if !VM_STATIC_LINKS
+        display[ip->l] = frame;
+#endif
+        bp = frame;
+        ip = prog + ip->m;
+        VM_NEXT;
+    }
+    VM_OP(RTN) {
+#if !VM_STATIC_LINKS
+        display[ip->l] = stack + bp[0];
+#endif
+        sp = bp - 1;
+        tos = *sp;  // the caller's, spilled by INC
+        ip = prog + bp[2];
+        bp = stack + bp[1];
+        VM_NEXT;
+    }
+
+#if !VM_THREADED
+    }
+#endif
+#undef VM_OP
+#undef VM_NEXT
+#undef VM_BINARY
+#undef VM_COMPARE
+#undef VM_OUTER
+
+stop:
+    result->status = status;
+    result->pc = (int)(ip - prog);
+    result->steps = steps;
+    free(stack);
+    free(prog);
+    return status != VM_HALTED;
+}
+
+// Register bytecode interpreter, dispatched like vm_run(). Every register
+// operand is checked against the register file once, before running.
+
+typedef struct {
+#if VM_THREADED
+    const void* handler;
+#endif
+    int op;
+    int d;
+    int a;
+    int b;
+} RegInsn;
+
+// Index of the first invalid instruction of p, or -1
+int reg_check(const RegProgram* p) {
+    int n = p->length, r = p->registers;
+    if (n <= 0 || p->constantBase < 0 || p->constantBase + p->constantCount > r) return 0;
+    for (int i = 0; i < n; i++) {
+        const RegInstruction* in = &p->code[i];
+        int usesD = 0, usesA = 0, usesB = 0, jumps = 0;
+        switch (in->op) {
+            case REG_MOV: case REG_NEG: usesD = usesA = 1; break;
+            case REG_ADD: case REG_SUB: case REG_MUL: case REG_DIV: usesD = usesA = usesB = 1; break;
+            case REG_JMP: jumps = 1; break;
+            case REG_JEQ: case REG_JNE: case REG_JLT:
+            case REG_JLE: case REG_JGT: case REG_JGE: jumps = usesA = usesB = 1; break;
+            case REG_JODD: case REG_JEVEN: jumps = usesA = 1; break;
+            case REG_READ: usesD = 1; break;
+            case REG_WRITE: usesA = 1; break;
+            case REG_HALT: break;
+            default: return i;
+        }
+        if ((usesD && (in->d < 0 || in->d >= r)) || (jumps && (in->d < 0 || in->d >= n)) ||
+            (usesA && (in->a < 0 || in->a >= r)) || (usesB && (in->b < 0 || in->b >= r))) {
+            return i;
+        }
+    }
+    // The last instruction must not fall off the end
+    int last = p->code[n - 1].op;
+    return last == REG_HALT || last == REG_JMP ? -1 : n - 1;
+}
+
+int reg_run(const RegProgram* program, FILE* in, FILE* out, RunResult* result) {
+    result->status = VM_HALTED;
+    result->pc = 0;
+    result->steps = 0;
+    int bad = reg_check(program);
+    if (bad >= 0) {
+        result->status = VM_BAD_CODE;
+        result->pc = bad;
+        return 1;
+    }
+    int n = program->length;
+    RegInsn* prog = malloc(sizeof(RegInsn) * n);
+    int* r = calloc(program->registers, sizeof(int));
+    if (!prog || !r) {
+        free(prog);
+        free(r);
+        result->status = VM_OUT_OF_MEMORY;
+        return 1;
+    }
+    for (int i = 0; i < program->constantCount; i++) {
+        r[program->constantBase + i] = program->constants[i];
+    }
+    for (int i = 0; i < n; i++) {
+        prog[i].op = program->code[i].op;
+        prog[i].d = program->code[i].d;
+        prog[i].a = program->code[i].a;
+        prog[i].b = program->code[i].b;
+    }
+
+    const RegInsn* ip = prog;
+    long long steps = 0;
+    int status = VM_HALTED;
+
+#if VM_THREADED
+    static const void* const handlers[REG_HALT + 1] = {
+        NULL, &&op_MOV, &&op_NEG, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_JMP,
+        &&op_JEQ, &&op_JNE, &&op_JLT, &&op_JLE, &&op_JGT, &&op_JGE, &&op_JODD, &&op_JEVEN,
+        &&op_READ, &&op_WRITE, &&op_HALT
+    };
+    for (int i = 0; i < n; i++) prog[i].handler = handlers[prog[i].op];
+#define REG_OP(name) op_##name:
+#define REG_NEXT do { steps++; goto *ip->handler; } while (0)
+    goto *ip->handler;
+#else
+#define REG_OP(name) case REG_##name:
+#define REG_NEXT { steps++; continue; }
+    for (;;) switch (ip->op) {
+#endif
+
+#define REG_ARITH(name, expr) \
+    REG_OP(name) { unsigned a = (unsigned)r[ip->a], b = (unsigned)r[ip->b]; r[ip->d] = (int)(expr); ip++; REG_NEXT; }
+#define REG_JUMP(name, cond) \
+    REG_OP(name) { ip = r[ip->a] cond r[ip->b] ? prog + ip->d : ip + 1; REG_NEXT; }
+
+    REG_OP(MOV) r[ip->d] = r[ip->a]; ip++; REG_NEXT;
+    REG_OP(NEG) r[ip->d] = (int)(0u - (unsigned)r[ip->a]); ip++; REG_NEXT;
+    REG_ARITH(ADD, a + b)
+    REG_ARITH(SUB, a - b)
+    REG_ARITH(MUL, a * b)
+    REG_OP(DIV) {
+        int a = r[ip->a], b = r[ip->b];
+        if (b == 0) {
+            status = VM_DIVIDE_BY_ZERO;
+            goto stop;
+        }
+        r[ip->d] = b == -1 ? (int)(0u - (unsigned)a) : a / b;
+        ip++;
+        REG_NEXT;
+    }
+    REG_OP(JMP) ip = prog + ip->d; REG_NEXT;
+    REG_JUMP(JEQ, ==)
+    REG_JUMP(JNE, !=)
+    REG_JUMP(JLT, <)
+    REG_JUMP(JLE, <=)
+    REG_JUMP(JGT, >)
+    REG_JUMP(JGE, >=)
+    REG_OP(JODD) ip = r[ip->a] % 2 != 0 ? prog + ip->d : ip + 1; REG_NEXT;
+    REG_OP(JEVEN) ip = r[ip->a] % 2 == 0 ? prog + ip->d : ip + 1; REG_NEXT;
+    REG_OP(READ) {
+        int value;
+        fprintf(out, "Please Enter an Integer: ");
+        fflush(out);
+        if (fscanf(in, "%d", &value) != 1) {
+            status = VM_BAD_INPUT;
+            goto stop;
+        }
+        r[ip->d] = value;
+        ip++;
+        REG_NEXT;
+    }
+    REG_OP(WRITE) fprintf(out, "Output result is: %d\n", r[ip->a]); ip++; REG_NEXT;
+    REG_OP(HALT) steps++; goto stop;
+
+#if !VM_THREADED
+    }
+#endif
+#undef REG_OP
+#undef REG_NEXT
+#undef REG_ARITH
+#undef REG_JUMP
+
+stop:
+    result->status = status;
+    result->pc = (int)(ip - prog);
+    result->steps = steps;
+    free(r);
+    free(prog);
+    return status != VM_HALTED;
+}
+
+// Template JIT for x86-64. The checked and decoded code from vm_prepare()
+// is translated instruction by instruction into machine code with the
+// same stack layout as vm_run(): the frame and the stack live in memory
+// and the top of the stack stays in eax. An instruction that pushes a
+// literal or a variable is fused with a following arithmetic or compare
+// operation, which then takes the operand straight from the immediate or
+// the frame, and a compare or ODD followed by JPC becomes a single
+// conditional branch. READ and WRITE call back into C. Code that calls
+// procedures is left to vm_run().
+//
+// Registers: rbx frame base, r12 next free stack cell, r13 JitState,
+// r15 instructions executed (added once per basic block), eax top of the
+// stack. A runtime error jumps to a stub that records the instruction and
+// takes back the count of the block's instructions that did not run.
+
+#ifndef VM_JIT
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define VM_JIT 1
+#else
+#define VM_JIT 0
+#endif
+#endif
+
+#if VM_JIT
+
+typedef struct {
+    FILE* in;
+    FILE* out;
+    int status;        // VM_* code
+    int pc;            // instruction that stopped the run
+    long long steps;
+} JitState;
+
+typedef struct {
+    unsigned char* bytes;
+    size_t length;
+    size_t capacity;
+    int failed;        // ran out of memory; the contents are incomplete
+} JitBuffer;
+
+// Where a rel32 must point once the code is laid out
+typedef struct {
+    size_t at;         // offset of the rel32 field
+    int target;        // instruction index, JIT_EXIT, or JIT_STUB(i)
+} JitFixup;
+
+#define JIT_EXIT -1
+#define JIT_STUB(i) (-2 - (i))
+
+typedef struct {
+    int pc;
+    int notRun;        // instructions of the block from pc on
+    int status;        // 0 if the callback already set it
+} JitStub;
+
+typedef struct {
+    JitBuffer code;
+    JitFixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+    JitStub* stubs;
+    int stubCount;
+    int stubCapacity;
+} Jit;
+
+void jit_bytes(JitBuffer* b, const void* data, size_t n) {
+    if (b->length + n > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+        while (capacity < b->length + n) capacity *= 2;
+        unsigned char* bytes = b->failed ? NULL : realloc(b->bytes, capacity);
+        if (!bytes) {
+            b->failed = 1;
+            return;
+        }
+        b->bytes = bytes;
+        b->capacity = capacity;
+    }
+    memcpy(b->bytes + b->length, data, n);
+    b->length += n;
+}
+
+#define JIT_EMIT(jit, ...) do { \
+        static const unsigned char bytes_[] = {__VA_ARGS__}; \
+        jit_bytes(&(jit)->code, bytes_, sizeof(bytes_)); \
+    } while (0)
+
+void jit_imm32(Jit* jit, int value) {
+    jit_bytes(&jit->code, &value, 4);
+}
+
+// Append a rel32 to be filled in with target's address
+void jit_rel32(Jit* jit, int target) {
+    if (jit->fixupCount == jit->fixupCapacity) {
+        int capacity = jit->fixupCapacity ? jit->fixupCapacity * 2 : 256;
+        JitFixup* fixups = realloc(jit->fixups, sizeof(JitFixup) * capacity);
+        if (!fixups) {
+            jit->code.failed = 1;
+            return;
+        }
+        jit->fixups = fixups;
+        jit->fixupCapacity = capacity;
+    }
+    jit->fixups[jit->fixupCount].at = jit->code.length;
+    jit->fixups[jit->fixupCount].target = target;
+    jit->fixupCount++;
+    jit_imm32(jit, 0);
+}
+
+// Conditional jump (condition code cc) to a runtime error stub
+void jit_error_jump(Jit* jit, int cc, int pc, int notRun, int status) {
+    if (jit->stubCount == jit->stubCapacity) {
+        int capacity = jit->stubCapacity ? jit->stubCapacity * 2 : 64;
+        JitStub* stubs = realloc(jit->stubs, sizeof(JitStub) * capacity);
+        if (!stubs) {
+            jit->code.failed = 1;
+            return;
+        }
+        jit->stubs = stubs;
+        jit->stubCapacity = capacity;
+    }
+    JitStub* s = &jit->stubs[jit->stubCount];
+    s->pc = pc;
+    s->notRun = notRun;
+    s->status = status;
+    unsigned char jcc[2] = {0x0F, (unsigned char)(0x80 + cc)};
+    jit_bytes(&jit->code, jcc, 2);
+    jit_rel32(jit, JIT_STUB(jit->stubCount));
+    jit->stubCount++;
+}
+
+// Operand forms of a binary operation: the second operand on the stack,
+// an immediate, or a frame slot
+enum { JIT_STACK, JIT_IMM, JIT_FRAME };
+
+// x86 condition codes
+enum { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+int jit_condition(int op) {
+    switch (op) {
+        case VM_EQL: return CC_E;
+        case VM_NEQ: return CC_NE;
+        case VM_LSS: return CC_L;
+        case VM_LEQ: return CC_LE;
+        case VM_GTR: return CC_G;
+        default: return CC_GE;
+    }
+}
+
+int is_vm_compare(int op) {
+    return op >= VM_EQL && op <= VM_GEQ;
+}
+
+int is_vm_binary(int op) {
+    return (op >= VM_ADD && op <= VM_DIV) || is_vm_compare(op);
+}
+
+void jit_push(Jit* jit) {
+    JIT_EMIT(jit, 0x41, 0x89, 0x04, 0x24);        // mov [r12], eax
+    JIT_EMIT(jit, 0x49, 0x83, 0xC4, 0x04);        // add r12, 4
+}
+
+void jit_pop(Jit* jit) {
+    JIT_EMIT(jit, 0x4D, 0x8D, 0x64, 0x24, 0xFC);  // lea r12, [r12 - 4]
+    JIT_EMIT(jit, 0x41, 0x8B, 0x04, 0x24);        // mov eax, [r12]
+}
+
+// eax := eax op operand, or for JIT_STACK [r12 - 4] op eax with a pop.
+// A compare with jpc >= 0 is fused with the JPC after it, which pops
+// the next value into eax and branches when the compare is false.
+void jit_binary(Jit* jit, int op, int form, int operand, int pc, int notRun, int jpc) {
+    int disp = operand * 4;
+    if (op == VM_DIV) {
+        // Divisor in ecx, dividend in eax
+        if (form == JIT_STACK) {
+            JIT_EMIT(jit, 0x4D, 0x8D, 0x64, 0x24, 0xFC);  // lea r12, [r12 - 4]
+            JIT_EMIT(jit, 0x89, 0xC1);                    // mov ecx, eax
+            JIT_EMIT(jit, 0x41, 0x8B, 0x04, 0x24);        // mov eax, [r12]
+        } else if (form == JIT_IMM) {
+            JIT_EMIT(jit, 0xB9);                          // mov ecx, imm32
+            jit_imm32(jit, operand);
+        } else {
+            JIT_EMIT(jit, 0x8B, 0x8B);                    // mov ecx, [rbx + disp32]
+            jit_imm32(jit, disp);
+        }
+        if (form != JIT_IMM || operand == 0) {
+            JIT_EMIT(jit, 0x85, 0xC9);                    // test ecx, ecx
+            jit_error_jump(jit, CC_E, pc, notRun, VM_DIVIDE_BY_ZERO);
+        }
+        // x / -1 wraps like the other operations instead of trapping
+        JIT_EMIT(jit, 0x83, 0xF9, 0xFF,                   // cmp ecx, -1
+                      0x75, 0x04,                         // jne 1f
+                      0xF7, 0xD8,                         // neg eax
+                      0xEB, 0x03,                         // jmp 2f
+                      0x99,                               // 1: cdq
+                      0xF7, 0xF9);                        // idiv ecx; 2:
+        return;
+    }
+
+    if (form == JIT_STACK) {
+        JIT_EMIT(jit, 0x4D, 0x8D, 0x64, 0x24, 0xFC);      // lea r12, [r12 - 4]
+        switch (op) {
+            case VM_ADD: JIT_EMIT(jit, 0x41, 0x03, 0x04, 0x24); break;        // add eax, [r12]
+            case VM_MUL: JIT_EMIT(jit, 0x41, 0x0F, 0xAF, 0x04, 0x24); break;  // imul eax, [r12]
+            case VM_SUB:
+                JIT_EMIT(jit, 0x89, 0xC1,                 // mov ecx, eax
+                              0x41, 0x8B, 0x04, 0x24,     // mov eax, [r12]
+                              0x29, 0xC8);                // sub eax, ecx
+                break;
+            default:
+                JIT_EMIT(jit, 0x41, 0x8B, 0x0C, 0x24,     // mov ecx, [r12]
+                              0x39, 0xC1);                // cmp ecx, eax
+                break;
+        }
+    } else if (form == JIT_IMM) {
+        switch (op) {
+            case VM_ADD: JIT_EMIT(jit, 0x05); break;              // add eax, imm32
+            case VM_SUB: JIT_EMIT(jit, 0x2D); break;              // sub eax, imm32
+            case VM_MUL: JIT_EMIT(jit, 0x69, 0xC0); break;        // imul eax, eax, imm32
+            default: JIT_EMIT(jit, 0x3D); break;                  // cmp eax, imm32
+        }
+        jit_imm32(jit, operand);
+    } else {
+        switch (op) {
+            case VM_ADD: JIT_EMIT(jit, 0x03, 0x83); break;        // add eax, [rbx + disp32]
+            case VM_SUB: JIT_EMIT(jit, 0x2B, 0x83); break;        // sub eax, [rbx + disp32]
+            case VM_MUL: JIT_EMIT(jit, 0x0F, 0xAF, 0x83); break;  // imul eax, [rbx + disp32]
+            default: JIT_EMIT(jit, 0x3B, 0x83); break;            // cmp eax, [rbx + disp32]
+        }
+        jit_imm32(jit, disp);
+    }
+
+    if (!is_vm_compare(op)) return;
+    int cc = jit_condition(op);
+    if (jpc >= 0) {
+        jit_pop(jit);  // lea and mov leave the flags alone
+        unsigned char jcc[2] = {0x0F, (unsigned char)(0x80 + (cc ^ 1))};
+        jit_bytes(&jit->code, jcc, 2);
+        jit_rel32(jit, jpc);
+        return;
+    }
+    unsigned char setcc[3] = {0x0F, (unsigned char)(0x90 + cc), 0xC0};
+    jit_bytes(&jit->code, setcc, 3);                      // setcc al
+    JIT_EMIT(jit, 0x0F, 0xB6, 0xC0);                      // movzx eax, al
+}
+
+void jit_call(Jit* jit, void* function) {
+    JIT_EMIT(jit, 0x4C, 0x89, 0xEF);                      // mov rdi, r13
+    JIT_EMIT(jit, 0x48, 0xB8);                            // mov rax, imm64
+    jit_bytes(&jit->code, &function, 8);
+    JIT_EMIT(jit, 0xFF, 0xD0);                            // call rax
+}
+
+int jit_read(JitState* s) {
+    int value;
+    fprintf(s->out, "Please Enter an Integer: ");
+    fflush(s->out);
+    if (fscanf(s->in, "%d", &value) != 1) {
+        s->status = VM_BAD_INPUT;
+        return 0;
+    }
+    return value;
+}
+
+void jit_write(JitState* s, int value) {
+    fprintf(s->out, "Output result is: %d\n", value);
+}
+
+// Translate prog into jit->code; entry is void (*)(int* bp, int* sp, JitState*).
+// jit->code.failed is set if memory ran out.
+void jit_translate(Jit* jit, const VmInsn* prog, int n) {
+    // Basic blocks start at instruction 0, at jump targets and after
+    // jumps and HALT; blockLength[i] is set at the start of each
+    char* leader = calloc(n + 1, 1);
+    int* blockLength = malloc(sizeof(int) * n);
+    size_t* offset = malloc(sizeof(size_t) * n);
+    if (!leader || !blockLength || !offset) {
+        free(leader);
+        free(blockLength);
+        free(offset);
+        jit->code.failed = 1;
+        return;
+    }
+    leader[0] = 1;
+    for (int i = 0; i < n; i++) {
+        int op = prog[i].op;
+        if (op == VM_JMP || op == VM_JPC) leader[prog[i].m] = 1;
+        if (op == VM_JMP || op == VM_JPC || op == VM_HALT) leader[i + 1] = 1;
+    }
+    for (int i = n - 1, next = n; i >= 0; i--) {
+        if (leader[i]) {
+            blockLength[i] = next - i;
+            next = i;
+        }
+    }
+
+    JIT_EMIT(jit, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55,    // push rbx, rbp, r12, r13,
+                  0x41, 0x56, 0x41, 0x57,                // r14, r15
+                  0x48, 0x83, 0xEC, 0x08,                // sub rsp, 8 (align calls)
+                  0x48, 0x89, 0xFB,                      // mov rbx, rdi
+                  0x49, 0x89, 0xF4,                      // mov r12, rsi
+                  0x49, 0x89, 0xD5,                      // mov r13, rdx
+                  0x45, 0x31, 0xFF,                      // xor r15d, r15d
+                  0x31, 0xC0);                           // xor eax, eax
+
+    int blockEnd = 0;
+    for (int pc = 0; pc < n; pc++) {
+        offset[pc] = jit->code.length;
+        if (leader[pc]) {
+            blockEnd = pc + blockLength[pc];
+            JIT_EMIT(jit, 0x49, 0x81, 0xC7);              // add r15, imm32
+            jit_imm32(jit, blockLength[pc]);
+        }
+        int op = prog[pc].op, m = prog[pc].m;
+        int next = pc + 1 < n && !leader[pc + 1] ? prog[pc + 1].op : -1;
+        int afterNext = pc + 2 < n && !leader[pc + 2] ? pc + 2 : -1;
+
+        if ((op == VM_LIT || op == VM_LOD) && next >= 0 && is_vm_binary(next)) {
+            // The pushed value becomes the operation's second operand
+            int jpc = -1;
+            if (is_vm_compare(next) && afterNext >= 0 && prog[afterNext].op == VM_JPC) {
+                jpc = prog[afterNext].m;
+            }
+            jit_binary(jit, next, op == VM_LIT ? JIT_IMM : JIT_FRAME, m,
+                       pc + 1, blockEnd - (pc + 1), jpc);
+            pc += jpc >= 0 ? 2 : 1;
+            continue;
+        }
+        if (is_vm_compare(op) && next == VM_JPC) {
+            jit_binary(jit, op, JIT_STACK, 0, pc, blockEnd - pc, prog[pc + 1].m);
+            pc++;
+            continue;
+        }
+        if (is_vm_binary(op)) {
+            jit_binary(jit, op, JIT_STACK, 0, pc, blockEnd - pc, -1);
+            continue;
+        }
+
+        switch (op) {
+            case VM_LIT:
+                jit_push(jit);
+                JIT_EMIT(jit, 0xB8);                      // mov eax, imm32
+                jit_imm32(jit, m);
+                break;
+            case VM_LOD:
+                jit_push(jit);
+                JIT_EMIT(jit, 0x8B, 0x83);                // mov eax, [rbx + disp32]
+                jit_imm32(jit, m * 4);
+                break;
+            case VM_STO:
+                JIT_EMIT(jit, 0x89, 0x83);                // mov [rbx + disp32], eax
+                jit_imm32(jit, m * 4);
+                jit_pop(jit);
+                break;
+            case VM_INC:
+                jit_push(jit);
+                JIT_EMIT(jit, 0x49, 0x81, 0xC4);          // add r12, imm32
+                jit_imm32(jit, m * 4);
+                break;
+            case VM_JMP:
+                JIT_EMIT(jit, 0xE9);                      // jmp rel32
+                jit_rel32(jit, m);
+                break;
+            case VM_JPC:
+                JIT_EMIT(jit, 0x89, 0xC1);                // mov ecx, eax
+                jit_pop(jit);
+                JIT_EMIT(jit, 0x85, 0xC9, 0x0F, 0x84);    // test ecx, ecx; jz rel32
+                jit_rel32(jit, m);
+                break;
+            case VM_NEG:
+                JIT_EMIT(jit, 0xF7, 0xD8);                // neg eax
+                break;
+            case VM_ODD:
+                if (next == VM_JPC) {
+                    JIT_EMIT(jit, 0xA9, 0x01, 0x00, 0x00, 0x00);  // test eax, 1
+                    jit_pop(jit);
+                    JIT_EMIT(jit, 0x0F, 0x84);            // jz rel32
+                    jit_rel32(jit, prog[pc + 1].m);
+                    pc++;
+                    break;
+                }
+                // eax % 2 with C's sign: ((eax + sign) & 1) - sign
+                JIT_EMIT(jit, 0x89, 0xC1,                 // mov ecx, eax
+                              0xC1, 0xE9, 0x1F,           // shr ecx, 31
+                              0x01, 0xC8,                 // add eax, ecx
+                              0x83, 0xE0, 0x01,           // and eax, 1
+                              0x29, 0xC8);                // sub eax, ecx
+                break;
+            case VM_READ:
+                jit_push(jit);
+                jit_call(jit, (void*)jit_read);
+                // cmp dword [r13 + status], 0
+                JIT_EMIT(jit, 0x41, 0x83, 0x7D, (unsigned char)offsetof(JitState, status), 0x00);
+                jit_error_jump(jit, CC_NE, pc, blockEnd - pc, 0);
+                break;
+            case VM_WRITE:
+                JIT_EMIT(jit, 0x89, 0xC6);                // mov esi, eax
+                jit_call(jit, (void*)jit_write);
+                jit_pop(jit);
+                break;
+            case VM_HALT:
+                JIT_EMIT(jit, 0x41, 0xC7, 0x45, (unsigned char)offsetof(JitState, pc));
+                jit_imm32(jit, pc);                       // mov dword [r13 + pc], imm32
+                JIT_EMIT(jit, 0xE9);                      // jmp exit
+                jit_rel32(jit, JIT_EXIT);
+                break;
+        }
+    }
+
+    // Error stubs, then the common exit
+    size_t* stubOffset = malloc(sizeof(size_t) * (jit->stubCount + 1));
+    if (!stubOffset) jit->code.failed = 1;
+    for (int i = 0; i < jit->stubCount && !jit->code.failed; i++) {
+        JitStub* s = &jit->stubs[i];
+        stubOffset[i] = jit->code.length;
+        JIT_EMIT(jit, 0x41, 0xC7, 0x45, (unsigned char)offsetof(JitState, pc));
+        jit_imm32(jit, s->pc);                            // mov dword [r13 + pc], imm32
+        JIT_EMIT(jit, 0x49, 0x81, 0xEF);                  // sub r15, imm32
+        jit_imm32(jit, s->notRun);
+        if (s->status) {
+            JIT_EMIT(jit, 0x41, 0xC7, 0x45, (unsigned char)offsetof(JitState, status));
+            jit_imm32(jit, s->status);                    // mov dword [r13 + status], imm32
+        }
+        JIT_EMIT(jit, 0xE9);                              // jmp exit
+        jit_rel32(jit, JIT_EXIT);
+    }
+    size_t exitOffset = jit->code.length;
+    JIT_EMIT(jit, 0x4D, 0x89, 0x7D, (unsigned char)offsetof(JitState, steps),  // mov [r13 + steps], r15
+                  0x48, 0x83, 0xC4, 0x08,                // add rsp, 8
+                  0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D,    // pop r15, r14, r13,
+                  0x41, 0x5C, 0x5D, 0x5B,                // r12, rbp, rbx
+                  0xC3);                                 // ret
+
+    for (int i = 0; i < jit->fixupCount && !jit->code.failed; i++) {
+        JitFixup* f = &jit->fixups[i];
+        size_t target = f->target >= 0 ? offset[f->target]
+                      : f->target == JIT_EXIT ? exitOffset
+                      : stubOffset[JIT_STUB(f->target)];
+        int rel = (int)(target - (f->at + 4));
+        memcpy(jit->code.bytes + f->at, &rel, 4);
+    }
+    free(stubOffset);
+    free(leader);
+    free(blockLength);
+    free(offset);
+}
+#endif
+
+int vm_run_jit(const instruction* code, int length, FILE* in, FILE* out, RunResult* result) {
+#if VM_JIT
+    result->steps = 0;
+    result->pc = 0;
+    VmInsn* prog = malloc(sizeof(VmInsn) * (length > 0 ? length : 1));
+    if (!prog) {
+        result->status = VM_OUT_OF_MEMORY;
+        return 1;
+    }
+    int stackSize, callNeed;
+    int bad = vm_prepare(code, length, prog, &stackSize, &callNeed);
+    if (bad != -1) {
+        free(prog);
+        result->status = bad >= 0 ? VM_BAD_CODE : VM_OUT_OF_MEMORY;
+        result->pc = bad >= 0 ? bad : 0;
+        return 1;
+    }
+    if (callNeed > 0) {
+        // Procedures are not translated: interpret the program
+        free(prog);
+        return vm_run(code, length, in, out, result);
+    }
+    Jit jit = {0};
+    jit_translate(&jit, prog, length);
+    free(prog);
+
+    if (jit.code.failed) {
+        free(jit.code.bytes);
+        free(jit.fixups);
+        free(jit.stubs);
+        result->status = VM_OUT_OF_MEMORY;
+        return 1;
+    }
+    size_t size = jit.code.length;
+    void* text = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int mapped = text != MAP_FAILED;
+    if (mapped) {
+        memcpy(text, jit.code.bytes, size);
+        mapped = mprotect(text, size, PROT_READ | PROT_EXEC) == 0;
+        if (!mapped) munmap(text, size);
+    }
+    free(jit.code.bytes);
+    free(jit.fixups);
+    free(jit.stubs);
+    if (!mapped) {
+        // No executable memory (e.g. W^X policy): interpret instead
+        return vm_run(code, length, in, out, result);
+    }
+
+    int* stack = calloc(stackSize, sizeof(int));
+    if (!stack) {
+        munmap(text, size);
+        result->status = VM_OUT_OF_MEMORY;
+        return 1;
+    }
+    JitState state = {in, out, VM_HALTED, 0, 0};
+    void (*entry)(int*, int*, JitState*);
+    *(void**)&entry = text;
+    entry(stack + 1, stack, &state);
+    munmap(text, size);
+    free(stack);
+    result->status = state.status;
+    result->pc = state.pc;
+    result->steps = state.steps;
+    return state.status != VM_HALTED;
+#else
+    return vm_run(code, length, in, out, result);
+#endif
+}
+
+// Binary modules. Header fields, instructions and symbols are written byte
+// by byte in little-endian order, so a file does not depend on the host
+// that wrote it. Where the host lays out instruction and ModuleSymbol the
+// same way (little-endian GCC and Clang targets), module_open() hands out
+// pointers into the mapped file; elsewhere it decodes a copy.
+
+#define MODULE_HEADER_SIZE 40
+
+enum {  // byte offsets of the header fields
+    MH_MAGIC = 0, MH_VERSION = 4, MH_HEADER_SIZE = 6, MH_CHECKSUM = 8,
+    MH_CODE = 12, MH_CODE_COUNT = 16, MH_SYMBOLS = 20, MH_SYMBOL_COUNT = 24,
+    MH_STRINGS = 28, MH_STRING_SIZE = 32, MH_FILE_SIZE = 36
+};
+
+_Static_assert(sizeof(instruction) == 4, "instruction must pack into 32 bits");
+_Static_assert(sizeof(ModuleSymbol) == 24, "ModuleSymbol must have no padding");
+
+// CRC-32 (IEEE) of n bytes
+uint32_t module_crc(const unsigned char* p, size_t n) {
+    uint32_t table[256];
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+void put_u32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+uint32_t get_u32(const unsigned char* p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint32_t pack_instruction(const instruction* in) {
+    return in->op | (uint32_t)in->L << 5 | ((uint32_t)in->M & 0xFFFFFF) << 8;
+}
+
+instruction unpack_instruction(uint32_t word) {
+    instruction in;
+    in.op = word & 31;
+    in.L = (word >> 5) & 7;
+    in.M = (int)((word >> 8) ^ 0x800000) - 0x800000;  // sign-extend 24 bits
+    return in;
+}
+
+// Whether the file layout is the host's
+int module_layout_native() {
+    instruction probe = {SYS, 5, -2};
+    uint32_t word;
+    memcpy(&word, &probe, sizeof(word));
+    unsigned char bytes[4];
+    int32_t one = 1;
+    memcpy(bytes, &one, sizeof(bytes));
+    return word == pack_instruction(&probe) && bytes[0] == 1;
+}
+
+int module_write(FILE* out, const CompileResult* result) {
+    if (result->codeLength == 0) return 1;  // errors, or register code
+    uint32_t stringSize = 0;
+    for (int i = 0; i < result->symbolCount; i++) {
+        stringSize += (uint32_t)strlen(result->symbols[i].name) + 1;
+    }
+    uint32_t codeOffset = MODULE_HEADER_SIZE;
+    uint32_t symbolOffset = codeOffset + 4 * (uint32_t)result->codeLength;
+    uint32_t stringOffset = symbolOffset + sizeof(ModuleSymbol) * (uint32_t)result->symbolCount;
+    uint32_t size = (stringOffset + stringSize + 3) & ~3u;
+    unsigned char* file = calloc(size, 1);
+    if (!file) return 1;
+
+    memcpy(file + MH_MAGIC, "PL0M", 4);
+    file[MH_VERSION] = MODULE_VERSION;
+    file[MH_HEADER_SIZE] = MODULE_HEADER_SIZE;
+    put_u32(file + MH_CODE, codeOffset);
+    put_u32(file + MH_CODE_COUNT, (uint32_t)result->codeLength);
+    put_u32(file + MH_SYMBOLS, symbolOffset);
+    put_u32(file + MH_SYMBOL_COUNT, (uint32_t)result->symbolCount);
+    put_u32(file + MH_STRINGS, stringOffset);
+    put_u32(file + MH_STRING_SIZE, stringSize);
+    put_u32(file + MH_FILE_SIZE, size);
+    for (int i = 0; i < result->codeLength; i++) {
+        put_u32(file + codeOffset + 4 * i, pack_instruction(&result->code[i]));
+    }
+    uint32_t name = 0;
+    for (int i = 0; i < result->symbolCount; i++) {
+        const symbol* sym = &result->symbols[i];
+        unsigned char* rec = file + symbolOffset + sizeof(ModuleSymbol) * i;
+        put_u32(rec, name);
+        put_u32(rec + 4, (uint32_t)sym->kind);
+        put_u32(rec + 8, (uint32_t)sym->val);
+        put_u32(rec + 12, (uint32_t)sym->level);
+        put_u32(rec + 16, (uint32_t)sym->addr);
+        put_u32(rec + 20, (uint32_t)sym->mark);
+        size_t len = strlen(sym->name) + 1;
+        memcpy(file + stringOffset + name, sym->name, len);
+        name += (uint32_t)len;
+    }
+    put_u32(file + MH_CHECKSUM, module_crc(file + MH_CHECKSUM + 4, size - (MH_CHECKSUM + 4)));
+
+    int failed = fwrite(file, 1, size, out) != size;
+    free(file);
+    return failed;
+}
+
+// Whether count elements of elemSize bytes at offset lie inside the file,
+// after the header and aligned for 32-bit loads
+int module_section_ok(uint32_t offset, uint32_t count, size_t elemSize, uint32_t headerSize, size_t size) {
+    return offset % 4 == 0 && offset >= headerSize && count <= INT_MAX &&
+           (unsigned long long)offset + (unsigned long long)count * elemSize <= size;
+}
+
+// Check a mapped module; returns a MODULE_* code
+int module_check(const unsigned char* p, size_t size) {
+    if (size < MODULE_HEADER_SIZE || memcmp(p + MH_MAGIC, "PL0M", 4) != 0) return MODULE_BAD_FORMAT;
+    unsigned version = p[MH_VERSION] | p[MH_VERSION + 1] << 8;
+    if (version != MODULE_VERSION) return MODULE_BAD_VERSION;
+    // The checksum covers everything after it, the rest of the header too
+    if (module_crc(p + MH_CHECKSUM + 4, size - (MH_CHECKSUM + 4)) != get_u32(p + MH_CHECKSUM)) {
+        return MODULE_BAD_CHECKSUM;
+    }
+    uint32_t headerSize = p[MH_HEADER_SIZE] | p[MH_HEADER_SIZE + 1] << 8;
+    if (headerSize < MODULE_HEADER_SIZE || headerSize % 4 != 0 || headerSize > size ||
+        get_u32(p + MH_FILE_SIZE) != size ||
+        !module_section_ok(get_u32(p + MH_CODE), get_u32(p + MH_CODE_COUNT), 4, headerSize, size) ||
+        !module_section_ok(get_u32(p + MH_SYMBOLS), get_u32(p + MH_SYMBOL_COUNT),
+                           sizeof(ModuleSymbol), headerSize, size) ||
+        !module_section_ok(get_u32(p + MH_STRINGS), get_u32(p + MH_STRING_SIZE), 1, headerSize, size)) {
+        return MODULE_BAD_FORMAT;
+    }
+
+    // Every name must end inside the string pool
+    const unsigned char* strings = p + get_u32(p + MH_STRINGS);
+    uint32_t stringSize = get_u32(p + MH_STRING_SIZE);
+    if (stringSize > 0 && strings[stringSize - 1] != 0) return MODULE_BAD_FORMAT;
+    const unsigned char* symbols = p + get_u32(p + MH_SYMBOLS);
+    for (uint32_t i = 0; i < get_u32(p + MH_SYMBOL_COUNT); i++) {
+        if (get_u32(symbols + sizeof(ModuleSymbol) * i) >= stringSize) return MODULE_BAD_FORMAT;
+    }
+    return MODULE_OK;
+}
+
+int module_open(const char* path, Module* module) {
+    memset(module, 0, sizeof(*module));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return MODULE_IO_ERROR;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return MODULE_IO_ERROR;
+    }
+    if (st.st_size < MODULE_HEADER_SIZE || st.st_size > INT_MAX) {
+        close(fd);
+        return MODULE_BAD_FORMAT;
+    }
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return MODULE_IO_ERROR;
+    module->map = map;
+    module->mapSize = size;
+    const unsigned char* p = map;
+    int status = module_check(p, size);
+    if (status != MODULE_OK) {
+        module_close(module);
+        return status;
+    }
+
+    const unsigned char* code = p + get_u32(p + MH_CODE);
+    const unsigned char* symbols = p + get_u32(p + MH_SYMBOLS);
+    module->codeLength = (int)get_u32(p + MH_CODE_COUNT);
+    module->symbolCount = (int)get_u32(p + MH_SYMBOL_COUNT);
+    module->strings = (const char*)p + get_u32(p + MH_STRINGS);
+    module->stringSize = (int)get_u32(p + MH_STRING_SIZE);
+    if (module_layout_native()) {
+        module->code = (const instruction*)code;
+        module->symbols = (const ModuleSymbol*)symbols;
+        return MODULE_OK;
+    }
+
+    size_t codeBytes = sizeof(instruction) * module->codeLength;
+    unsigned char* copy = malloc(codeBytes + sizeof(ModuleSymbol) * module->symbolCount + 1);
+    if (!copy) {
+        module_close(module);
+        errno = ENOMEM;
+        return MODULE_IO_ERROR;
+    }
+    instruction* decoded = (instruction*)copy;
+    for (int i = 0; i < module->codeLength; i++) decoded[i] = unpack_instruction(get_u32(code + 4 * i));
+    ModuleSymbol* syms = (ModuleSymbol*)(copy + codeBytes);
+    for (int i = 0; i < module->symbolCount; i++) {
+        const unsigned char* rec = symbols + sizeof(ModuleSymbol) * i;
+        syms[i].name = get_u32(rec);
+        syms[i].kind = (int32_t)get_u32(rec + 4);
+        syms[i].val = (int32_t)get_u32(rec + 8);
+        syms[i].level = (int32_t)get_u32(rec + 12);
+        syms[i].addr = (int32_t)get_u32(rec + 16);
+        syms[i].mark = (int32_t)get_u32(rec + 20);
+    }
+    module->copy = copy;
+    module->code = decoded;
+    module->symbols = syms;
+    return MODULE_OK;
+}
+
+void module_close(Module* module) {
+    if (module->map) munmap(module->map, module->mapSize);
+    free(module->copy);
+    memset(module, 0, sizeof(*module));
+}
+
+#ifndef PL0_NO_MAIN
+
+// Print the lexical errors of a compile
+void print_errors(Output* out, const CompileResult* result) {
+    int header = 0;
+    for (int i = 0; i < result->errorCount; i++) {
+        const Error* e = &result->errors[i];
+        if (e->code != -1) continue;
+        if (!header) {
+            out_str(out, "\nErrors:\n");
+            header = 1;
+        }
+        if (e->line != -1) {
+            out_str(out, "Line ");
+            out_int(out, e->line, 0);
+            out_str(out, ", Column ");
+            out_int(out, e->column, 0);
+            out_str(out, ": ");
+        }
+        out_str(out, e->message);
+        out_char(out, '\n');
+    }
+}
+
+// Print the syntax error that stopped the parse, if any
+void print_syntax_error(Output* out, const CompileResult* result) {
+    for (int i = 0; i < result->errorCount; i++) {
+        const Error* e = &result->errors[i];
+        if (e->code == -1) continue;
+        if (e->line != -1) {
+            out_str(out, "Error (Line ");
+            out_int(out, e->line, 0);
+            out_str(out, ", Column ");
+            out_int(out, e->column, 0);
+            out_str(out, "): ");
+        } else {
+            out_str(out, "Error: ");
+        }
+        out_str(out, e->message);
+        out_char(out, '\n');
+    }
+}
+
+// All errors as JSON lines, syntax errors first like the text listing
+void print_errors_json(Output* out, const CompileResult* result) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < result->errorCount; i++) {
+            const Error* e = &result->errors[i];
+            if ((e->code == -1) != pass) continue;
+            out_str(out, "{\"type\":\"error\"");
+            out_key(out, "line");
+            out_int(out, e->line, 0);
+            out_key(out, "column");
+            out_int(out, e->column, 0);
+            out_key(out, "code");
+            out_int(out, e->code, 0);
+            out_key(out, "message");
+            out_json_string(out, e->message, (int)strlen(e->message));
+            out_str(out, "}\n");
+        }
+    }
+}
+
+// Register operand: rN, or #value for a constant
+void out_reg_operand(Output* out, const RegProgram* p, int reg) {
+    if (reg >= p->constantBase && reg < p->constantBase + p->constantCount) {
+        out_char(out, '#');
+        out_int(out, p->constants[reg - p->constantBase], 0);
+    } else {
+        out_char(out, 'r');
+        out_int(out, reg, 0);
+    }
+}
+
+void print_register_code(Output* out, const RegProgram* p, int format) {
+    static const char* const names[] = {
+        "", "MOV", "NEG", "ADD", "SUB", "MUL", "DIV", "JMP", "JEQ", "JNE", "JLT",
+        "JLE", "JGT", "JGE", "JODD", "JEVEN", "READ", "WRITE", "HALT"
+    };
+    if (format == FORMAT_JSON) {
+        for (int i = 0; i < p->length; i++) {
+            const RegInstruction* in = &p->code[i];
+            out_str(out, "{\"type\":\"reg\"");
+            out_key(out, "line");
+            out_int(out, i, 0);
+            out_key(out, "op");
+            out_json_string(out, names[in->op], (int)strlen(names[in->op]));
+            out_key(out, "d");
+            out_int(out, in->d, 0);
+            out_key(out, "a");
+            out_int(out, in->a, 0);
+            out_key(out, "b");
+            out_int(out, in->b, 0);
+            out_str(out, "}\n");
+        }
+        out_str(out, "{\"type\":\"registers\"");
+        out_key(out, "count");
+        out_int(out, p->registers, 0);
+        out_key(out, "constantBase");
+        out_int(out, p->constantBase, 0);
+        out_key(out, "constants");
+        out_char(out, '[');
+        for (int i = 0; i < p->constantCount; i++) {
+            if (i > 0) out_char(out, ',');
+            out_int(out, p->constants[i], 0);
+        }
+        out_str(out, "]}\n");
+        return;
+    }
+
+    out_str(out, "\nRegister Code:\n");
+    out_str(out, "Line OP    operands\n");
+    for (int i = 0; i < p->length; i++) {
+        const RegInstruction* in = &p->code[i];
+        out_int(out, i, 4);
+        out_char(out, ' ');
+        if (in->op == REG_HALT) {
+            out_str(out, names[in->op]);
+            out_char(out, '\n');
+            continue;
+        }
+        out_padded(out, names[in->op], -5);
+        out_char(out, ' ');
+        switch (in->op) {
+            case REG_MOV: case REG_NEG:
+                out_char(out, 'r');
+                out_int(out, in->d, 0);
+                out_str(out, ", ");
+                out_reg_operand(out, p, in->a);
+                break;
+            case REG_ADD: case REG_SUB: case REG_MUL: case REG_DIV:
+                out_char(out, 'r');
+                out_int(out, in->d, 0);
+                out_str(out, ", ");
+                out_reg_operand(out, p, in->a);
+                out_str(out, ", ");
+                out_reg_operand(out, p, in->b);
+                break;
+            case REG_JMP:
+                out_int(out, in->d, 0);
+                break;
+            case REG_JODD: case REG_JEVEN:
+                out_int(out, in->d, 0);
+                out_str(out, ", ");
+                out_reg_operand(out, p, in->a);
+                break;
+            case REG_READ:
+                out_char(out, 'r');
+                out_int(out, in->d, 0);
+                break;
+            case REG_WRITE:
+                out_reg_operand(out, p, in->a);
+                break;
+            default:
+                out_int(out, in->d, 0);
+                out_str(out, ", ");
+                out_reg_operand(out, p, in->a);
+                out_str(out, ", ");
+                out_reg_operand(out, p, in->b);
+                break;
+        }
+        out_char(out, '\n');
+    }
+    out_str(out, "Registers: ");
+    out_int(out, p->registers, 0);
+    out_str(out, " (constants from r");
+    out_int(out, p->constantBase, 0);
+    out_str(out, ")\n");
+}
+
+void print_code(Output* out, const CompileResult* result, int format) {
+    if (result->reg.length > 0) {
+        print_register_code(out, &result->reg, format);
+    } else if (format == FORMAT_BINARY) {
+        out_flush(out);
+        if (module_write(out->file, result) != 0) out->failed = 1;
+    } else if (format == FORMAT_JSON) {
+        for (int i = 0; i < result->codeLength; i++) {
+            out_str(out, "{\"type\":\"instruction\"");
+            out_key(out, "line");
+            out_int(out, i, 0);
+            out_key(out, "op");
+            out_int(out, result->code[i].op, 0);
+            out_key(out, "l");
+            out_int(out, result->code[i].L, 0);
+            out_key(out, "m");
+            out_int(out, result->code[i].M, 0);
+            out_str(out, "}\n");
+        }
+    } else {
+        out_str(out, "\nAssembly Code:\n");
+        out_str(out, "Line OP L M\n");
+        for (int i = 0; i < result->codeLength; i++) {
+            out_int(out, i, 4);
+            out_char(out, ' ');
+            out_int(out, result->code[i].op, 3);
+            out_char(out, ' ');
+            out_int(out, result->code[i].L, 0);
+            out_char(out, ' ');
+            out_int(out, result->code[i].M, 0);
+            out_char(out, '\n');
+        }
+    }
+}
+
+void print_symbols(Output* out, const CompileResult* result, int format) {
+    if (format == FORMAT_TEXT) {
+        out_str(out, "\nSymbol Table:\n");
+        out_str(out, "Kind | Name | Value | Level | Address | Mark\n");
+        out_str(out, "--------------------------------------------\n");
+    }
+    for (int i = 0; i < result->symbolCount; i++) {
+        const symbol* sym = &result->symbols[i];
+        if (format == FORMAT_JSON) {
+            out_str(out, "{\"type\":\"symbol\"");
+            out_key(out, "kind");
+            out_int(out, sym->kind, 0);
+            out_key(out, "name");
+            out_json_string(out, sym->name, (int)strlen(sym->name));
+            out_key(out, "value");
+            out_int(out, sym->val, 0);
+            out_key(out, "level");
+            out_int(out, sym->level, 0);
+            out_key(out, "address");
+            out_int(out, sym->addr, 0);
+            out_key(out, "mark");
+            out_int(out, sym->mark, 0);
+            out_str(out, "}\n");
+        } else {
+            out_int(out, sym->kind, 4);
+            out_str(out, " | ");
+            out_padded(out, sym->name, 4);
+            out_str(out, " | ");
+            out_int(out, sym->val, 5);
+            out_str(out, " | ");
+            out_int(out, sym->level, 5);
+            out_str(out, " | ");
+            if (sym->addr == ADDR_REMOVED) out_padded(out, "removed", 7);
+            else out_int(out, sym->addr, 7);
+            out_str(out, " | ");
+            out_int(out, sym->mark, 4);
+            out_char(out, '\n');
+        }
+    }
+}
+
+// Effect of the optimizer, with the code
+void print_passes(Output* out, const CompileResult* result, int format) {
+    if (result->passCount == 0) return;
+    if (format == FORMAT_JSON) {
+        for (int i = 0; i < result->passCount; i++) {
+            const PassStat* p = &result->passes[i];
+            out_str(out, "{\"type\":\"pass\",\"name\":");
+            out_json_string(out, p->name, (int)strlen(p->name));
+            out_key(out, "before");
+            out_int(out, p->before, 0);
+            out_key(out, "after");
+            out_int(out, p->after, 0);
+            out_str(out, "}\n");
+        }
+        return;
+    }
+    if (result->reg.length > 0) {
+        out_str(out, "\nOptimizer (stack instructions of the tree):\n");
+    } else {
+        out_str(out, "\nOptimizer: ");
+        out_int(out, result->codeSaved, 0);
+        out_str(out, " instructions saved (");
+        out_int(out, result->codeLength + result->codeSaved, 0);
+        out_str(out, " -> ");
+        out_int(out, result->codeLength, 0);
+        out_str(out, ")\n");
+    }
+    for (int i = 0; i < result->passCount; i++) {
+        const PassStat* p = &result->passes[i];
+        out_str(out, "  ");
+        out_padded(out, p->name, -9);
+        out_char(out, ' ');
+        out_int(out, p->before, 6);
+        out_str(out, " -> ");
+        out_int(out, p->after, 0);
+        if (strcmp(p->name, "slots") == 0) out_str(out, " frame slots");
+        out_char(out, '\n');
+    }
+}
+
+// Print the listing of a compile, each artifact in its format: the lexeme
+// echo and token list (only when the whole source was tokenized up
+// front), any errors, then the generated code and symbol table if the
+// program compiled. Returns 1 if writing failed.
+int print_listing(FILE* file, CompilerContext* ctx, const CompileResult* result, int tokenized,
+                  const int* formats) {
+    Output* out = malloc(sizeof(Output));
+    if (!out) {
+        out_of_memory();
+    }
+    out_init(out, file);
+    if (tokenized && formats[ARTIFACT_TOKENS] != FORMAT_NONE) {
+        // Lexical analysis listing
+        print_lexemes(out, ctx, formats[ARTIFACT_TOKENS]);
+        int lexicalErrors = 0;
+        for (int i = 0; i < result->errorCount; i++) {
+            if (result->errors[i].code == -1) lexicalErrors++;
+        }
+        if (!lexicalErrors && formats[ARTIFACT_TOKENS] == FORMAT_TEXT) {
+            print_token_list(out, ctx);
+        }
+    }
+
+    if (formats[ARTIFACT_ERRORS] == FORMAT_JSON) {
+        print_errors_json(out, result);
+    } else if (formats[ARTIFACT_ERRORS] == FORMAT_TEXT) {
+        print_syntax_error(out, result);
+        print_errors(out, result);
+    }
+    if (result->errorCount == 0) {
+        if (formats[ARTIFACT_CODE] != FORMAT_NONE) print_code(out, result, formats[ARTIFACT_CODE]);
+        if (formats[ARTIFACT_SYMBOLS] != FORMAT_NONE) print_symbols(out, result, formats[ARTIFACT_SYMBOLS]);
+        if (formats[ARTIFACT_CODE] == FORMAT_TEXT || formats[ARTIFACT_CODE] == FORMAT_JSON) {
+            print_passes(out, result, formats[ARTIFACT_CODE]);
+        }
+    }
+    out_flush(out);
+    int failed = out->failed;
+    free(out);
+    return failed;
+}
+
+// Print the --stats report of a compile on stderr, as text or as one JSON
+// line
+void print_stats(const CompileStats* s, int json) {
+    static const char* const phases[PHASE_COUNT] = {"read", "lex", "parse", "output"};
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    long long peak = ru.ru_maxrss;  // bytes
+#else
+    long long peak = ru.ru_maxrss * 1024LL;
+#endif
+    if (json) {
+        fprintf(stderr, "{\"type\":\"stats\"");
+        for (int k = 0; k < 2; k++) {
+            fprintf(stderr, ",\"%s\":{", k == 0 ? "wall" : "cpu");
+            for (int i = 0; i < PHASE_COUNT; i++) {
+                fprintf(stderr, "%s\"%s\":%.6f", i ? "," : "", phases[i], k == 0 ? s->wall[i] : s->cpu[i]);
+            }
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr, ",\"tokens\":%d,\"symbols\":%d,\"names\":%d,\"instructions\":%d,\"lookups\":%lld,"
+                "\"probes\":%lld,\"maxDepth\":%d,\"arenaBytes\":%zu,\"peakRss\":%lld}\n",
+                s->tokens, s->symbols, s->names, s->instructions, s->lookups, s->probes, s->maxDepth,
+                s->arenaBytes, peak);
+        return;
+    }
+    fprintf(stderr, "Stats:\n  phase     wall ms    cpu ms\n");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(stderr, "  %-6s %10.3f %9.3f\n", phases[i], s->wall[i] * 1e3, s->cpu[i] * 1e3);
+    }
+    fprintf(stderr, "  %d tokens, %d symbols, %d instructions\n", s->tokens, s->symbols, s->instructions);
+    fprintf(stderr, "  names: %d interned, %lld probes\n", s->names, s->probes);
+    fprintf(stderr, "  find_symbol: %lld lookups\n", s->lookups);
+    fprintf(stderr, "  expression depth: %d\n", s->maxDepth);
+    fprintf(stderr, "  memory: %zu KB held by the compiler, %lld KB peak RSS\n",
+            s->arenaBytes >> 10, peak >> 10);
+}
+
+// Run a compiled program for --run or --jit, reporting how it stopped if
+// not by HALT
+int run_program(const CompileResult* result, int jit, int vmStats) {
+    static const char* const reasons[] = {
+        "", "invalid code", "division by zero", "expected an integer to read",
+        "stack overflow", "out of memory"
+    };
+    struct timespec start, stop;
+    RunResult run;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed;
+    if (result->reg.length > 0) {
+        failed = reg_run(&result->reg, stdin, stdout, &run);
+    } else if (jit) {
+        failed = vm_run_jit(result->code, result->codeLength, stdin, stdout, &run);
+    } else {
+        failed = vm_run(result->code, result->codeLength, stdin, stdout, &run);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    fflush(stdout);
+    if (failed) {
+        printf("Run-time error at instruction %d: %s\n", run.pc, reasons[run.status]);
+    }
+    if (vmStats) {
+        double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "VM: %lld instructions in %.3f s (%.1f million/sec)\n",
+                run.steps, seconds, seconds > 0 ? run.steps / seconds / 1e6 : 0.0);
+    }
+    return failed;
+}
+
+// Run a module file for --exec
+int exec_module(const char* path, int jit, int vmStats) {
+    static const char* const problems[] = {
+        "", "", "not a PL/0 module", "unsupported module version", "checksum mismatch"
+    };
+    Module module;
+    int status = module_open(path, &module);
+    if (status == MODULE_IO_ERROR) {
+        perror("Error opening module");
+        return 1;
+    }
+    if (status != MODULE_OK) {
+        printf("Error: %s: %s\n", path, problems[status]);
+        return 1;
+    }
+    CompileResult result = {0};
+    result.code = module.code;
+    result.codeLength = module.codeLength;
+    int failed = run_program(&result, jit, vmStats);
+    module_close(&module);
+    return failed;
+}
+
+// Write the -o module of a compile
+int write_module(const char* path, const CompileResult* result) {
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        perror("Error writing module");
+        return 1;
+    }
+    int failed = module_write(out, result);
+    if (fclose(out) != 0) failed = 1;
+    if (failed) printf("Error: could not write module %s\n", path);
+    return failed;
+}
+
+// On-disk compile cache for --cache. An entry holds the listing or the
+// module of one successful compile and is named by a hash of the output
+// version, the C compiler, the options and the source bytes, so a hit
+// skips lexing and parsing altogether. Entries are written to a temporary
+// file and renamed into place, so concurrent compiles never see half an
+// entry. The stats file keeps the hit and miss counters and the bytes
+// stored; it is updated under flock(), and once the bytes pass the limit
+// the least recently used entries are deleted down to three quarters of it.
+
+// Version of the compiler's output: bump it with any change to the
+// listing or the code generated for some program, so that entries older
+// builds wrote are no longer used. Rebuilding alone keeps the cache.
+#define CACHE_VERSION 1
+#ifdef __VERSION__
+#define CACHE_COMPILER __VERSION__  // of the C compiler, whose code may differ
+#else
+#define CACHE_COMPILER "unknown"
+#endif
+#define CACHE_DEFAULT_LIMIT (64LL << 20)
+
+enum { CACHE_LISTING, CACHE_MODULE };  // kinds of entries
+
+typedef struct {
+    const char* dir;
+    long long limit;  // bytes
+    int hits;         // lookups of this process
+    int misses;
+} CompileCache;
+
+typedef struct {
+    char* name;
+    struct timespec used;
+    long long size;
+} CacheEntry;
+
+// Entry path for a source: FNV-1a-64 over the versions, C compiler, kind,
+// options and source, then CRC-32 of the source. formats are the listing's, NULL for
+// a module.
+void cache_path(char* path, size_t size, const CompileCache* cache, int kind, const int* formats,
+                const char* src, size_t len, int optLevel, int target) {
+    char options[256];
+    int n = snprintf(options, sizeof(options), "pl0 %d %d %s|%d|%d|%d|%d%d%d%d|", CACHE_VERSION,
+                     MODULE_VERSION, CACHE_COMPILER, kind, optLevel, target,
+                     formats ? formats[ARTIFACT_TOKENS] : 0, formats ? formats[ARTIFACT_CODE] : 0,
+                     formats ? formats[ARTIFACT_SYMBOLS] : 0, formats ? formats[ARTIFACT_ERRORS] : 0);
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < n; i++) h = (h ^ (unsigned char)options[i]) * 0x100000001b3ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)src[i]) * 0x100000001b3ULL;
+    snprintf(path, size, "%s/%016llx%08x.%s", cache->dir, h,
+             (unsigned)module_crc((const unsigned char*)src, len), kind == CACHE_MODULE ? "pm0" : "lst");
+}
+
+// Read a whole file; NULL if it cannot be read
+char* read_file(const char* path, size_t* size) {
+    FILE* in = fopen(path, "rb");
+    if (!in) return NULL;
+    char* data = NULL;
+    long length = -1;
+    if (fseek(in, 0, SEEK_END) == 0 && (length = ftell(in)) >= 0 && fseek(in, 0, SEEK_SET) == 0) {
+        data = malloc(length + 1);
+        if (data && fread(data, 1, length, in) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(in);
+    if (data) {
+        data[length] = '\0';
+        *size = (size_t)length;
+    }
+    return data;
+}
+
+int write_file(const char* path, const char* data, size_t size) {
+    FILE* out = fopen(path, "wb");
+    if (!out) return 1;
+    int failed = fwrite(data, 1, size, out) != size;
+    if (fclose(out) != 0) failed = 1;
+    return failed;
+}
+
+// Mark an entry as just used, for eviction
+void cache_touch(const char* path) {
+    utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+int compare_cache_age(const void* a, const void* b) {
+    const CacheEntry* x = a;
+    const CacheEntry* y = b;
+    if (x->used.tv_sec != y->used.tv_sec) return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    if (x->used.tv_nsec != y->used.tv_nsec) return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Delete the least recently used entries until at most target bytes are
+// left; returns the bytes left
+long long cache_evict(const CompileCache* cache, long long target) {
+    DIR* dir = opendir(cache->dir);
+    if (!dir) return 0;
+    CacheEntry* entries = NULL;
+    int count = 0, capacity = 0;
+    long long total = 0;
+    char path[PATH_MAX];
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        size_t length = strlen(d->d_name);
+        if (d->d_name[0] == '.' || length < 4 ||
+            (strcmp(d->d_name + length - 4, ".lst") != 0 && strcmp(d->d_name + length - 4, ".pm0") != 0)) {
+            continue;  // temporary files, stats
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, d->d_name);
+        if (stat(path, &st) != 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(CacheEntry));
+            if (!entries) {
+                out_of_memory();
+            }
+        }
+        entries[count].name = strdup(d->d_name);
+        entries[count].used = st.st_mtim;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+    qsort(entries, count, sizeof(CacheEntry), compare_cache_age);
+    for (int i = 0; i < count; i++) {
+        if (total > target) {
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+            if (unlink(path) == 0) total -= entries[i].size;
+        }
+        free(entries[i].name);
+    }
+    free(entries);
+    return total;
+}
+
+// Add to the counters of the stats file and evict if the entries have
+// grown past the limit. Fills the totals when asked for them.
+void cache_account(const CompileCache* cache, int hits, int misses, long long added, long long* totals) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stats", cache->dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return;
+    flock(fd, LOCK_EX);
+    long long h = 0, m = 0, bytes = 0;
+    char buf[128];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n > 0) {
+        buf[n] = '\0';
+        sscanf(buf, "hits %lld misses %lld bytes %lld", &h, &m, &bytes);
+    }
+    h += hits;
+    m += misses;
+    bytes += added;
+    if (bytes > cache->limit) bytes = cache_evict(cache, cache->limit / 4 * 3);
+    n = snprintf(buf, sizeof(buf), "hits %lld\nmisses %lld\nbytes %lld\n", h, m, bytes);
+    if (pwrite(fd, buf, n, 0) != n || ftruncate(fd, n) != 0) {
+        // the counters are advisory; the next update rewrites them
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (totals) {
+        totals[0] = h;
+        totals[1] = m;
+        totals[2] = bytes;
+    }
+}
+
+// Store an entry: write a temporary file, then rename it over the entry
+void cache_store(const CompileCache* cache, const char* path, const char* data, size_t size) {
+    static int serial;
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/.tmp-%ld-%d", cache->dir, (long)getpid(), __sync_fetch_and_add(&serial, 1));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    struct stat old;  // an entry another compile stored meanwhile
+    long long replaced = stat(path, &old) == 0 ? old.st_size : 0;
+    if (close(fd) == 0 && done == size && rename(tmp, path) == 0) {
+        cache_account(cache, 0, 0, (long long)size - replaced, NULL);
+    } else {
+        unlink(tmp);
+    }
+}
+
+// Listing of a compile as the cache keeps it: a line with the instruction
+// count and the instructions saved, then the listing
+char* render_listing(CompilerContext* ctx, const CompileResult* result, int tokenized, const int* formats,
+                     size_t* size) {
+    char* data = NULL;
+    FILE* out = open_memstream(&data, size);
+    if (!out) {
+        out_of_memory();
+    }
+    fprintf(out, "%d %d\n", result->codeLength + result->reg.length, result->codeSaved);
+    print_listing(out, ctx, result, tokenized, formats);
+    fclose(out);
+    return data;
+}
+
+char* render_module(const CompileResult* result, size_t* size) {
+    char* data = NULL;
+    FILE* out = open_memstream(&data, size);
+    if (!out) {
+        out_of_memory();
     }
-    
-    // Print symbol table
-    printf("\nSymbol Table:\n");
-    printf("Kind | Name | Value | Level | Address | Mark\n");
-    printf("--------------------------------------------\n");
-    for (int i = 0; i < sym_table_size; i++) {
-        printf("%4d | %4s | %5d | %5d | %7d | %4d\n",
-               symbol_table[i].kind,
-               symbol_table[i].name,
-               symbol_table[i].val,
-               symbol_table[i].level,
-               symbol_table[i].addr,
-               symbol_table[i].mark);
+    if (module_write(out, result) != 0) {
+        out_of_memory();
     }
-    
+    fclose(out);
+    return data;
+}
+
+// The listing part of a cached listing, with its counts
+const char* cached_listing(const char* data, int* instructions, int* saved) {
+    const char* body = strchr(data, '\n');
+    if (!body || sscanf(data, "%d %d", instructions, saved) != 2) return NULL;
+    return body + 1;
+}
+
+// Single-file compile through the cache. The listing is cached unless the
+// program is only run; the module when it runs or goes to -o. Stack code
+// only, since modules cannot hold register code.
+int compile_cached(CompileCache* cache, CompilerContext* ctx, FILE* input, int optLevel, int target,
+                   const int* formats, int run, int jit, int vmStats, const char* modulePath) {
+    char listingPath[PATH_MAX], modulePathInCache[PATH_MAX];
+    compiler_reset(ctx);
+    load_source(ctx, input);
+    int wantListing = !run;
+    int wantModule = run || modulePath;
+    cache_path(listingPath, sizeof(listingPath), cache, CACHE_LISTING, formats,
+               ctx->source, ctx->sourceLength, optLevel, target);
+    cache_path(modulePathInCache, sizeof(modulePathInCache), cache, CACHE_MODULE, NULL,
+               ctx->source, ctx->sourceLength, optLevel, target);
+
+    // Lookup: every entry this compile needs must be there
+    char* listing = NULL;
+    size_t listingSize = 0;
+    const char* body = NULL;
+    int instructions, saved;
+    Module module;
+    int haveModule = 0;
+    int hit = 1;
+    if (wantListing) {
+        listing = read_file(listingPath, &listingSize);
+        body = listing ? cached_listing(listing, &instructions, &saved) : NULL;
+        hit = body != NULL;
+    }
+    if (hit && wantModule) {
+        haveModule = module_open(modulePathInCache, &module) == MODULE_OK;
+        hit = haveModule;
+    }
+    if (hit) {
+        int failed = 0;
+        __sync_fetch_and_add(&cache->hits, 1);
+        if (wantListing) {
+            cache_touch(listingPath);
+            fwrite(body, 1, listingSize - (body - listing), stdout);
+        }
+        if (wantModule) {
+            cache_touch(modulePathInCache);
+            if (modulePath) {
+                const char* bytes = module.map;
+                failed = write_file(modulePath, bytes, module.mapSize);
+                if (failed) printf("Error: could not write module %s\n", modulePath);
+            }
+            if (run && !failed) {
+                CompileResult result = {0};
+                result.code = module.code;
+                result.codeLength = module.codeLength;
+                failed = run_program(&result, jit, vmStats);
+            }
+            module_close(&module);
+        }
+        free(listing);
+        cache_account(cache, 1, 0, 0, NULL);
+        return failed;
+    }
+    if (haveModule) module_close(&module);
+    int listingCached = body != NULL;
+    free(listing);
+    __sync_fetch_and_add(&cache->misses, 1);
+    cache_account(cache, 0, 1, 0, NULL);
+
+    CompileResult result;
+    int failed = compile_loaded(ctx, &result);
+    if (failed) {
+        print_listing(stdout, ctx, &result, !run, formats);
+        return failed;
+    }
+    if (wantListing) {
+        size_t size;
+        char* data = render_listing(ctx, &result, 1, formats, &size);
+        if (!listingCached) cache_store(cache, listingPath, data, size);
+        const char* text = cached_listing(data, &instructions, &saved);
+        fwrite(text, 1, size - (text - data), stdout);
+        free(data);
+    }
+    if (wantModule) {
+        size_t size;
+        char* data = render_module(&result, &size);
+        cache_store(cache, modulePathInCache, data, size);
+        if (modulePath && write_file(modulePath, data, size) != 0) {
+            printf("Error: could not write module %s\n", modulePath);
+            failed = 1;
+        }
+        free(data);
+    }
+    if (run && !failed) failed = run_program(&result, jit, vmStats);
+    return failed;
+}
+
+// Print the --cache-stats line
+void print_cache_stats(const CompileCache* cache) {
+    long long totals[3];
+    cache_account(cache, 0, 0, 0, totals);
+    fprintf(stderr, "Cache: %d hits, %d misses (all runs: %lld hits, %lld misses, %lld bytes stored)\n",
+            cache->hits, cache->misses, totals[0], totals[1], totals[2]);
+}
+
+// Batch compilation. The files are split into one contiguous range per
+// worker; a worker whose range runs dry steals the back half of another
+// worker's remaining range. Each worker owns a CompilerContext, and every
+// file gets its own listing file, so the output does not depend on which
+// worker compiled what.
+typedef struct {
+    pthread_mutex_t lock;
+    int next;  // next file to compile
+    int end;
+} WorkRange;
+
+typedef struct BatchFile {
+    char* path;
+    char* listing;     // file the listing goes to
+    const struct BatchFile* clash;  // earlier file with the same listing; not compiled
+    int opened;        // input read and listing written
+    int errorCount;
+    int instructions;
+    int saved;         // instructions removed by the optimizer
+} BatchFile;
+
+typedef struct {
+    BatchFile* files;
+    int fileCount;
+    WorkRange* ranges;
+    int workerCount;
+    const char* outDir;  // NULL writes each listing next to its source
+    int optLevel;
+    int target;          // TARGET_* for every file
+    CompileCache* cache; // NULL without --cache
+    const int* formats;  // of the listings, by ARTIFACT_*
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    int id;
+} BatchWorker;
+
+// Next file for worker id, or -1 when no work is left anywhere
+int take_work(Batch* b, int id) {
+    WorkRange* own = &b->ranges[id];
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        int f = own->next++;
+        pthread_mutex_unlock(&own->lock);
+        return f;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (int k = 1; k < b->workerCount; k++) {
+        WorkRange* victim = &b->ranges[(id + k) % b->workerCount];
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        if (left <= 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        int start = victim->end - (left + 1) / 2;
+        int end = victim->end;
+        victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&own->lock);
+        own->next = start + 1;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        return start;
+    }
+    return -1;
+}
+
+// Listing file for a source: <path>.out, or with outDir the path under
+// outDir, with empty and . components dropped and each .. turned into __
+// so that nothing is written outside it
+char* listing_path(const Batch* b, const char* path) {
+    if (!b->outDir) {
+        char* out = malloc(strlen(path) + 5);
+        if (out) sprintf(out, "%s.out", path);
+        return out;
+    }
+    char* out = malloc(strlen(b->outDir) + strlen(path) + 6);
+    if (!out) return NULL;
+    char* p = out + sprintf(out, "%s", b->outDir);
+    for (const char* s = path; *s; ) {
+        const char* end = strchr(s, '/');
+        if (!end) end = s + strlen(s);
+        int n = (int)(end - s);
+        if (n == 2 && s[0] == '.' && s[1] == '.') {
+            p += sprintf(p, "/__");
+        } else if (n > 0 && !(n == 1 && s[0] == '.')) {
+            p += sprintf(p, "/%.*s", n, s);
+        }
+        s = *end ? end + 1 : end;
+    }
+    strcpy(p, ".out");
+    return out;
+}
+
+// Create the directories a listing goes in
+void make_listing_dirs(char* listing) {
+    for (char* s = listing + 1; (s = strchr(s, '/')) != NULL; s++) {
+        *s = 0;
+        mkdir(listing, 0755);
+        *s = '/';
+    }
+}
+
+int compare_listings(const void* a, const void* b) {
+    const BatchFile* x = *(const BatchFile* const*)a;
+    const BatchFile* y = *(const BatchFile* const*)b;
+    int c = strcmp(x->listing, y->listing);
+    return c ? c : (x > y) - (x < y);  // in the order the files were given
+}
+
+// Give every file its listing. A file whose listing an earlier one already
+// writes is not compiled, so no listing is overwritten or written by two
+// workers at once.
+void assign_listings(Batch* b) {
+    BatchFile** order = malloc(sizeof(BatchFile*) * (b->fileCount + 1));
+    if (!order) {
+        out_of_memory();
+    }
+    for (int i = 0; i < b->fileCount; i++) {
+        b->files[i].listing = listing_path(b, b->files[i].path);
+        if (!b->files[i].listing) {
+            out_of_memory();
+        }
+        order[i] = &b->files[i];
+    }
+    qsort(order, b->fileCount, sizeof(BatchFile*), compare_listings);
+    for (int i = 1; i < b->fileCount; i++) {
+        if (strcmp(order[i]->listing, order[i - 1]->listing) == 0) {
+            order[i]->clash = order[i - 1]->clash ? order[i - 1]->clash : order[i - 1];
+        }
+    }
+    for (int i = 0; i < b->fileCount && b->outDir; i++) {
+        if (!b->files[i].clash) make_listing_dirs(b->files[i].listing);
+    }
+    free(order);
+}
+
+void compile_batch_file(Batch* b, CompilerContext* ctx, BatchFile* f) {
+    if (f->clash) return;
+    FILE* input = fopen(f->path, "r");
+    if (!input) return;
+    FILE* out = fopen(f->listing, "w");
+    if (!out) {
+        fclose(input);
+        return;
+    }
+    setvbuf(out, NULL, _IOFBF, 64 * 1024);
+
+    CompileResult result;
+    compiler_reset(ctx);
+    load_source(ctx, input);
     fclose(input);
-    return 0;
+
+    char entry[PATH_MAX];
+    if (b->cache) {
+        cache_path(entry, sizeof(entry), b->cache, CACHE_LISTING, b->formats,
+                   ctx->source, ctx->sourceLength, b->optLevel, b->target);
+        size_t size;
+        char* data = read_file(entry, &size);
+        const char* text = data ? cached_listing(data, &f->instructions, &f->saved) : NULL;
+        int hit = text != NULL;
+        if (hit) {
+            cache_touch(entry);
+            fwrite(text, 1, size - (text - data), out);
+        }
+        free(data);
+        __sync_fetch_and_add(hit ? &b->cache->hits : &b->cache->misses, 1);
+        cache_account(b->cache, hit, !hit, 0, NULL);
+        if (hit) {
+            f->opened = fclose(out) == 0;
+            return;
+        }
+    }
+
+    compile_loaded(ctx, &result);
+    if (b->cache && result.errorCount == 0) {
+        size_t size;
+        char* data = render_listing(ctx, &result, 1, b->formats, &size);
+        cache_store(b->cache, entry, data, size);
+        const char* text = cached_listing(data, &f->instructions, &f->saved);
+        fwrite(text, 1, size - (text - data), out);
+        free(data);
+    } else {
+        print_listing(out, ctx, &result, 1, b->formats);
+    }
+
+    f->errorCount = result.errorCount;
+    f->instructions = result.errorCount ? 0 : result.codeLength + result.reg.length;
+    f->saved = result.codeSaved;
+    f->opened = fclose(out) == 0;
+}
+
+void* batch_worker(void* arg) {
+    BatchWorker* w = arg;
+    CompilerContext* ctx = compiler_create();
+    if (!ctx) return NULL;
+    compiler_set_optimization(ctx, w->batch->optLevel);
+    compiler_set_target(ctx, w->batch->target);
+    int f;
+    while ((f = take_work(w->batch, w->id)) >= 0) {
+        compile_batch_file(w->batch, ctx, &w->batch->files[f]);
+    }
+    compiler_destroy(ctx);
+    return NULL;
+}
+
+void add_batch_file(Batch* b, int* capacity, const char* dir, const char* name) {
+    if (b->fileCount == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        b->files = realloc(b->files, *capacity * sizeof(BatchFile));
+        if (!b->files) {
+            out_of_memory();
+        }
+    }
+    size_t length = (dir ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+    char* path = malloc(length);
+    if (!path) {
+        out_of_memory();
+    }
+    if (dir) {
+        sprintf(path, "%s/%s", dir, name);
+    } else {
+        strcpy(path, name);
+    }
+    BatchFile* f = &b->files[b->fileCount++];
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+}
+
+int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Add a source file, or every regular file of a directory in name order.
+// Hidden files and earlier .out listings are skipped.
+void collect_batch_files(Batch* b, int* capacity, const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        add_batch_file(b, capacity, NULL, path);
+        return;
+    }
+    DIR* dir = opendir(path);
+    if (!dir) {
+        add_batch_file(b, capacity, NULL, path);
+        return;
+    }
+    char** names = NULL;
+    int count = 0, namesCapacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (entry->d_name[0] == '.') continue;
+        if (length > 4 && strcmp(entry->d_name + length - 4, ".out") == 0) continue;
+        if (count == namesCapacity) {
+            namesCapacity = namesCapacity ? namesCapacity * 2 : 64;
+            names = realloc(names, namesCapacity * sizeof(char*));
+            if (!names) {
+                out_of_memory();
+            }
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char*), compare_names);
+    for (int i = 0; i < count; i++) {
+        char* full = malloc(strlen(path) + strlen(names[i]) + 2);
+        if (full) {
+            sprintf(full, "%s/%s", path, names[i]);
+            if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) {
+                add_batch_file(b, capacity, path, names[i]);
+            }
+            free(full);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Compile every file named by paths on workerCount threads (0 = one per
+// core) and print a summary. Returns 1 if any file failed.
+int run_batch(char** paths, int pathCount, int workerCount, const char* outDir, int optLevel, int target,
+              CompileCache* cache, const int* formats) {
+    Batch b = {0};
+    int capacity = 0;
+    b.outDir = outDir;
+    b.optLevel = optLevel;
+    b.target = target;
+    b.cache = cache;
+    b.formats = formats;
+    for (int i = 0; i < pathCount; i++) {
+        collect_batch_files(&b, &capacity, paths[i]);
+    }
+    assign_listings(&b);
+
+    if (workerCount <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workerCount = cores > 0 ? (int)cores : 1;
+    }
+    if (workerCount > b.fileCount) workerCount = b.fileCount > 0 ? b.fileCount : 1;
+    b.workerCount = workerCount;
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    b.ranges = calloc(workerCount, sizeof(WorkRange));
+    BatchWorker* workers = calloc(workerCount, sizeof(BatchWorker));
+    pthread_t* threads = calloc(workerCount, sizeof(pthread_t));
+    if (!b.ranges || !workers || !threads) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&b.ranges[i].lock, NULL);
+        b.ranges[i].next = (int)((long)b.fileCount * i / workerCount);
+        b.ranges[i].end = (int)((long)b.fileCount * (i + 1) / workerCount);
+        workers[i].batch = &b;
+        workers[i].id = i;
+    }
+    int started = 0;
+    for (int i = 1; i < workerCount; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &workers[i]) != 0) break;
+        started = i;
+    }
+    batch_worker(&workers[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Summary, in the order the files were given
+    int failures = 0;
+    long instructions = 0;
+    long saved = 0;
+    for (int i = 0; i < b.fileCount; i++) {
+        BatchFile* f = &b.files[i];
+        if (f->clash) {
+            printf("%s: listing %s is already written for %s\n", f->path, f->listing, f->clash->path);
+            failures++;
+        } else if (!f->opened) {
+            printf("%s: cannot read source or write listing\n", f->path);
+            failures++;
+        } else if (f->errorCount > 0) {
+            printf("%s: %d error%s\n", f->path, f->errorCount, f->errorCount == 1 ? "" : "s");
+            failures++;
+        }
+        instructions += f->instructions;
+        saved += f->saved;
+    }
+    printf("\nBatch: %d files, %d failed, %ld instructions in %.3f s (%.0f files/sec, %d threads)\n",
+           b.fileCount, failures, instructions, seconds,
+           seconds > 0 ? b.fileCount / seconds : 0.0, workerCount);
+    if (optLevel >= 1) {
+        printf("Optimizer: %ld instructions saved\n", saved);
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_destroy(&b.ranges[i].lock);
+    }
+    for (int i = 0; i < b.fileCount; i++) {
+        free(b.files[i].path);
+        free(b.files[i].listing);
+    }
+    free(b.files);
+    free(b.ranges);
+    free(workers);
+    free(threads);
+    return failures > 0;
+}
+
+// Parse an --emit list such as tokens=none,code=json into formats.
+// Returns 0 if it is malformed.
+int parse_formats(const char* spec, int* formats) {
+    static const char* const artifacts[ARTIFACT_COUNT] = {"tokens", "code", "symbols", "errors"};
+    static const char* const names[] = {"text", "json", "none", "binary"};
+    while (*spec) {
+        const char* eq = strchr(spec, '=');
+        if (!eq) return 0;
+        const char* end = strchr(eq, ',');
+        if (!end) end = eq + strlen(eq);
+        int artifact = -1, format = -1;
+        for (int k = 0; k < ARTIFACT_COUNT; k++) {
+            if (strlen(artifacts[k]) == (size_t)(eq - spec) && strncmp(spec, artifacts[k], eq - spec) == 0) {
+                artifact = k;
+            }
+        }
+        for (int k = 0; k < 4; k++) {
+            if (strlen(names[k]) == (size_t)(end - eq - 1) && strncmp(eq + 1, names[k], end - eq - 1) == 0) {
+                format = k;
+            }
+        }
+        if (artifact < 0 || format < 0 || (format == FORMAT_BINARY && artifact != ARTIFACT_CODE)) return 0;
+        formats[artifact] = format;
+        spec = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+// Language server for --server: JSON-RPC 2.0 on stdin and stdout, framed
+// as in the Language Server Protocol (a Content-Length header, a blank
+// line, then the JSON body). Each open file is a Document, and every
+// didOpen and didChange is answered with publishDiagnostics for the file.
+// Changes may be ranged (textDocumentSync 2) or whole texts. Positions are
+// 0-based lines and byte columns: the server announces the utf-8 position
+// encoding, which matches what editors send for ASCII text either way.
+
+// Open file of the server
+typedef struct {
+    char* uri;
+    Document* doc;
+} ServerFile;
+
+typedef struct {
+    ServerFile* files;
+    int fileCount;
+    int fileCapacity;
+    Output* out;           // body of the message being written
+    char* body;
+    size_t bodySize;
+    FILE* bodyFile;
+    int shutdown;          // shutdown was requested
+    long long messages;
+    double seconds;        // spent applying edits and collecting diagnostics
+    DocumentStats closed;  // work of the files closed so far
+} Server;
+
+double now_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+const char* json_space(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return p;
 }
+
+// End of the JSON value at p, or NULL if it is malformed
+const char* json_skip(const char* p) {
+    p = json_space(p);
+    if (*p == '"') {
+        for (p++; *p != '"'; p++) {
+            if (*p == '\0') return NULL;
+            if (*p == '\\' && *++p == '\0') return NULL;
+        }
+        return p + 1;
+    }
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p = json_space(p + 1);
+        if (*p == close) return p + 1;
+        for (;;) {
+            if (close == '}') {
+                p = json_skip(p);
+                if (!p) return NULL;
+                p = json_space(p);
+                if (*p++ != ':') return NULL;
+            }
+            p = json_skip(p);
+            if (!p) return NULL;
+            p = json_space(p);
+            if (*p == close) return p + 1;
+            if (*p++ != ',') return NULL;
+        }
+    }
+    const char* start = p;
+    while (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.') p++;
+    return p > start ? p : NULL;
+}
+
+// Value of member key of the object at p, or NULL
+const char* json_member(const char* p, const char* key) {
+    if (!p) return NULL;
+    p = json_space(p);
+    if (*p != '{') return NULL;
+    p = json_space(p + 1);
+    size_t n = strlen(key);
+    while (*p == '"') {
+        const char* name = p + 1;
+        const char* value = json_skip(p);
+        if (!value) return NULL;
+        value = json_space(value);
+        if (*value != ':') return NULL;
+        value = json_space(value + 1);
+        if (strncmp(name, key, n) == 0 && name[n] == '"') return value;
+        p = json_skip(value);
+        if (!p) return NULL;
+        p = json_space(p);
+        if (*p != ',') return NULL;
+        p = json_space(p + 1);
+    }
+    return NULL;
+}
+
+// Integer at p, or fallback if there is none
+int json_int(const char* p, int fallback) {
+    if (!p) return fallback;
+    p = json_space(p);
+    if (*p != '-' && !isdigit((unsigned char)*p)) return fallback;
+    long long value = strtoll(p, NULL, 10);
+    return value < INT_MIN ? INT_MIN : value > INT_MAX ? INT_MAX : (int)value;
+}
+
+// Value of the 4 hex digits at p, or -1
+int hex4(const char* p) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = (unsigned char)p[i];
+        int digit = isdigit(c) ? c - '0' : isxdigit(c) ? (c | 0x20) - 'a' + 10 : -1;
+        if (digit < 0) return -1;
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+// Put the UTF-8 bytes of code point c at s; returns how many
+int utf8_encode(char* s, unsigned c) {
+    if (c < 0x80) {
+        s[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        s[0] = (char)(0xC0 | c >> 6);
+        s[1] = (char)(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000) {
+        s[0] = (char)(0xE0 | c >> 12);
+        s[1] = (char)(0x80 | (c >> 6 & 0x3F));
+        s[2] = (char)(0x80 | (c & 0x3F));
+        return 3;
+    }
+    s[0] = (char)(0xF0 | c >> 18);
+    s[1] = (char)(0x80 | (c >> 12 & 0x3F));
+    s[2] = (char)(0x80 | (c >> 6 & 0x3F));
+    s[3] = (char)(0x80 | (c & 0x3F));
+    return 4;
+}
+
+// Decode the JSON string at p into a malloc'd, NUL-terminated buffer.
+// Returns its length, or -1 if there is no string at p.
+int json_string(const char* p, char** out) {
+    *out = NULL;
+    if (!p) return -1;
+    p = json_space(p);
+    const char* end = json_skip(p);
+    if (*p != '"' || !end) return -1;
+    char* s = malloc(end - p);  // decoding never lengthens a string
+    if (!s) {
+        out_of_memory();
+    }
+    int n = 0;
+    for (p++; p < end - 1; p++) {
+        if (*p != '\\') {
+            s[n++] = *p;
+            continue;
+        }
+        switch (*++p) {
+            case 'b': s[n++] = '\b'; break;
+            case 'f': s[n++] = '\f'; break;
+            case 'n': s[n++] = '\n'; break;
+            case 'r': s[n++] = '\r'; break;
+            case 't': s[n++] = '\t'; break;
+            case 'u': {
+                int c = p + 5 <= end - 1 ? hex4(p + 1) : -1;
+                if (c < 0) break;
+                p += 4;
+                // A surrogate pair stands for one code point
+                int low = c >= 0xD800 && c < 0xDC00 && p + 7 <= end - 1 && p[1] == '\\' && p[2] == 'u'
+                          ? hex4(p + 3) : -1;
+                if (low >= 0xDC00 && low < 0xE000) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                n += utf8_encode(s + n, c);
+                break;
+            }
+            default: s[n++] = *p; break;
+        }
+    }
+    s[n] = '\0';
+    *out = s;
+    return n;
+}
+
+// Read one message body; NULL at the end of input
+char* read_message(FILE* in) {
+    char line[256];
+    long long length = -1;
+    for (;;) {
+        if (!fgets(line, sizeof(line), in)) return NULL;
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            if (length >= 0) break;
+            continue;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) length = atoll(line + 15);
+    }
+    if (length > INT_MAX) return NULL;
+    char* body = malloc(length + 1);
+    if (!body) {
+        out_of_memory();
+    }
+    if (fread(body, 1, length, in) != (size_t)length) {
+        free(body);
+        return NULL;
+    }
+    body[length] = '\0';
+    return body;
+}
+
+// Start a message body
+void server_begin(Server* s) {
+    s->bodyFile = open_memstream(&s->body, &s->bodySize);
+    if (!s->bodyFile) {
+        out_of_memory();
+    }
+    out_init(s->out, s->bodyFile);
+    out_str(s->out, "{\"jsonrpc\":\"2.0\"");
+}
+
+// Finish the message body and send it
+void server_send(Server* s) {
+    out_char(s->out, '}');
+    out_flush(s->out);
+    fclose(s->bodyFile);
+    printf("Content-Length: %zu\r\n\r\n", s->bodySize);
+    fwrite(s->body, 1, s->bodySize, stdout);
+    fflush(stdout);
+    free(s->body);
+}
+
+// Answer request id, the raw JSON value of its id, with a result or an
+// error
+void server_respond(Server* s, const char* id, const char* result, int errorCode, const char* message) {
+    server_begin(s);
+    out_key(s->out, "id");
+    const char* end = id ? json_skip(id) : NULL;
+    if (end) out_bytes(s->out, id, end - id);
+    else out_str(s->out, "null");
+    if (message) {
+        out_str(s->out, ",\"error\":{\"code\":");
+        out_int(s->out, errorCode, 0);
+        out_key(s->out, "message");
+        out_json_string(s->out, message, (int)strlen(message));
+        out_char(s->out, '}');
+    } else {
+        out_key(s->out, "result");
+        out_str(s->out, result);
+    }
+    server_send(s);
+}
+
+// 0-based position of a diagnostic; the end of input is the end of the text
+void diagnostic_position(const Document* doc, const Error* e, int* line, int* character) {
+    if (e->line >= 1) {
+        *line = e->line - 1;
+        *character = e->column - 1;
+    } else {
+        *line = doc->lineCount - 1;
+        *character = doc->length - doc->lineStart[doc->lineCount - 1];
+    }
+}
+
+void out_position(Output* out, int line, int character) {
+    out_str(out, "{\"line\":");
+    out_int(out, line, 0);
+    out_key(out, "character");
+    out_int(out, character, 0);
+    out_char(out, '}');
+}
+
+// Send the diagnostics of a file; NULL clears them
+void publish_diagnostics(Server* s, const char* uri, Document* doc) {
+    double start = now_seconds();
+    const Error* errors = NULL;
+    int count = doc ? document_diagnostics(doc, &errors) : 0;
+    s->seconds += now_seconds() - start;
+
+    server_begin(s);
+    out_str(s->out, ",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":");
+    out_json_string(s->out, uri, (int)strlen(uri));
+    out_str(s->out, ",\"diagnostics\":[");
+    for (int i = 0; i < count; i++) {
+        int line, character;
+        diagnostic_position(doc, &errors[i], &line, &character);
+        out_str(s->out, i ? ",{\"range\":{\"start\":" : "{\"range\":{\"start\":");
+        out_position(s->out, line, character);
+        out_str(s->out, ",\"end\":");
+        out_position(s->out, line, character + 1);
+        out_str(s->out, "},\"severity\":1,\"source\":\"pl0\"");
+        if (errors[i].code >= 0) {
+            out_key(s->out, "code");
+            out_int(s->out, errors[i].code, 0);
+        }
+        out_key(s->out, "message");
+        out_json_string(s->out, errors[i].message, (int)strlen(errors[i].message));
+        out_char(s->out, '}');
+    }
+    out_str(s->out, "]}");
+    server_send(s);
+}
+
+// Open file with uri, or -1
+int server_find(const Server* s, const char* uri) {
+    for (int i = 0; i < s->fileCount; i++) {
+        if (strcmp(s->files[i].uri, uri) == 0) return i;
+    }
+    return -1;
+}
+
+void server_close(Server* s, int file) {
+    const DocumentStats* st = document_stats(s->files[file].doc);
+    s->closed.edits += st->edits;
+    s->closed.fullParses += st->fullParses;
+    s->closed.tokensLexed += st->tokensLexed;
+    s->closed.statementsParsed += st->statementsParsed;
+    document_destroy(s->files[file].doc);
+    free(s->files[file].uri);
+    s->files[file] = s->files[--s->fileCount];
+}
+
+// Apply the contentChanges of a didChange in order
+void apply_changes(Document* doc, const char* changes) {
+    const char* p = json_space(changes);
+    if (*p != '[') return;
+    p = json_space(p + 1);
+    while (*p == '{') {
+        char* text;
+        int length = json_string(json_member(p, "text"), &text);
+        const char* range = json_member(p, "range");
+        if (length < 0) {
+            // Nothing to apply
+        } else if (range) {
+            const char* start = json_member(range, "start");
+            const char* end = json_member(range, "end");
+            document_edit(doc, json_int(json_member(start, "line"), 0) + 1,
+                          json_int(json_member(start, "character"), 0) + 1,
+                          json_int(json_member(end, "line"), 0) + 1,
+                          json_int(json_member(end, "character"), 0) + 1, text, length);
+        } else {
+            document_set_text(doc, text, length);
+        }
+        free(text);
+        p = json_skip(p);
+        if (!p) return;
+        p = json_space(p);
+        if (*p != ',') return;
+        p = json_space(p + 1);
+    }
+}
+
+// Handle one message; returns 0 to go on, otherwise 1 + the exit status
+int server_handle(Server* s, const char* message) {
+    s->messages++;
+    if (*json_space(message) != '{' || !json_skip(message)) {
+        server_respond(s, NULL, NULL, -32700, "Parse error");
+        return 0;
+    }
+    char* method;
+    const char* id = json_member(message, "id");
+    if (json_string(json_member(message, "method"), &method) < 0) {
+        if (id) server_respond(s, id, NULL, -32600, "Invalid Request");
+        return 0;
+    }
+    const char* params = json_member(message, "params");
+    const char* textDocument = json_member(params, "textDocument");
+    char* uri;
+    json_string(json_member(textDocument, "uri"), &uri);
+    int file = uri ? server_find(s, uri) : -1;
+    int status = 0;
+
+    if (strcmp(method, "initialize") == 0) {
+        server_respond(s, id, "{\"capabilities\":{\"positionEncoding\":\"utf-8\",\"textDocumentSync\":"
+                       "{\"openClose\":true,\"change\":2}},\"serverInfo\":{\"name\":\"pl0\"}}", 0, NULL);
+    } else if (strcmp(method, "shutdown") == 0) {
+        s->shutdown = 1;
+        server_respond(s, id, "null", 0, NULL);
+    } else if (strcmp(method, "exit") == 0) {
+        status = 1 + !s->shutdown;
+    } else if (strcmp(method, "textDocument/didOpen") == 0 && uri) {
+        char* text;
+        int length = json_string(json_member(textDocument, "text"), &text);
+        double start = now_seconds();
+        if (file < 0) {
+            RESERVE(s->files, s->fileCapacity, s->fileCount + 1);
+            file = s->fileCount;
+            s->files[file].uri = uri;
+            s->files[file].doc = document_create();
+            if (!s->files[file].doc) {
+                out_of_memory();
+            }
+            s->fileCount++;
+            uri = NULL;
+        }
+        document_set_text(s->files[file].doc, text ? text : "", length > 0 ? length : 0);
+        s->seconds += now_seconds() - start;
+        free(text);
+        publish_diagnostics(s, s->files[file].uri, s->files[file].doc);
+    } else if (strcmp(method, "textDocument/didChange") == 0 && file >= 0) {
+        const char* changes = json_member(params, "contentChanges");
+        double start = now_seconds();
+        if (changes) apply_changes(s->files[file].doc, changes);
+        s->seconds += now_seconds() - start;
+        publish_diagnostics(s, uri, s->files[file].doc);
+    } else if (strcmp(method, "textDocument/didClose") == 0 && file >= 0) {
+        server_close(s, file);
+        publish_diagnostics(s, uri, NULL);
+    } else if (id) {
+        server_respond(s, id, NULL, -32601, "Method not found");
+    }
+    free(method);
+    free(uri);
+    return status;
+}
+
+// Print the work of the server on stderr
+void print_server_stats(const Server* s, int json) {
+    DocumentStats total = s->closed;
+    for (int i = 0; i < s->fileCount; i++) {
+        const DocumentStats* st = document_stats(s->files[i].doc);
+        total.edits += st->edits;
+        total.fullParses += st->fullParses;
+        total.tokensLexed += st->tokensLexed;
+        total.statementsParsed += st->statementsParsed;
+    }
+    if (json) {
+        fprintf(stderr, "{\"type\":\"server-stats\",\"messages\":%lld,\"edits\":%lld,\"fullParses\":%lld,"
+                "\"tokensLexed\":%lld,\"statementsParsed\":%lld,\"seconds\":%.6f}\n", s->messages,
+                total.edits, total.fullParses, total.tokensLexed, total.statementsParsed, s->seconds);
+        return;
+    }
+    fprintf(stderr, "Server stats:\n  %lld messages, %lld edits, %.3f ms updating documents\n",
+            s->messages, total.edits, s->seconds * 1e3);
+    fprintf(stderr, "  %lld full parses, %lld tokens lexed, %lld statements reparsed\n",
+            total.fullParses, total.tokensLexed, total.statementsParsed);
+}
+
+// Serve until exit or the end of input; returns the exit status
+int run_server(int stats) {
+    Server s;
+    memset(&s, 0, sizeof(s));
+    s.out = malloc(sizeof(Output));
+    if (!s.out) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    int status = 0;
+    char* message;
+    while (!status && (message = read_message(stdin))) {
+        status = server_handle(&s, message);
+        free(message);
+    }
+    if (stats) print_server_stats(&s, stats == 2);
+    while (s.fileCount > 0) server_close(&s, s.fileCount - 1);
+    free(s.files);
+    free(s.out);
+    // Without exit the client went away, which is an error too
+    return status ? status - 1 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    // Usage: lex [--stream] [input_file]; without a file the program is
+    // streamed from stdin.
+    //        lex --batch [-j threads] [--out-dir dir] files_or_dirs...
+    // -O1 (or -O) runs the peephole optimizer, -O2 also the syntax tree
+    // passes, -O0 (the default) none.
+    // --run executes the program instead of printing the listing, taking
+    // its input from stdin; --jit does the same with native code.
+    // --vm-stats adds the instruction rate on stderr.
+    // --target register generates register bytecode instead of stack code;
+    // the listing and --run use it.
+    // -o file also writes the stack code as a binary module; --exec file
+    // runs a module (with --jit, as native code) without compiling.
+    // --cache dir reuses listings and modules of earlier compiles of the
+    // same source and options; --cache-size MB bounds it (default 64) and
+    // --cache-stats prints its counters on stderr. Streamed input and
+    // running register code are never cached.
+    // --emit artifact=format,... picks how the listing writes tokens, code,
+    // symbols and errors: text, json (JSON lines), none, or for code
+    // binary (a module). --quiet prints only code and errors, --json
+    // everything as JSON lines.
+    // --stats reports phase times, counters and memory of the compile on
+    // stderr; --stats-json does so as a JSON line.
+    // --lex-threads n lexes a large source on n threads (default one per
+    // core; batch mode lexes each file on its worker's thread).
+    //        lex --server [--stats]
+    // runs a language server on stdin and stdout that reports the errors
+    // of open files as they are edited; --stats prints its work on exit.
+    char* InputFile = NULL;
+    int streamInput = 0;
+    int batch = 0;
+    int server = 0;
+    int jobs = 0;
+    int lexThreads = 0;
+    int optLevel = 0;
+    int run = 0;
+    int jit = 0;
+    int target = TARGET_STACK;
+    int vmStats = 0;
+    char* outDir = NULL;
+    char* modulePath = NULL;
+    char* execPath = NULL;
+    CompileCache cache = {NULL, CACHE_DEFAULT_LIMIT, 0, 0};
+    int cacheStats = 0;
+    int stats = 0;  // 1 for text, 2 for JSON
+    int formats[ARTIFACT_COUNT] = {FORMAT_TEXT, FORMAT_TEXT, FORMAT_TEXT, FORMAT_TEXT};
+    char** paths = argv + 1;  // positional arguments, compacted in place
+    int pathCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stream") == 0) {
+            streamInput = 1;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            optLevel = 1;
+        } else if (strncmp(argv[i], "-O", 2) == 0 && isdigit((unsigned char)argv[i][2])) {
+            optLevel = atoi(argv[i] + 2);
+        } else if (strcmp(argv[i], "--run") == 0) {
+            run = 1;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            run = 1;
+            jit = 1;
+        } else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "register") == 0) {
+                target = TARGET_REGISTER;
+            } else if (strcmp(argv[i], "stack") != 0) {
+                printf("Error: unknown target %s (stack or register)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            modulePath = argv[++i];
+        } else if (strcmp(argv[i], "--exec") == 0 && i + 1 < argc) {
+            execPath = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache.dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache.limit = atoll(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            cacheStats = 1;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            formats[ARTIFACT_TOKENS] = FORMAT_NONE;
+            formats[ARTIFACT_SYMBOLS] = FORMAT_NONE;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            for (int k = 0; k < ARTIFACT_COUNT; k++) formats[k] = FORMAT_JSON;
+        } else if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+            if (!parse_formats(argv[++i], formats)) {
+                printf("Error: bad --emit list %s (artifact=format: tokens, code, symbols, errors;"
+                       " text, json, none, binary)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--stats-json") == 0) {
+            stats = 2;
+        } else if (strcmp(argv[i], "--vm-stats") == 0) {
+            vmStats = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[i], "--server") == 0) {
+            server = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lex-threads") == 0 && i + 1 < argc) {
+            lexThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out-dir") == 0 && i + 1 < argc) {
+            outDir = argv[++i];
+        } else {
+            InputFile = argv[i];
+            paths[pathCount++] = argv[i];
+        }
+    }
+
+    if (server) {
+        return run_server(stats);
+    }
+    if (jit && target == TARGET_REGISTER) {
+        printf("Error: --jit only runs stack code\n");
+        return 1;
+    }
+    if (modulePath && (batch || target == TARGET_REGISTER)) {
+        printf("Error: -o writes the stack code of a single program\n");
+        return 1;
+    }
+    if (formats[ARTIFACT_CODE] == FORMAT_BINARY &&
+        (target == TARGET_REGISTER || formats[ARTIFACT_TOKENS] != FORMAT_NONE ||
+         formats[ARTIFACT_SYMBOLS] != FORMAT_NONE)) {
+        printf("Error: code=binary writes a module of stack code; set tokens=none,symbols=none\n");
+        return 1;
+    }
+    if (stats && !PL0_STATS) {
+        printf("Error: --stats needs a build with PL0_STATS=1\n");
+        return 1;
+    }
+    if (stats && (batch || cache.dir || execPath)) {
+        printf("Error: --stats reports a single uncached compile\n");
+        return 1;
+    }
+    if (execPath) {
+        return exec_module(execPath, jit, vmStats);
+    }
+    if (cache.dir) {
+        struct stat st;
+        mkdir(cache.dir, 0755);
+        if (stat(cache.dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            printf("Error: cannot use %s as the cache directory\n", cache.dir);
+            return 1;
+        }
+    }
+
+    if (batch) {
+        int failed = run_batch(paths, pathCount, jobs, outDir, optLevel, target, cache.dir ? &cache : NULL, formats);
+        if (cache.dir && cacheStats) print_cache_stats(&cache);
+        return failed;
+    }
+
+    FILE *input = stdin;
+    if (InputFile) {
+        input = fopen(InputFile, "r");
+        if (!input) {
+            perror("Error opening file");
+            return 1;
+        }
+    } else {
+        streamInput = 1;
+    }
+
+    CompilerContext* ctx = compiler_create();
+    if (!ctx) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    compiler_set_optimization(ctx, optLevel);
+    compiler_set_target(ctx, target);
+    compiler_set_lex_threads(ctx, lexThreads);
+    CompileResult result;
+    int failed;
+
+    if (cache.dir && !streamInput && !(run && target == TARGET_REGISTER)) {
+        failed = compile_cached(&cache, ctx, input, optLevel, target, formats, run, jit, vmStats, modulePath);
+        if (cacheStats) print_cache_stats(&cache);
+        compiler_destroy(ctx);
+        fclose(input);
+        return failed;
+    }
+    if (streamInput) {
+        // Lexing is driven by the parser, one token at a time
+        failed = compile_stream(ctx, input, &result);
+    } else {
+        compiler_reset(ctx);
+        STATS_START(readClock);
+        load_source(ctx, input);
+        STATS_STOP(&ctx->stats, readClock, PHASE_READ);
+        failed = compile_loaded(ctx, &result);
+    }
+    STATS_START(outputClock);
+    if (modulePath && !failed) {
+        failed = write_module(modulePath, &result);
+    }
+    if (!run) {
+        print_listing(stdout, ctx, &result, !streamInput, formats);
+    } else if (failed) {
+        print_listing(stdout, ctx, &result, 0, formats);
+    }
+    STATS_STOP(&ctx->stats, outputClock, PHASE_OUTPUT);
+    if (run && !failed) {
+        failed = run_program(&result, jit, vmStats);
+    }
+    if (stats) print_stats(result.stats, stats == 2);
+
+    compiler_destroy(ctx);
+    if (input != stdin) fclose(input);
+    return failed;
+}
+
+#endif
@@ -0,0 +1,334 @@
+// Sophia Kropivnitskaia and Harshika Jindal
+// Course: Systems Software
+// Semester: Summer 2025
+// HW 3 - Tiny PL/0 Compiler (Parser and Code Generator): library interface
+//
+// Build parsercodegen.c with -DPL0_NO_MAIN to embed the compiler. A
+// CompilerContext holds all state of a compile; it can be reused for any
+// number of compiles, and separate contexts may be used from separate
+// threads at the same time. Nothing is printed, and running out of memory
+// is reported in the results of the call rather than ending the process.
+
+#ifndef PARSERCODEGEN_H
+#define PARSERCODEGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_ID_LEN 11
+
+// Virtual machine opcodes
+typedef enum {
+    LIT = 1, OPR = 2, LOD = 3, STO = 4, CAL = 5, INC = 6, JMP = 7, JPC = 8, SYS = 9
+} opCode;
+
+// Operations selected by the M field of OPR
+enum {
+    OPR_RTN = 0, OPR_NEG = 1, OPR_ADD = 2, OPR_SUB = 3, OPR_MUL = 4, OPR_DIV = 5, OPR_ODD = 6,
+    OPR_EQL = 8, OPR_NEQ = 9, OPR_LSS = 10, OPR_LEQ = 11, OPR_GTR = 12, OPR_GEQ = 13
+};
+
+// Virtual machine instruction, packed into 32 bits: op in bits 0-4, L in
+// bits 5-7 and M, two's complement, in bits 8-31. Binary modules hold code
+// in this layout.
+//
+// L is an absolute lexical level, the main block's being 0: LOD and STO
+// address the frame of the innermost active block at level L, and CAL L M
+// calls the procedure at M whose block is at level L. OPR 0 0 returns from
+// a procedure.
+typedef struct {
+    unsigned op : 5;  // opcode
+    unsigned L : 3;   // lexicographical level
+    int M : 24;       // modifier
+} instruction;
+
+// Deepest level L can hold, so procedures nest at most this deep
+#define INSTRUCTION_L_MAX 7
+
+// Range of M. Literals outside it are not folded, and programs of more
+// than INSTRUCTION_M_MAX + 1 instructions (8M) are rejected: jump targets
+// are M operands.
+#define INSTRUCTION_M_MIN (-(1 << 23))
+#define INSTRUCTION_M_MAX ((1 << 23) - 1)
+
+// Address of a variable -O2 removed, which has no frame slot
+#define ADDR_REMOVED -1
+
+// Symbol table structure
+typedef struct {
+    int kind;       // const = 1, var = 2, procedure = 3
+    char name[MAX_ID_LEN + 1];  // name up to 11 chars
+    int val;        // number (ASCII value)
+    int level;      // L level of the block declaring it
+    int addr;       // M address; a procedure's first instruction; ADDR_REMOVED
+                    // for a variable the optimizer found unused
+    int mark;       // to indicate unavailable or deleted
+    int id;         // name ID the lexer interned name as
+    int shadow;     // outer symbol hidden by this one, or -1
+} symbol;
+
+// Error handling
+typedef struct {
+    int line;       // -1 when the error is at the end of input
+    int column;
+    int code;       // index into error_messages for syntax errors, -1 for lexical errors
+    char message[100];
+} Error;
+
+// Register bytecode opcodes. Operands name cells of one register file
+// holding the frame slots of the variables, then temporaries, then
+// constants; d is the destination or, for jumps, the target instruction.
+typedef enum {
+    REG_MOV = 1,   // d := a
+    REG_NEG,       // d := -a
+    REG_ADD,       // d := a + b
+    REG_SUB,
+    REG_MUL,
+    REG_DIV,
+    REG_JMP,       // jump to d
+    REG_JEQ,       // jump to d if a = b
+    REG_JNE,
+    REG_JLT,
+    REG_JLE,
+    REG_JGT,
+    REG_JGE,
+    REG_JODD,      // jump to d if a is odd
+    REG_JEVEN,
+    REG_READ,      // read into d
+    REG_WRITE,     // write a
+    REG_HALT
+} regOpCode;
+
+typedef struct {
+    int op;
+    int d;
+    int a;
+    int b;
+} RegInstruction;
+
+// Register bytecode of a program: registers[constantBase + i] starts out
+// holding constants[i], every other register 0
+typedef struct {
+    const RegInstruction* code;
+    int length;
+    int registers;
+    const int* constants;
+    int constantBase;
+    int constantCount;
+} RegProgram;
+
+// Code generator targets
+enum {
+    TARGET_STACK = 0,    // instruction code[] for the PL/0 stack machine
+    TARGET_REGISTER = 1  // RegProgram for reg_run()
+};
+
+typedef struct CompilerContext CompilerContext;
+
+// Optimizer passes, for compiler_set_passes(). The first four work on the
+// syntax tree before code generation; the peephole pass on the code.
+enum {
+    PASS_CONSTPROP = 1,  // constant propagation and folding
+    PASS_CSE = 2,        // common subexpression elimination
+    PASS_DSE = 4,        // dead store elimination
+    PASS_SLOTS = 8,      // share frame slots between variables
+    PASS_PEEPHOLE = 16,
+    PASS_ALL = 31
+};
+
+// Effect of one pass: instruction counts before and after it, or frame
+// sizes for PASS_SLOTS
+typedef struct {
+    const char* name;
+    int before;
+    int after;
+} PassStat;
+
+// Phases timed by CompileStats. The library times lexing (part of parsing
+// when the source is streamed) and parsing with code generation; reading
+// the source and writing the output are up to the caller.
+enum { PHASE_READ, PHASE_LEX, PHASE_PARSE, PHASE_OUTPUT, PHASE_COUNT };
+
+// Counters of a compile. All zero when the compiler is built with
+// -DPL0_STATS=0, which leaves out the hooks that collect them.
+typedef struct {
+    double wall[PHASE_COUNT];  // seconds
+    double cpu[PHASE_COUNT];   // seconds of the compiling thread
+    int tokens;
+    int symbols;
+    int names;                 // distinct identifiers
+    int instructions;          // as generated, after optimization
+    long long lookups;         // find_symbol() calls
+    long long probes;          // name pool slots examined by the lexer's interning
+    int maxDepth;              // deepest expression nesting: 1 + parentheses open
+    size_t arenaBytes;         // memory held by the context
+} CompileStats;
+
+// Output of a compile. The arrays belong to the context and stay valid until
+// its next compile or compiler_destroy().
+typedef struct {
+    const instruction* code;
+    int codeLength;
+    int codeSaved;      // instructions removed by the optimizer
+    const PassStat* passes;  // in the order they ran
+    int passCount;
+    RegProgram reg;     // with TARGET_REGISTER, instead of code
+    const symbol* symbols;
+    int symbolCount;
+    const Error* errors;
+    int errorCount;
+    const CompileStats* stats;
+} CompileResult;
+
+CompilerContext* compiler_create();
+void compiler_destroy(CompilerContext* ctx);
+
+// 0 (the default) keeps the code exactly as emitted; 1 runs the peephole
+// optimizer over it; 2 runs every pass. Applies to every later compile
+// with ctx.
+void compiler_set_optimization(CompilerContext* ctx, int level);
+
+// Select the passes to run by PASS_* mask instead of by level
+void compiler_set_passes(CompilerContext* ctx, int passes);
+
+// TARGET_STACK (the default) or TARGET_REGISTER, for every later compile.
+// The peephole pass only applies to the stack target.
+void compiler_set_target(CompilerContext* ctx, int target);
+
+// Lex sources of several megabytes on up to threads threads, one chunk
+// of lines each; 0 takes one per core. 1, the default, lexes on the
+// calling thread. The tokens and errors are the same either way, and
+// streamed compiles always lex on the calling thread.
+void compiler_set_lex_threads(CompilerContext* ctx, int threads);
+
+// Compile len bytes of PL/0 source. Returns 0 on success and 1 if the
+// program has errors, in which case result->errors describes them. A
+// source too large for int offsets, or a compile that runs out of memory,
+// is reported as a single error at the end of input.
+int compile_buffer(CompilerContext* ctx, const char* src, size_t len, CompileResult* result);
+
+// Compile a program read from input, lexing it as a stream while parsing.
+// Returns as compile_buffer() does, with the same errors: a lexical error
+// anywhere in the input, even after the program, drops the syntax errors
+// and stops the parse, as compile_buffer() does not parse such a program.
+int compile_stream(CompilerContext* ctx, FILE* input, CompileResult* result);
+
+// Documents, for editors: a program kept between edits, lexed and parsed
+// again only around each change. Lines and columns are 1-based and count
+// bytes, as in Error.
+typedef struct Document Document;
+
+// Work done by a document's edits
+typedef struct {
+    long long edits;
+    long long fullParses;        // including those of document_set_text()
+    long long tokensLexed;       // with the old token each lex stopped at
+    long long statementsParsed;  // by reparses from a statement boundary
+} DocumentStats;
+
+Document* document_create();
+void document_destroy(Document* doc);
+
+// Replace the whole text. Returns 1, changing nothing, if len does not fit
+// an int, and 1 with the document left empty if memory runs out.
+int document_set_text(Document* doc, const char* text, size_t len);
+
+// Replace the text from startLine:startColumn up to endLine:endColumn
+// with len bytes of text. Positions past the end of a line or of the text
+// stand for that end. Returns 1, changing nothing, if the text would
+// outgrow an int, and 1 with the document left empty if memory runs out.
+int document_edit(Document* doc, int startLine, int startColumn, int endLine, int endColumn,
+                  const char* text, size_t len);
+
+// Lexical and syntax errors of the current text, the ones compile_buffer()
+// reports before code generation. The array is valid until the next change.
+// If memory runs out, the one error is "out of memory".
+int document_diagnostics(Document* doc, const Error** errors);
+
+const DocumentStats* document_stats(const Document* doc);
+
+// How a run of the virtual machine ended
+enum {
+    VM_HALTED = 0,       // the program ran to SYS HALT
+    VM_BAD_CODE,         // the code failed the check done before running
+    VM_DIVIDE_BY_ZERO,
+    VM_BAD_INPUT,        // SYS READ found no integer
+    VM_STACK_OVERFLOW,   // procedure calls nested too deeply
+    VM_OUT_OF_MEMORY     // the code or its stack could not be allocated
+};
+
+typedef struct {
+    int status;          // VM_* code
+    int pc;              // instruction that stopped the run
+    long long steps;     // instructions executed
+} RunResult;
+
+// Run code in the built-in virtual machine. SYS READ takes integers from
+// in and SYS WRITE prints to out. Returns 0 if the program halted normally.
+int vm_run(const instruction* code, int length, FILE* in, FILE* out, RunResult* result);
+
+// Run register bytecode, with the same input, output and results as
+// vm_run()
+int reg_run(const RegProgram* program, FILE* in, FILE* out, RunResult* result);
+
+// Same as vm_run(), but translates the code to native x86-64 first. Falls
+// back to vm_run() on other targets or where memory cannot be made
+// executable.
+int vm_run_jit(const instruction* code, int length, FILE* in, FILE* out, RunResult* result);
+
+// Binary modules. A module file is a 40-byte header of little-endian
+// 32-bit fields
+//     "PL0M", version (16 bits), header size (16 bits), CRC-32 of every
+//     byte after it (the rest of the header included), then offset and
+//     count of the code, offset and count of the symbols, offset and size
+//     of the string pool, and the file size
+// followed by the code as packed instructions, the symbols as ModuleSymbol
+// records and the string pool of their NUL-terminated names. Sections are
+// 4-byte aligned.
+#define MODULE_VERSION 2
+
+typedef struct {
+    uint32_t name;  // offset of the name in the string pool
+    int32_t kind;
+    int32_t val;
+    int32_t level;
+    int32_t addr;
+    int32_t mark;
+} ModuleSymbol;
+
+// A module opened by module_open(). On little-endian hosts the arrays
+// point straight into the mapped file.
+typedef struct {
+    const instruction* code;
+    int codeLength;
+    const ModuleSymbol* symbols;
+    int symbolCount;
+    const char* strings;
+    int stringSize;
+    void* map;          // the mapping, and its size
+    size_t mapSize;
+    void* copy;         // decoded sections where the file could not be used in place
+} Module;
+
+// Results of module_open()
+enum {
+    MODULE_OK = 0,
+    MODULE_IO_ERROR,     // see errno
+    MODULE_BAD_FORMAT,   // not a module, or sections out of bounds
+    MODULE_BAD_VERSION,
+    MODULE_BAD_CHECKSUM
+};
+
+// Write the code and symbols of a stack target compile as a module.
+// Returns 0 on success, and nonzero for a compile with no stack code or
+// if memory runs out.
+int module_write(FILE* out, const CompileResult* result);
+
+// Map a module file and check it. Returns a MODULE_* code, MODULE_IO_ERROR
+// with errno set to ENOMEM if memory runs out; on success the module must
+// be released with module_close().
+int module_open(const char* path, Module* module);
+void module_close(Module* module);
+
+#endif